@@ -517,6 +517,9 @@ extern void _unaligned_strided_byte_copy(char *dst, npy_intp outstrides,
                                          npy_intp N, int elsize, 
                                          NpyArray_Descr* unused);
 extern void _strided_byte_swap(void *p, npy_intp stride, npy_intp n, int size);
+extern int _tiled_strided_copy(char *dst, npy_intp *dstrides,
+                               char *src, npy_intp *sstrides,
+                               npy_intp *dims, int nd, int elsize);
 
 #if defined(__cplusplus)
 }
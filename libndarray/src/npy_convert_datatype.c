@@ -66,9 +66,10 @@ static int
 _broadcast_cast(NpyArray *out, NpyArray *in,
                 NpyArray_VectorUnaryFunc *castfunc, int iswap, int oswap)
 {
-    int delsize, selsize, maxaxis, i, N;
-    NpyArrayMultiIterObject *multi;
-    npy_intp maxdim, ostrides, istrides;
+    int delsize, selsize, i, N;
+    NpyArrayLoopIterObject *it;
+    NpyArray *ops[2];
+    int opflags[2] = {NPY_LOOPITER_WRITE, NPY_LOOPITER_READ};
     char *buffers[2];
     NpyArray_CopySwapNFunc *ocopyfunc, *icopyfunc;
     char *obptr;
@@ -76,43 +77,34 @@ _broadcast_cast(NpyArray *out, NpyArray *in,
 
     delsize = NpyArray_ITEMSIZE(out);
     selsize = NpyArray_ITEMSIZE(in);
-    multi = NpyArray_MultiIterFromArrays(NULL, 0, 2, out, in);
-    if (multi == NULL) {
+    ops[0] = out;
+    ops[1] = in;
+    it = NpyArray_LoopIterNew(2, ops, opflags, NULL, 0, 0);
+    if (it == NULL) {
         return -1;
     }
 
-    if (multi->size != NpyArray_SIZE(out)) {
+    if (it->size != NpyArray_SIZE(out)) {
         NpyErr_SetString(NpyExc_ValueError,
                          "array dimensions are not compatible for copy");
-        Npy_DECREF(multi);
+        Npy_DECREF(it);
         return -1;
     }
 
     icopyfunc = in->descr->f->copyswapn;
     ocopyfunc = out->descr->f->copyswapn;
-    maxaxis = NpyArray_RemoveSmallest(multi);
-    if (maxaxis < 0) {
-        /* cast 1 0-d array to another */
-        N = 1;
-        maxdim = 1;
-        ostrides = delsize;
-        istrides = selsize;
-    }
-    else {
-        maxdim = multi->dimensions[maxaxis];
-        N = (int) (NpyArray_MIN(maxdim, NPY_BUFSIZE));
-        ostrides = multi->iters[0]->strides[maxaxis];
-        istrides = multi->iters[1]->strides[maxaxis];
-
-    }
+    /* Unbuffered, so every inner loop is the whole innermost dimension. */
+    N = (int) (NpyArray_MIN(it->count, NPY_BUFSIZE));
     buffers[0] = malloc(N*delsize);
     if (buffers[0] == NULL) {
+        Npy_DECREF(it);
         NpyErr_MEMORY;
         return -1;
     }
     buffers[1] = malloc(N*selsize);
     if (buffers[1] == NULL) {
         free(buffers[0]);
+        Npy_DECREF(it);
         NpyErr_MEMORY;
         return -1;
     }
@@ -129,23 +121,21 @@ _broadcast_cast(NpyArray *out, NpyArray *in,
     }
 #endif
 
-    while (multi->index < multi->size) {
-        _strided_buffered_cast(multi->iters[0]->dataptr,
-                               ostrides,
+    while (NpyArray_LoopIter_NOTDONE(it)) {
+        _strided_buffered_cast(it->dataptrs[0], it->strides[0],
                                delsize, oswap, ocopyfunc,
-                               multi->iters[1]->dataptr,
-                               istrides,
+                               it->dataptrs[1], it->strides[1],
                                selsize, iswap, icopyfunc,
-                               maxdim, buffers, N,
+                               it->count, buffers, N,
                                castfunc, out, in);
-        NpyArray_MultiIter_NEXT(multi);
+        NpyArray_LoopIterNext(it);
     }
 #if NPY_ALLOW_THREADS
     if (NpyArray_ISNUMBER(in) && NpyArray_ISNUMBER(out)) {
         NPY_END_THREADS;
     }
 #endif
-    Npy_DECREF(multi);
+    Npy_DECREF(it);
     if (NpyDataType_REFCHK(in->descr)) {
         obptr = buffers[1];
         for (i = 0; i < N; i++, obptr+=selsize) {
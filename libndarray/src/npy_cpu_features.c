@@ -0,0 +1,315 @@
+/*
+ *  npy_cpu_features.c -
+ *
+ *  Run time detection of the instruction sets supported by the processor
+ *  and selection of the matching kernels, and detection of the cache
+ *  sizes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "npy_config.h"
+#include "npy_api.h"
+#include "npy_cpu.h"
+#include "npy_cpu_features.h"
+
+#if defined(NPY_CPU_X86) || defined(NPY_CPU_AMD64)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__)
+#include <cpuid.h>
+#endif
+#endif
+
+
+/* Defined in npy_loops.c.src and npy_arraytypes.c.src */
+extern void npy_loops_cpu_dispatch(int level);
+extern void npy_arraytypes_cpu_dispatch(int level);
+
+
+static int npy_cpu_detected = NPY_CPU_BASELINE;
+static int npy_cpu_level = NPY_CPU_BASELINE;
+
+static const char *npy_cpu_level_names[NPY_CPU_NLEVELS] = {
+    "baseline", "sse42", "avx2", "avx512"
+};
+
+/* Data cache sizes in bytes by level, 0 where unknown */
+static npy_intp npy_cpu_cache[NPY_CPU_MAXCACHE + 1];
+
+
+#if (defined(NPY_CPU_X86) || defined(NPY_CPU_AMD64)) && \
+    (defined(_MSC_VER) || defined(__GNUC__))
+
+static void
+npy_cpuid(unsigned int leaf, unsigned int subleaf, unsigned int *regs)
+{
+#if defined(_MSC_VER)
+    int r[4];
+
+    __cpuidex(r, (int)leaf, (int)subleaf);
+    regs[0] = r[0];
+    regs[1] = r[1];
+    regs[2] = r[2];
+    regs[3] = r[3];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+
+/* Returns the register state enabled by the operating system. */
+static npy_uint64
+npy_xgetbv(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+
+    /* xgetbv, spelled out for assemblers which do not know it */
+    __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0"
+                         : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((npy_uint64)edx << 32) | eax;
+#endif
+}
+
+
+static int
+npy_cpu_probe(void)
+{
+    unsigned int r[4];
+    unsigned int maxleaf, ecx1, ebx7 = 0;
+    npy_uint64 xcr0 = 0;
+    int level = NPY_CPU_BASELINE;
+
+    npy_cpuid(0, 0, r);
+    maxleaf = r[0];
+    if (maxleaf < 1) {
+        return level;
+    }
+    npy_cpuid(1, 0, r);
+    ecx1 = r[2];
+    if (maxleaf >= 7) {
+        npy_cpuid(7, 0, r);
+        ebx7 = r[1];
+    }
+    /* OSXSAVE: the registers are saved on context switches */
+    if (ecx1 & (1u << 27)) {
+        xcr0 = npy_xgetbv();
+    }
+
+    /* SSE4.2 and POPCNT */
+    if ((ecx1 & (1u << 20)) && (ecx1 & (1u << 23))) {
+        level = NPY_CPU_SSE42;
+    }
+    else {
+        return level;
+    }
+    /* AVX, FMA3 and AVX2, with the YMM state enabled */
+    if ((ecx1 & (1u << 28)) && (ecx1 & (1u << 12)) &&
+        (ebx7 & (1u << 5)) && (xcr0 & 0x6) == 0x6) {
+        level = NPY_CPU_AVX2;
+    }
+    else {
+        return level;
+    }
+    /* AVX-512 F, DQ, CD, BW and VL, with the ZMM state enabled */
+    if ((ebx7 & (1u << 16)) && (ebx7 & (1u << 17)) &&
+        (ebx7 & (1u << 28)) && (ebx7 & (1u << 30)) &&
+        (ebx7 & (1u << 31)) && (xcr0 & 0xe6) == 0xe6) {
+        level = NPY_CPU_AVX512;
+    }
+    return level;
+}
+
+
+/*
+ * Fills in the cache sizes from the deterministic cache parameters of
+ * leaf 4 (Intel) or 0x8000001D (AMD), or failing that from the older
+ * AMD leaves 0x80000005 and 0x80000006.
+ */
+static void
+npy_cpu_probe_caches(npy_intp *cache)
+{
+    unsigned int r[4];
+    unsigned int leaves[2] = {4, 0x8000001D};
+    unsigned int maxleaf, maxext, sub;
+    int i, found = 0;
+
+    npy_cpuid(0, 0, r);
+    maxleaf = r[0];
+    npy_cpuid(0x80000000, 0, r);
+    maxext = r[0];
+
+    for (i = 0; i < 2 && !found; i++) {
+        if (leaves[i] > (leaves[i] & 0x80000000 ? maxext : maxleaf)) {
+            continue;
+        }
+        for (sub = 0; sub < 16; sub++) {
+            unsigned int type, level;
+            npy_intp size;
+
+            npy_cpuid(leaves[i], sub, r);
+            type = r[0] & 0x1f;
+            if (type == 0) {
+                break;
+            }
+            level = (r[0] >> 5) & 0x7;
+            /* Data or unified caches */
+            if ((type != 1 && type != 3) || level < 1 ||
+                level > NPY_CPU_MAXCACHE) {
+                continue;
+            }
+            size = (npy_intp)((r[1] >> 22) + 1) *
+                (((r[1] >> 12) & 0x3ff) + 1) *
+                ((r[1] & 0xfff) + 1) * ((npy_intp)r[2] + 1);
+            cache[level] = size;
+            found = 1;
+        }
+    }
+    if (!found && maxext >= 0x80000006) {
+        npy_cpuid(0x80000005, 0, r);
+        cache[1] = (npy_intp)(r[2] >> 24) * 1024;
+        npy_cpuid(0x80000006, 0, r);
+        cache[2] = (npy_intp)(r[2] >> 16) * 1024;
+        cache[3] = (npy_intp)(r[3] >> 18) * 512 * 1024;
+    }
+}
+
+#else
+
+static int
+npy_cpu_probe(void)
+{
+    return NPY_CPU_BASELINE;
+}
+
+
+static void
+npy_cpu_probe_caches(npy_intp *cache)
+{
+}
+
+#endif
+
+
+/*
+ * Fills in the cache sizes the processor did not report from the
+ * operating system, where it provides them.
+ */
+static void
+npy_cpu_os_caches(npy_intp *cache)
+{
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && \
+    defined(_SC_LEVEL3_CACHE_SIZE)
+    int names[NPY_CPU_MAXCACHE + 1] = {0, _SC_LEVEL1_DCACHE_SIZE,
+                                       _SC_LEVEL2_CACHE_SIZE,
+                                       _SC_LEVEL3_CACHE_SIZE};
+    long size;
+    int i;
+
+    for (i = 1; i <= NPY_CPU_MAXCACHE; i++) {
+        if (cache[i] == 0 && (size = sysconf(names[i])) > 0) {
+            cache[i] = size;
+        }
+    }
+#endif
+}
+
+
+/*
+ * Returns the highest instruction set level supported by the processor.
+ */
+NDARRAY_API int
+NpyCPU_DetectedLevel(void)
+{
+    return npy_cpu_detected;
+}
+
+
+/*
+ * Returns the instruction set level the kernels are currently chosen
+ * for.
+ */
+NDARRAY_API int
+NpyCPU_GetLevel(void)
+{
+    return npy_cpu_level;
+}
+
+
+/*
+ * Switches the kernels over to the given instruction set level, limited
+ * to what the processor supports, and returns the level actually used.
+ * Not thread safe: must not be called while other threads are running
+ * loops.
+ */
+NDARRAY_API int
+NpyCPU_SetLevel(int level)
+{
+    if (level < NPY_CPU_BASELINE) {
+        level = NPY_CPU_BASELINE;
+    }
+    if (level > npy_cpu_detected) {
+        level = npy_cpu_detected;
+    }
+    npy_cpu_level = level;
+    npy_loops_cpu_dispatch(level);
+    npy_arraytypes_cpu_dispatch(level);
+    return level;
+}
+
+
+NDARRAY_API const char *
+NpyCPU_LevelName(int level)
+{
+    if (level < 0 || level >= NPY_CPU_NLEVELS) {
+        return NULL;
+    }
+    return npy_cpu_level_names[level];
+}
+
+
+/*
+ * Returns the size in bytes of the data cache at the given level, from 1
+ * to NPY_CPU_MAXCACHE, or 0 if it is not known.
+ */
+NDARRAY_API npy_intp
+NpyCPU_CacheSize(int level)
+{
+    if (level < 1 || level > NPY_CPU_MAXCACHE) {
+        return 0;
+    }
+    return npy_cpu_cache[level];
+}
+
+
+/*
+ * Called once from npy_initlib.
+ */
+void
+npy_cpu_init(void)
+{
+    int level, i;
+    char *env;
+
+    npy_cpu_detected = npy_cpu_probe();
+    level = npy_cpu_detected;
+    npy_cpu_probe_caches(npy_cpu_cache);
+    npy_cpu_os_caches(npy_cpu_cache);
+
+    env = getenv("NPY_CPU_LEVEL");
+    if (env != NULL) {
+        for (i = 0; i < NPY_CPU_NLEVELS; i++) {
+            if (strcmp(env, npy_cpu_level_names[i]) == 0 && i < level) {
+                level = i;
+            }
+        }
+    }
+    NpyCPU_SetLevel(level);
+}
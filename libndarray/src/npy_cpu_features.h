@@ -0,0 +1,75 @@
+#ifndef _NPY_CPU_FEATURES_H_
+#define _NPY_CPU_FEATURES_H_
+
+#include "npy_common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+ * Run time selection of instruction set specific kernels.  The library
+ * is compiled for the baseline instruction set of the target; kernels
+ * which have versions for newer instruction sets are switched over in
+ * npy_initlib once the processor has been probed.  The level can be
+ * lowered for testing with NpyCPU_SetLevel or the NPY_CPU_LEVEL
+ * environment variable ("baseline", "sse42", "avx2" or "avx512").
+ */
+
+/* Instruction set levels, each including the ones below it */
+enum NPY_CPU_LEVEL {
+    NPY_CPU_BASELINE = 0,
+    NPY_CPU_SSE42,
+    NPY_CPU_AVX2,       /* AVX, AVX2 and FMA3 */
+    NPY_CPU_AVX512,     /* AVX-512 F, CD, BW, DQ and VL */
+    NPY_CPU_NLEVELS
+};
+
+
+NDARRAY_API int
+NpyCPU_DetectedLevel(void);
+NDARRAY_API int
+NpyCPU_GetLevel(void);
+NDARRAY_API int
+NpyCPU_SetLevel(int level);
+NDARRAY_API const char *
+NpyCPU_LevelName(int level);
+
+/* Highest cache level reported by NpyCPU_CacheSize */
+#define NPY_CPU_MAXCACHE 3
+
+NDARRAY_API npy_intp
+NpyCPU_CacheSize(int level);
+
+void
+npy_cpu_init(void);
+
+
+/*
+ * Sets slot to the best of the versions in impls, which is indexed by
+ * level and holds NULL for levels without a version of their own.
+ * impls[NPY_CPU_BASELINE] must be set.  A slot holding a function other
+ * than one of impls, for example a cast function registered by the
+ * interface, is left alone.
+ */
+#define NPY_CPU_INSTALL(slot, impls, level) do {                        \
+        int k_, known_ = 0;                                             \
+        for (k_ = 0; k_ < NPY_CPU_NLEVELS; k_++) {                      \
+            if ((slot) == (impls)[k_]) {                                \
+                known_ = 1;                                             \
+            }                                                           \
+        }                                                               \
+        if (known_) {                                                   \
+            for (k_ = (level); (impls)[k_] == NULL; k_--) {             \
+            }                                                           \
+            (slot) = (impls)[k_];                                       \
+        }                                                               \
+    } while (0)
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -11,6 +11,7 @@
 #include "npy_api.h"
 #include "npy_arrayobject.h"
 #include "npy_internal.h"
+#include "npy_simd.h"
 
 
 /* TODO: Remove these declarations once PyArray_INCREF, etc refactored. */
@@ -296,6 +297,194 @@ npy_byte_swap_vector(void *p, npy_intp n, int size)
 }
 
 
+/*
+ * Edge length, in elements, of the square tiles _tiled_strided_copy
+ * works in.  One tile of the source and one of the destination stay in
+ * the L1 cache for elements of up to 8 bytes.
+ */
+#define NPY_COPY_TILE 32
+
+#define _ABS_STRIDE(s) ((s) < 0 ? -(s) : (s))
+
+/*
+ * Copies an na by nb block whose elements are at dst + i*dsa + j*dsb
+ * and src + i*ssa + j*ssb.
+ */
+static void
+_copy_block(char *dst, npy_intp dsa, npy_intp dsb,
+            char *src, npy_intp ssa, npy_intp ssb,
+            npy_intp na, npy_intp nb, int elsize)
+{
+    npy_intp i, j;
+
+#define _BLOCK_MOVE(_type_)                                     \
+    for (i = 0; i < na; i++) {                                  \
+        for (j = 0; j < nb; j++) {                              \
+            *(_type_ *)(dst + i*dsa + j*dsb) =                  \
+                *(_type_ *)(src + i*ssa + j*ssb);               \
+        }                                                       \
+    }                                                           \
+    return
+
+    switch(elsize) {
+        case 8:
+            _BLOCK_MOVE(npy_int64);
+        case 4:
+            _BLOCK_MOVE(npy_int32);
+        case 1:
+            _BLOCK_MOVE(npy_int8);
+        case 2:
+            _BLOCK_MOVE(npy_int16);
+        default:
+            for (i = 0; i < na; i++) {
+                for (j = 0; j < nb; j++) {
+                    memcpy(dst + i*dsa + j*dsb, src + i*ssa + j*ssb, elsize);
+                }
+            }
+    }
+#undef _BLOCK_MOVE
+}
+
+/*
+ * Copies one tile, where the destination is contiguous along a (the i
+ * index) and the source along b (the j index) whenever dsa and ssb are
+ * the element size.  In that case 4x4 blocks of 4-byte and 2x2 blocks
+ * of 8-byte elements are transposed in registers.
+ */
+static void
+_copy_tile(char *dst, npy_intp dsa, npy_intp dsb,
+           char *src, npy_intp ssa, npy_intp ssb,
+           npy_intp na, npy_intp nb, int elsize)
+{
+    npy_intp i = 0, j = 0;
+
+#if defined(NPY_HAVE_SSE2_INTRINSICS)
+    if (elsize == 4 && dsa == 4 && ssb == 4) {
+        for (i = 0; i + 4 <= na; i += 4) {
+            for (j = 0; j + 4 <= nb; j += 4) {
+                char *s = src + i*ssa + j*4, *d = dst + i*4 + j*dsb;
+                __m128 r0 = _mm_loadu_ps((float *)s);
+                __m128 r1 = _mm_loadu_ps((float *)(s + ssa));
+                __m128 r2 = _mm_loadu_ps((float *)(s + 2*ssa));
+                __m128 r3 = _mm_loadu_ps((float *)(s + 3*ssa));
+
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                _mm_storeu_ps((float *)d, r0);
+                _mm_storeu_ps((float *)(d + dsb), r1);
+                _mm_storeu_ps((float *)(d + 2*dsb), r2);
+                _mm_storeu_ps((float *)(d + 3*dsb), r3);
+            }
+        }
+    }
+    else if (elsize == 8 && dsa == 8 && ssb == 8) {
+        for (i = 0; i + 2 <= na; i += 2) {
+            for (j = 0; j + 2 <= nb; j += 2) {
+                char *s = src + i*ssa + j*8, *d = dst + i*8 + j*dsb;
+                __m128d r0 = _mm_loadu_pd((double *)s);
+                __m128d r1 = _mm_loadu_pd((double *)(s + ssa));
+
+                _mm_storeu_pd((double *)d, _mm_unpacklo_pd(r0, r1));
+                _mm_storeu_pd((double *)(d + dsb), _mm_unpackhi_pd(r0, r1));
+            }
+        }
+    }
+#endif
+    /* Whatever the register transposes left: the right edge, then the bottom. */
+    if (j < nb) {
+        _copy_block(dst + j*dsb, dsa, dsb, src + j*ssb, ssa, ssb,
+                    i, nb - j, elsize);
+    }
+    _copy_block(dst + i*dsa, dsa, dsb, src + i*ssa, ssa, ssb,
+                na - i, nb, elsize);
+}
+
+/*
+ * Copies between two aligned arrays of the same shape and element size
+ * whose fastest varying axes differ, as in a transpose or a change from
+ * C to Fortran order.  Walking either array in its own order makes every
+ * access to the other one a cache (and often TLB) miss, so the two
+ * fastest axes are instead copied in square tiles which fit in cache.
+ *
+ * Returns 0 once copied, or 1 without copying if the arrays share their
+ * fastest axis, are too small to gain from tiling or overlap in memory,
+ * in which case the caller should use a plain strided copy.
+ */
+int
+_tiled_strided_copy(char *dst, npy_intp *dstrides,
+                    char *src, npy_intp *sstrides,
+                    npy_intp *dims, int nd, int elsize)
+{
+    npy_intp coord[NPY_MAXDIMS];
+    int outer[NPY_MAXDIMS];
+    int a = -1, b = -1, nouter = 0, k;
+    char *dlo = dst, *dhi = dst + elsize, *slo = src, *shi = src + elsize;
+    npy_intp i0, j0;
+
+    for (k = 0; k < nd; k++) {
+        npy_intp dext = dstrides[k] * (dims[k] - 1);
+        npy_intp sext = sstrides[k] * (dims[k] - 1);
+
+        if (dims[k] == 0) {
+            return 0;
+        }
+        if (dims[k] == 1) {
+            continue;
+        }
+        if (a < 0 || _ABS_STRIDE(dstrides[k]) < _ABS_STRIDE(dstrides[a])) {
+            a = k;
+        }
+        if (b < 0 || _ABS_STRIDE(sstrides[k]) < _ABS_STRIDE(sstrides[b])) {
+            b = k;
+        }
+        *(dext < 0 ? &dlo : &dhi) += dext;
+        *(sext < 0 ? &slo : &shi) += sext;
+    }
+    if (a < 0 || a == b ||
+        dims[a] < NPY_COPY_TILE || dims[b] < NPY_COPY_TILE ||
+        (dlo < shi && slo < dhi)) {
+        return 1;
+    }
+    for (k = 0; k < nd; k++) {
+        if (k != a && k != b) {
+            outer[nouter++] = k;
+        }
+        coord[k] = 0;
+    }
+
+    for (;;) {
+        for (i0 = 0; i0 < dims[a]; i0 += NPY_COPY_TILE) {
+            npy_intp na = NpyArray_MIN(NPY_COPY_TILE, dims[a] - i0);
+
+            for (j0 = 0; j0 < dims[b]; j0 += NPY_COPY_TILE) {
+                npy_intp nb = NpyArray_MIN(NPY_COPY_TILE, dims[b] - j0);
+
+                _copy_tile(dst + i0*dstrides[a] + j0*dstrides[b],
+                           dstrides[a], dstrides[b],
+                           src + i0*sstrides[a] + j0*sstrides[b],
+                           sstrides[a], sstrides[b], na, nb, elsize);
+            }
+        }
+        /* Step the remaining axes. */
+        for (k = nouter - 1; k >= 0; k--) {
+            int ax = outer[k];
+
+            if (++coord[ax] < dims[ax]) {
+                dst += dstrides[ax];
+                src += sstrides[ax];
+                break;
+            }
+            coord[ax] = 0;
+            dst -= dstrides[ax] * (dims[ax] - 1);
+            src -= sstrides[ax] * (dims[ax] - 1);
+        }
+        if (k < 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+
 static int
 _copy_from_same_shape(NpyArray *dest, NpyArray *src,
                       strided_copy_func_t myfunc, int swap)
@@ -304,8 +493,21 @@ _copy_from_same_shape(NpyArray *dest, NpyArray *src,
     npy_intp maxdim;
     NpyArrayIterObject *dit, *sit;
     NpyArray_Descr* descr;
+    int tiled;
     NPY_BEGIN_THREADS_DEF
 
+    if (!swap && myfunc == _strided_byte_copy) {
+        NPY_BEGIN_THREADS;
+        tiled = _tiled_strided_copy(dest->data, dest->strides,
+                                    src->data, src->strides,
+                                    dest->dimensions, dest->nd,
+                                    NpyArray_ITEMSIZE(dest)) == 0;
+        NPY_END_THREADS;
+        if (tiled) {
+            return 0;
+        }
+    }
+
     dit = NpyArray_IterAllButAxis(dest, &maxaxis);
     sit = NpyArray_IterAllButAxis(src, &maxaxis);
 
@@ -528,6 +730,26 @@ _flat_copyinto(NpyArray *dst, NpyArray *src, NPY_ORDER order)
         return 0;
     }
 
+    if (!NpyDataType_REFCHK(dst->descr) &&
+        NpyArray_SAFEALIGNEDCOPY(src) && NpyArray_SAFEALIGNEDCOPY(dst)) {
+        npy_intp dstrides[NPY_MAXDIMS];
+        int flags = 0, tiled;
+
+        npy_array_fill_strides(dstrides, src->dimensions, src->nd,
+                               dst->descr->elsize,
+                               (order == NPY_FORTRANORDER) ? NPY_FORTRAN : 0,
+                               &flags);
+        NPY_BEGIN_THREADS;
+        tiled = _tiled_strided_copy(dst->data, dstrides,
+                                    src->data, src->strides,
+                                    src->dimensions, src->nd,
+                                    dst->descr->elsize) == 0;
+        NPY_END_THREADS;
+        if (tiled) {
+            return 0;
+        }
+    }
+
     axis = NpyArray_NDIM(src)-1;
 
     if (order == NPY_FORTRANORDER) {
@@ -484,8 +484,8 @@ typedef enum {
  * Size of internal buffers used for alignment Make BUFSIZE a multiple
  * of sizeof(cdouble) -- ususally 16 so that ufunc buffers are aligned
  */
-#define NPY_MIN_BUFSIZE ((int)sizeof(cdouble))
-#define NPY_MAX_BUFSIZE (((int)sizeof(cdouble))*1000000)
+#define NPY_MIN_BUFSIZE ((int)sizeof(npy_cdouble))
+#define NPY_MAX_BUFSIZE (((int)sizeof(npy_cdouble))*1000000)
 #define NPY_BUFSIZE 10000
 /* #define NPY_BUFSIZE 80*/
 
@@ -0,0 +1,773 @@
+/*
+ *  npy_expr.c -
+ *
+ *  Blocked evaluation of element-wise expressions built from ufuncs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "npy_config.h"
+#include "npy_api.h"
+#include "npy_arrayobject.h"
+#include "npy_iterators.h"
+#include "npy_ufunc_object.h"
+#include "npy_threads.h"
+#include "npy_expr.h"
+#include "npy_internal.h"
+
+
+/* Defined in npy_ufunc_object.c */
+extern fpe_state_f fp_error_state;
+
+
+/* Alignment of the block buffers */
+#define NPY_EXPR_ALIGN NPY_BUFFER_ALIGN
+
+
+/* Evaluation state of one node */
+typedef struct {
+    int used;
+    int type;
+    int elsize;
+    /* Scalar kind if every input below the node is 0-d */
+    NPY_SCALARKIND scalar;
+    /* The values are cast, so must be contiguous or constant */
+    int contig;
+
+    /* Inputs */
+    int iter;
+    int copy;
+    int swap;
+    NpyArray_CopySwapNFunc *copyswapn;
+
+    /* Applications */
+    NpyUFuncGenericFunction function;
+    void *funcdata;
+    NpyArray_VectorUnaryFunc *cast[NPY_MAXARGS];
+    int castsize[NPY_MAXARGS];
+    char *castbuf[NPY_MAXARGS];
+
+    char *buffer;
+
+    /* Where the values of the current block are */
+    char *ptr;
+    npy_intp step;
+} expr_value;
+
+typedef struct {
+    NpyExprObject *self;
+    expr_value *vals;
+    int root;
+
+    /* The array written to, directly by the root node if direct */
+    NpyArray *ret;
+    int iout;
+    int direct;
+    int retsize;
+    int retswap;
+    NpyArray_CopySwapNFunc *retcopyswapn;
+    NpyArray_VectorUnaryFunc *retcast;
+    char *retbuf;
+
+    int errormask;
+    void *errobj;
+    int first;
+} expr_state;
+
+
+static void
+npy_expr_dealloc(NpyExprObject *self)
+{
+    int i;
+
+    assert(0 == self->nob_refcnt);
+
+    for (i = 0; i < self->nnodes; i++) {
+        Npy_XDECREF(self->nodes[i].ufunc);
+        Npy_XDECREF(self->nodes[i].array);
+    }
+    self->nob_magic_number = NPY_INVALID_MAGIC;
+    NpyArray_free(self);
+}
+
+NDARRAY_API NpyTypeObject NpyExpr_Type = {
+    (npy_destructor)npy_expr_dealloc,
+    NULL
+};
+
+
+/*
+ * Creates an empty expression.
+ */
+NDARRAY_API NpyExprObject *
+NpyExpr_New(void)
+{
+    NpyExprObject *self;
+
+    self = (NpyExprObject *)NpyArray_malloc(sizeof(NpyExprObject));
+    if (self == NULL) {
+        NpyErr_MEMORY;
+        return NULL;
+    }
+    NpyObject_Init(self, &NpyExpr_Type);
+    self->nnodes = 0;
+    self->ninputs = 0;
+    return self;
+}
+
+
+static int
+expr_add_node(NpyExprObject *self)
+{
+    NpyExprNode *node;
+
+    if (self->nnodes >= NPY_EXPR_MAXNODES) {
+        NpyErr_SetString(NpyExc_ValueError, "too many nodes in expression");
+        return -1;
+    }
+    node = &self->nodes[self->nnodes];
+    node->ufunc = NULL;
+    node->array = NULL;
+    return self->nnodes++;
+}
+
+
+/*
+ * Adds an input array to the expression and returns its node.  A
+ * reference to the array is kept until the expression is released.
+ * Inputs are broadcast against each other when the expression is
+ * evaluated.
+ */
+NDARRAY_API int
+NpyExpr_Input(NpyExprObject *self, NpyArray *array)
+{
+    int k;
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+    assert(NPY_VALID_MAGIC == array->nob_magic_number);
+
+    /* One iterator is needed for the output */
+    if (self->ninputs >= NPY_MAXARGS - 1) {
+        NpyErr_SetString(NpyExc_ValueError,
+                         "too many inputs in expression");
+        return -1;
+    }
+    if (NpyArray_ISFLEXIBLE(array) || NpyArray_ISOBJECT(array)) {
+        NpyErr_SetString(NpyExc_TypeError,
+                         "flexible and object arrays can not be used "
+                         "in expressions");
+        return -1;
+    }
+    k = expr_add_node(self);
+    if (k < 0) {
+        return -1;
+    }
+    Npy_INCREF(array);
+    self->nodes[k].array = array;
+    self->ninputs++;
+    return k;
+}
+
+
+/*
+ * Adds the application of ufunc to the nodes in args, one for each input
+ * of the ufunc, and returns the node of the result.
+ */
+NDARRAY_API int
+NpyExpr_Apply(NpyExprObject *self, NpyUFuncObject *ufunc, int *args)
+{
+    int i, k;
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+    assert(NPY_VALID_MAGIC == ufunc->nob_magic_number);
+
+    if (ufunc->nin < 1 || ufunc->nout != 1 || ufunc->core_enabled) {
+        NpyErr_SetString(NpyExc_ValueError,
+                         "only ufuncs with one output and no signature "
+                         "can be used in expressions");
+        return -1;
+    }
+    for (i = 0; i < ufunc->nin; i++) {
+        if (args[i] < 0 || args[i] >= self->nnodes) {
+            NpyErr_SetString(NpyExc_ValueError, "invalid expression node");
+            return -1;
+        }
+    }
+    k = expr_add_node(self);
+    if (k < 0) {
+        return -1;
+    }
+    Npy_INCREF(ufunc);
+    self->nodes[k].ufunc = ufunc;
+    for (i = 0; i < ufunc->nin; i++) {
+        self->nodes[k].args[i] = args[i];
+    }
+    return k;
+}
+
+
+/*
+ * Selects the inner loops and the casts of the nodes the root depends
+ * on.  Nodes only refer to nodes added before them, so a single pass in
+ * order sees the operands of each node first.
+ */
+static int
+expr_prepare(NpyExprObject *self, expr_value *vals, int root)
+{
+    NpyArray_Descr *descr;
+    int arg_types[NPY_MAXARGS];
+    NPY_SCALARKIND scalars[NPY_MAXARGS];
+    int i, k;
+
+    vals[root].used = 1;
+    for (k = root; k >= 0; k--) {
+        NpyUFuncObject *ufunc = self->nodes[k].ufunc;
+
+        if (vals[k].used && ufunc != NULL) {
+            for (i = 0; i < ufunc->nin; i++) {
+                vals[self->nodes[k].args[i]].used = 1;
+            }
+        }
+    }
+
+    for (k = 0; k <= root; k++) {
+        NpyExprNode *node = &self->nodes[k];
+        expr_value *v = &vals[k];
+
+        if (!v->used) {
+            continue;
+        }
+        if (node->ufunc == NULL) {
+            v->type = NpyArray_TYPE(node->array);
+            if (NpyArray_NDIM(node->array) == 0) {
+                v->scalar = NpyArray_ScalarKind(v->type, &node->array);
+            }
+            else {
+                v->scalar = NPY_NOSCALAR;
+            }
+            v->swap = !NpyArray_ISNOTSWAPPED(node->array);
+            v->copy = v->swap || !NpyArray_ISALIGNED(node->array);
+            continue;
+        }
+
+        v->scalar = NPY_BOOL_SCALAR;
+        for (i = 0; i < node->ufunc->nin; i++) {
+            arg_types[i] = vals[node->args[i]].type;
+            scalars[i] = vals[node->args[i]].scalar;
+            if (scalars[i] == NPY_NOSCALAR) {
+                v->scalar = NPY_NOSCALAR;
+            }
+        }
+        if (npy_ufunc_select_loop(node->ufunc, arg_types, scalars,
+                                  &v->function, &v->funcdata) < 0) {
+            return -1;
+        }
+        for (i = 0; i < node->ufunc->nargs; i++) {
+            if (NpyTypeNum_ISFLEXIBLE(arg_types[i]) ||
+                NpyTypeNum_ISOBJECT(arg_types[i])) {
+                NpyErr_SetString(NpyExc_TypeError,
+                                 "ufunc loops of flexible or object type "
+                                 "can not be used in expressions");
+                return -1;
+            }
+        }
+        v->type = arg_types[node->ufunc->nin];
+        if (v->scalar != NPY_NOSCALAR) {
+            v->scalar = NpyArray_ScalarKind(v->type, NULL);
+        }
+
+        for (i = 0; i < node->ufunc->nin; i++) {
+            expr_value *a = &vals[node->args[i]];
+
+            if (a->type == arg_types[i]) {
+                continue;
+            }
+            descr = NpyArray_DescrFromType(a->type);
+            v->cast[i] = NpyArray_GetCastFunc(descr, arg_types[i]);
+            Npy_DECREF(descr);
+            if (v->cast[i] == NULL) {
+                return -1;
+            }
+            descr = NpyArray_DescrFromType(arg_types[i]);
+            v->castsize[i] = descr->elsize;
+            Npy_DECREF(descr);
+            a->contig = 1;
+        }
+    }
+
+    for (k = 0; k <= root; k++) {
+        if (vals[k].used) {
+            descr = NpyArray_DescrFromType(vals[k].type);
+            vals[k].elsize = descr->elsize;
+            vals[k].copyswapn = descr->f->copyswapn;
+            Npy_DECREF(descr);
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Returns 1 if a and b share memory in any way other than being exactly
+ * the same view.
+ */
+static int
+expr_overlap(NpyArray *a, NpyArray *b)
+{
+    npy_intp lo[2], hi[2];
+    NpyArray *ap[2];
+    int i, j;
+
+    if (NpyArray_BYTES(a) == NpyArray_BYTES(b) &&
+        NpyArray_NDIM(a) == NpyArray_NDIM(b) &&
+        NpyArray_CompareLists(NpyArray_DIMS(a), NpyArray_DIMS(b),
+                              NpyArray_NDIM(a)) &&
+        NpyArray_CompareLists(NpyArray_STRIDES(a), NpyArray_STRIDES(b),
+                              NpyArray_NDIM(a)) &&
+        NpyArray_ITEMSIZE(a) == NpyArray_ITEMSIZE(b)) {
+        return 0;
+    }
+
+    ap[0] = a;
+    ap[1] = b;
+    for (j = 0; j < 2; j++) {
+        lo[j] = 0;
+        hi[j] = NpyArray_ITEMSIZE(ap[j]);
+        for (i = 0; i < NpyArray_NDIM(ap[j]); i++) {
+            npy_intp ext = (NpyArray_DIM(ap[j], i) - 1) *
+                NpyArray_STRIDE(ap[j], i);
+
+            if (NpyArray_DIM(ap[j], i) == 0) {
+                return 0;
+            }
+            if (ext < 0) {
+                lo[j] += ext;
+            }
+            else {
+                hi[j] += ext;
+            }
+        }
+    }
+    return (NpyArray_BYTES(a) + lo[0] < NpyArray_BYTES(b) + hi[1] &&
+            NpyArray_BYTES(b) + lo[1] < NpyArray_BYTES(a) + hi[0]);
+}
+
+
+/*
+ * Evaluates n elements of every node.  ptrs and strides give the first
+ * element and the step of each input and, last, of the output.
+ */
+static int
+expr_block(expr_state *st, char **ptrs, npy_intp *strides, npy_intp n)
+{
+    NpyExprObject *self = st->self;
+    expr_value *vals = st->vals;
+    int iout = st->iout;
+    char *args[NPY_MAXARGS];
+    npy_intp steps[NPY_MAXARGS];
+    char *src;
+    npy_intp sstep, m;
+    int i, k, nin;
+
+    for (k = 0; k <= st->root; k++) {
+        NpyExprNode *node = &self->nodes[k];
+        expr_value *v = &vals[k];
+
+        if (!v->used) {
+            continue;
+        }
+        if (node->ufunc == NULL) {
+            src = ptrs[v->iter];
+            sstep = strides[v->iter];
+            if (v->copy || (v->contig && sstep != 0 && sstep != v->elsize)) {
+                v->copyswapn(v->buffer, v->elsize, src, sstep, n, v->swap,
+                             node->array);
+                v->ptr = v->buffer;
+                v->step = v->elsize;
+            }
+            else {
+                v->ptr = src;
+                v->step = sstep;
+            }
+            continue;
+        }
+
+        nin = node->ufunc->nin;
+        for (i = 0; i < nin; i++) {
+            expr_value *a = &vals[node->args[i]];
+
+            if (v->cast[i] != NULL) {
+                /* Constant operands are only cast once */
+                m = (a->step == 0) ? 1 : n;
+                v->cast[i](a->ptr, v->castbuf[i], m, NULL, NULL);
+                args[i] = v->castbuf[i];
+                steps[i] = (a->step == 0) ? 0 : v->castsize[i];
+            }
+            else {
+                args[i] = a->ptr;
+                steps[i] = a->step;
+            }
+        }
+        if (k == st->root && st->direct) {
+            args[nin] = ptrs[iout];
+            steps[nin] = strides[iout];
+        }
+        else {
+            args[nin] = v->buffer;
+            steps[nin] = v->elsize;
+        }
+        v->function(args, &n, steps, v->funcdata);
+        v->ptr = args[nin];
+        v->step = steps[nin];
+
+        if (NPY_UFUNC_ERR_CHECK_EACH(st->errormask)) {
+            NpyUFunc_checkfperr(node->ufunc->name, st->errormask,
+                                st->errobj, &st->first);
+            if (NpyErr_Occurred()) {
+                return -1;
+            }
+        }
+    }
+
+    if (!st->direct) {
+        expr_value *r = &vals[st->root];
+
+        if (st->retcast != NULL) {
+            m = (r->step == 0) ? 1 : n;
+            st->retcast(r->ptr, st->retbuf, m, NULL, NULL);
+            src = st->retbuf;
+            sstep = (r->step == 0) ? 0 : st->retsize;
+        }
+        else {
+            src = r->ptr;
+            sstep = r->step;
+        }
+        st->retcopyswapn(ptrs[iout], strides[iout], src, sstep, n,
+                         st->retswap, st->ret);
+    }
+    return 0;
+}
+
+
+/*
+ * Sizes the blocks and carves the buffers out of a single allocation.
+ * Returns the block length, or -1 on error.
+ */
+static npy_intp
+expr_alloc_buffers(expr_state *st, npy_intp inner, char **mem)
+{
+    expr_value *vals = st->vals;
+    NpyExprObject *self = st->self;
+    npy_intp block, bytes, total;
+    char *p;
+    int pass, i, k;
+
+    /* Bytes touched per element */
+    bytes = st->retsize;
+    for (k = 0; k <= st->root; k++) {
+        expr_value *v = &vals[k];
+
+        if (!v->used) {
+            continue;
+        }
+        if (self->nodes[k].ufunc == NULL) {
+            bytes += (v->copy || v->contig) ? 2*v->elsize : v->elsize;
+            continue;
+        }
+        if (k != st->root || !st->direct) {
+            bytes += v->elsize;
+        }
+        for (i = 0; i < self->nodes[k].ufunc->nin; i++) {
+            if (v->cast[i] != NULL) {
+                bytes += v->castsize[i];
+            }
+        }
+    }
+    if (st->retcast != NULL) {
+        bytes += st->retsize;
+    }
+
+    /*
+     * The operands and buffers of a block fit in the same part of the L2
+     * cache as the buffers of a buffered loop, so that the values of a
+     * block are still cached when the next node uses them.
+     */
+    block = NpyUFunc_GetBufferSize(bytes);
+    if (block > inner) {
+        block = inner;
+    }
+
+#define NPY_EXPR_CARVE(ptr, size) do {                                  \
+        if (pass) {                                                     \
+            (ptr) = p + total;                                          \
+        }                                                               \
+        total += ((size) * block + NPY_EXPR_ALIGN - 1) &                \
+            ~(npy_intp)(NPY_EXPR_ALIGN - 1);                            \
+    } while (0)
+
+    /* The first pass adds up the sizes, the second assigns the buffers */
+    p = NULL;
+    for (pass = 0; pass < 2; pass++) {
+        total = 0;
+        for (k = 0; k <= st->root; k++) {
+            expr_value *v = &vals[k];
+
+            if (!v->used) {
+                continue;
+            }
+            if (self->nodes[k].ufunc == NULL) {
+                if (v->copy || v->contig) {
+                    NPY_EXPR_CARVE(v->buffer, v->elsize);
+                }
+                continue;
+            }
+            if (k != st->root || !st->direct) {
+                NPY_EXPR_CARVE(v->buffer, v->elsize);
+            }
+            for (i = 0; i < self->nodes[k].ufunc->nin; i++) {
+                if (v->cast[i] != NULL) {
+                    NPY_EXPR_CARVE(v->castbuf[i], v->castsize[i]);
+                }
+            }
+        }
+        if (st->retcast != NULL) {
+            NPY_EXPR_CARVE(st->retbuf, st->retsize);
+        }
+        if (!pass) {
+            if (total == 0) {
+                break;
+            }
+            *mem = NpyThreads_BufferAlloc(total);
+            if (*mem == NULL) {
+                NpyErr_MEMORY;
+                return -1;
+            }
+            p = *mem;
+        }
+    }
+#undef NPY_EXPR_CARVE
+
+    return block;
+}
+
+
+/*
+ * Evaluates node and returns a new reference to the result.  If out is
+ * NULL a new array with the broadcast shape of the inputs is returned,
+ * otherwise the result is cast into out, which must have that shape.
+ */
+NDARRAY_API NpyArray *
+NpyExpr_Evaluate(NpyExprObject *self, int node, NpyArray *out)
+{
+    expr_state st;
+    expr_value *vals = NULL;
+    NpyArrayMultiIterObject *multi = NULL;
+    NpyArray *tmp = NULL;
+    NpyArray_Descr *descr;
+    char *mem = NULL;
+    char *ptrs[NPY_MAXARGS];
+    npy_intp strides[NPY_MAXARGS];
+    npy_intp inner, block, j;
+    int bufsize;
+    int i, k, ld;
+    NPY_BEGIN_THREADS_DEF
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+    assert(out == NULL || NPY_VALID_MAGIC == out->nob_magic_number);
+
+    if (node < 0 || node >= self->nnodes) {
+        NpyErr_SetString(NpyExc_ValueError, "invalid expression node");
+        return NULL;
+    }
+    memset(&st, 0, sizeof(st));
+    st.self = self;
+    st.root = node;
+    st.first = 1;
+
+    vals = (expr_value *)NpyArray_malloc((node + 1) * sizeof(expr_value));
+    if (vals == NULL) {
+        NpyErr_MEMORY;
+        return NULL;
+    }
+    memset(vals, 0, (node + 1) * sizeof(expr_value));
+    st.vals = vals;
+    if (expr_prepare(self, vals, node) < 0) {
+        goto fail;
+    }
+
+    /* Broadcast the inputs used, followed by the output */
+    multi = NpyArray_MultiIterNew();
+    if (multi == NULL) {
+        goto fail;
+    }
+    multi->numiter = 0;
+    multi->index = 0;
+    for (k = 0; k <= node; k++) {
+        vals[k].iter = -1;
+        if (vals[k].used && self->nodes[k].ufunc == NULL) {
+            multi->iters[multi->numiter] =
+                NpyArray_IterNew(self->nodes[k].array);
+            if (multi->iters[multi->numiter] == NULL) {
+                goto fail;
+            }
+            vals[k].iter = multi->numiter++;
+        }
+    }
+    if (NpyArray_Broadcast(multi) < 0) {
+        goto fail;
+    }
+
+    if (out != NULL) {
+        if (NpyArray_NDIM(out) != multi->nd ||
+            !NpyArray_CompareLists(NpyArray_DIMS(out), multi->dimensions,
+                                   multi->nd)) {
+            NpyErr_SetString(NpyExc_ValueError,
+                             "invalid return array shape");
+            goto fail;
+        }
+        if (!NpyArray_ISWRITEABLE(out)) {
+            NpyErr_SetString(NpyExc_ValueError,
+                             "return array is not writeable");
+            goto fail;
+        }
+        if (NpyArray_ISFLEXIBLE(out) || NpyArray_ISOBJECT(out)) {
+            NpyErr_SetString(NpyExc_TypeError,
+                             "flexible and object arrays can not be used "
+                             "in expressions");
+            goto fail;
+        }
+        st.ret = out;
+        for (k = 0; k <= node; k++) {
+            if (vals[k].iter >= 0 &&
+                expr_overlap(self->nodes[k].array, out)) {
+                /* Evaluate into a temporary and copy at the end */
+                st.ret = NULL;
+                break;
+            }
+        }
+    }
+    if (st.ret == NULL) {
+        tmp = NpyArray_New(NULL, multi->nd, multi->dimensions,
+                           (out != NULL) ? NpyArray_TYPE(out) :
+                                           vals[node].type,
+                           NULL, NULL, 0, 0, NULL);
+        if (tmp == NULL) {
+            goto fail;
+        }
+        st.ret = tmp;
+    }
+    st.iout = multi->numiter;
+    multi->iters[st.iout] = NpyArray_IterNew(st.ret);
+    if (multi->iters[st.iout] == NULL) {
+        goto fail;
+    }
+    multi->numiter++;
+
+    /* How the values of the root get into the result */
+    st.retsize = NpyArray_ITEMSIZE(st.ret);
+    st.retswap = !NpyArray_ISNOTSWAPPED(st.ret);
+    st.retcopyswapn = NpyArray_DESCR(st.ret)->f->copyswapn;
+    st.direct = (self->nodes[node].ufunc != NULL &&
+                 NpyArray_TYPE(st.ret) == vals[node].type &&
+                 NpyArray_ISALIGNED(st.ret) && !st.retswap);
+    if (NpyArray_TYPE(st.ret) != vals[node].type) {
+        descr = NpyArray_DescrFromType(vals[node].type);
+        st.retcast = NpyArray_GetCastFunc(descr, NpyArray_TYPE(st.ret));
+        Npy_DECREF(descr);
+        if (st.retcast == NULL) {
+            goto fail;
+        }
+        vals[node].contig = 1;
+    }
+
+    /* Iterate over all but one long axis, which is split into blocks */
+    npy_multiiter_coalesce(multi);
+    if (multi->nd > 0) {
+        ld = multi->nd - 1;
+        inner = multi->dimensions[ld];
+        for (i = 0; i < multi->numiter; i++) {
+            NpyArrayIterObject *it = multi->iters[i];
+
+            strides[i] = it->strides[ld];
+            it->contiguous = 0;
+            if (it->size != 0) {
+                it->size /= (it->dims_m1[ld] + 1);
+            }
+            it->dims_m1[ld] = 0;
+            it->backstrides[ld] = 0;
+        }
+        if (multi->size != 0) {
+            multi->size /= inner;
+        }
+    }
+    else {
+        inner = 1;
+        for (i = 0; i < multi->numiter; i++) {
+            strides[i] = 0;
+        }
+    }
+    if (multi->size == 0) {
+        goto finish;
+    }
+
+    block = expr_alloc_buffers(&st, inner, &mem);
+    if (block < 0) {
+        goto fail;
+    }
+
+    NpyUFunc_clearfperr();
+    fp_error_state(&bufsize, &st.errormask, &st.errobj);
+
+    NPY_BEGIN_THREADS;
+    while (multi->index < multi->size) {
+        for (j = 0; j < inner; j += block) {
+            npy_intp n = (inner - j < block) ? inner - j : block;
+
+            for (i = 0; i < multi->numiter; i++) {
+                ptrs[i] = multi->iters[i]->dataptr + j*strides[i];
+            }
+            if (expr_block(&st, ptrs, strides, n) < 0) {
+                NPY_END_THREADS;
+                goto fail;
+            }
+        }
+        NpyArray_MultiIter_NEXT(multi);
+    }
+    NPY_END_THREADS;
+    /* Without early handling the errors are reported for the root */
+    if (st.errormask && !NPY_UFUNC_ERR_CHECK_EACH(st.errormask) &&
+        self->nodes[node].ufunc != NULL) {
+        NpyUFunc_checkfperr(self->nodes[node].ufunc->name, st.errormask,
+                            st.errobj, &st.first);
+        if (NpyErr_Occurred()) {
+            goto fail;
+        }
+    }
+
+ finish:
+    if (tmp != NULL && out != NULL) {
+        if (NpyArray_CopyInto(out, tmp) < 0) {
+            goto fail;
+        }
+        Npy_DECREF(tmp);
+        tmp = NULL;
+    }
+    if (tmp == NULL) {
+        tmp = out;
+        Npy_INCREF(tmp);
+    }
+    NpyInterface_DECREF(st.errobj);
+    NpyThreads_BufferFree(mem);
+    Npy_DECREF(multi);
+    NpyArray_free(vals);
+    return tmp;
+
+ fail:
+    NpyInterface_DECREF(st.errobj);
+    NpyThreads_BufferFree(mem);
+    Npy_XDECREF(tmp);
+    Npy_XDECREF(multi);
+    NpyArray_free(vals);
+    return NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef _NPY_EXPR_H_
+#define _NPY_EXPR_H_
+
+#include "npy_object.h"
+#include "npy_arrayobject.h"
+#include "npy_ufunc_object.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+ * Lazily evaluated element-wise expressions.  An expression records a
+ * graph of ufunc applications over arrays, for example a*b + c*d - e,
+ * and evaluates it in blocks small enough that the intermediate values
+ * stay in cache.  This produces the same result as calling the ufuncs
+ * one after the other, but never allocates temporaries the size of the
+ * arrays and reads each input once.
+ *
+ * Nodes are referred to by the index returned when they are added, and
+ * a node can be used as an operand any number of times.  Only ufuncs
+ * with a single output and without a signature can be applied, and
+ * flexible and object arrays are not supported.
+ */
+
+#define NPY_EXPR_MAXNODES 64
+
+typedef struct NpyExprNode {
+    struct NpyUFuncObject *ufunc;   /* NULL for an input */
+    NpyArray *array;                /* The array of an input */
+    int args[NPY_MAXARGS];          /* The operand nodes of an application */
+} NpyExprNode;
+
+typedef struct NpyExprObject {
+    NpyObject_HEAD
+
+    int nnodes;
+    int ninputs;
+    NpyExprNode nodes[NPY_EXPR_MAXNODES];
+} NpyExprObject;
+
+NDARRAY_API extern NpyTypeObject NpyExpr_Type;
+
+
+NDARRAY_API NpyExprObject *
+NpyExpr_New(void);
+NDARRAY_API int
+NpyExpr_Input(NpyExprObject *self, NpyArray *array);
+NDARRAY_API int
+NpyExpr_Apply(NpyExprObject *self, NpyUFuncObject *ufunc, int *args);
+NDARRAY_API NpyArray *
+NpyExpr_Evaluate(NpyExprObject *self, int node, NpyArray *out);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
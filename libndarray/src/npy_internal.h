@@ -43,6 +43,11 @@ extern struct NpyInterface_WrapperFuncs _NpyArrayWrapperFuncs;
         (_NpyArrayWrapperFuncs.descr_new_from_wrapper)((a), (b), (c)) :              \
         NPY_TRUE)
 
+
+/* npy_iterators.c */
+extern void
+npy_multiiter_coalesce(NpyArrayMultiIterObject *multi);
+
 #if defined(__cplusplus)
 }
 #endif
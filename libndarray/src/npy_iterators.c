@@ -884,6 +884,121 @@ NpyArray_RemoveSmallest(NpyArrayMultiIterObject *multi)
     return axis;
 }
 
+/*
+ * Reorders and merges the dimensions of broadcast iterators so that the
+ * last dimension is the fastest varying one in memory and is as long as
+ * possible.  Axes are sorted by decreasing stride, using only operands
+ * which are not broadcast along either axis to decide, and then
+ * neighbouring axes are merged when every operand steps through them as
+ * through a single axis.  The iterators must be at their start.
+ */
+void
+npy_multiiter_coalesce(NpyArrayMultiIterObject *multi)
+{
+    int nargs = multi->numiter;
+    int nd = multi->nd;
+    npy_intp dims[NPY_MAXDIMS];
+    npy_intp strides[NPY_MAXARGS][NPY_MAXDIMS];
+    npy_intp tmp;
+    int i, j, k, swap;
+
+    if (nd == 0) {
+        return;
+    }
+    for (k = 0; k < nd; k++) {
+        dims[k] = multi->dimensions[k];
+        for (j = 0; j < nargs; j++) {
+            strides[j][k] = multi->iters[j]->strides[k];
+        }
+    }
+
+    /*
+     * Insertion sort: an axis moves inward past its neighbour only if
+     * all operands which move along both agree it has the smaller
+     * stride.
+     */
+    for (i = 1; i < nd; i++) {
+        for (k = i; k > 0; k--) {
+            swap = 0;
+            for (j = 0; j < nargs; j++) {
+                npy_intp outer = strides[j][k-1], inner = strides[j][k];
+
+                if (outer == 0 || inner == 0) {
+                    continue;
+                }
+                if (outer < 0) {
+                    outer = -outer;
+                }
+                if (inner < 0) {
+                    inner = -inner;
+                }
+                if (inner > outer) {
+                    swap = 1;
+                }
+                else {
+                    swap = 0;
+                    break;
+                }
+            }
+            if (!swap) {
+                break;
+            }
+            tmp = dims[k];
+            dims[k] = dims[k-1];
+            dims[k-1] = tmp;
+            for (j = 0; j < nargs; j++) {
+                tmp = strides[j][k];
+                strides[j][k] = strides[j][k-1];
+                strides[j][k-1] = tmp;
+            }
+        }
+    }
+
+    /* Merge axis k into axis i (the one outside it) where possible. */
+    i = 0;
+    for (k = 1; k < nd; k++) {
+        for (j = 0; j < nargs; j++) {
+            if (dims[i] != 1 && dims[k] != 1 &&
+                strides[j][i] != strides[j][k] * dims[k]) {
+                break;
+            }
+        }
+        if (j == nargs) {
+            for (j = 0; j < nargs; j++) {
+                if (dims[k] != 1) {
+                    strides[j][i] = strides[j][k];
+                }
+            }
+            dims[i] *= dims[k];
+        }
+        else {
+            i++;
+            dims[i] = dims[k];
+            for (j = 0; j < nargs; j++) {
+                strides[j][i] = strides[j][k];
+            }
+        }
+    }
+    nd = i + 1;
+
+    multi->nd = nd;
+    for (k = 0; k < nd; k++) {
+        multi->dimensions[k] = dims[k];
+    }
+    for (j = 0; j < nargs; j++) {
+        NpyArrayIterObject *it = multi->iters[j];
+
+        it->nd_m1 = nd - 1;
+        for (k = nd - 1; k >= 0; k--) {
+            it->coordinates[k] = 0;
+            it->dims_m1[k] = dims[k] - 1;
+            it->strides[k] = strides[j][k];
+            it->backstrides[k] = strides[j][k] * (dims[k] - 1);
+            it->factors[k] = (k == nd - 1) ? 1 : it->factors[k+1] * dims[k+1];
+        }
+    }
+}
+
 /* Adjust dimensionality and strides for index object iterators
    --- i.e. broadcast
 */
@@ -1098,6 +1213,455 @@ NpyArray_MultiIterFromArrays(NpyArray **mps, int n, int nadd, ...)
 
 
 
+/*========================= Range clones ===============================*/
+
+/*
+ * Positions an iterator at a flat index from its coordinates.  Unlike
+ * NpyArray_ITER_GOTO1D this does not rely on the factors or on the
+ * contiguous flag, which are left stale when the dimensions of an
+ * iterator are rewritten, as construct_arrays and
+ * npy_multiiter_coalesce do.
+ */
+NDARRAY_API void
+NpyArray_IterGotoIndex(NpyArrayIterObject *it, npy_intp index)
+{
+    int i;
+
+    it->index = index;
+    it->dataptr = it->ao->data;
+    for (i = it->nd_m1; i >= 0; i--) {
+        npy_intp dim = it->dims_m1[i] + 1;
+
+        it->coordinates[i] = index % dim;
+        it->dataptr += it->coordinates[i] * it->strides[i];
+        index /= dim;
+    }
+}
+
+/*
+ * Makes clone a copy of it which walks the flat indices [start, end).
+ */
+NDARRAY_API void
+NpyArray_IterRangeInit(NpyArrayIterObject *clone, NpyArrayIterObject *it,
+                       npy_intp start, npy_intp end)
+{
+    assert(0 <= start && start <= end && end <= it->size);
+
+    *clone = *it;
+    NpyArray_IterGotoIndex(clone, start);
+    clone->size = end;
+}
+
+/*
+ * Makes clone a copy of it which walks the block of coordinates
+ * [start, end) along the first axis, and all of the others.
+ */
+NDARRAY_API void
+NpyArray_IterOuterRangeInit(NpyArrayIterObject *clone,
+                            NpyArrayIterObject *it,
+                            npy_intp start, npy_intp end)
+{
+    npy_intp rowsize = 1;
+    int i;
+
+    if (it->nd_m1 < 0) {
+        NpyArray_IterRangeInit(clone, it, 0, it->size);
+        return;
+    }
+    for (i = 1; i <= it->nd_m1; i++) {
+        rowsize *= it->dims_m1[i] + 1;
+    }
+    NpyArray_IterRangeInit(clone, it, start * rowsize, end * rowsize);
+}
+
+/*
+ * Returns a new iterator walking the flat indices [start, end) of it.
+ * Unlike the Init versions this is a separate object holding its own
+ * reference to the array.
+ */
+NDARRAY_API NpyArrayIterObject *
+NpyArray_IterRangeNew(NpyArrayIterObject *it, npy_intp start, npy_intp end)
+{
+    NpyArrayIterObject *clone;
+
+    if (start < 0 || start > end || end > it->size) {
+        NpyErr_SetString(NpyExc_IndexError, "iterator range out of bounds");
+        return NULL;
+    }
+    clone = (NpyArrayIterObject *)NpyArray_malloc(sizeof(NpyArrayIterObject));
+    if (clone == NULL) {
+        NpyErr_MEMORY;
+        return NULL;
+    }
+    NpyArray_IterRangeInit(clone, it, start, end);
+    NpyObject_Init((_NpyObject *)clone, &NpyArrayIter_Type);
+    Npy_INCREF(clone->ao);
+    /* Defer creation of the wrapper - will be handled by Npy_INTERFACE. */
+    return clone;
+}
+
+/*
+ * Makes clone a copy of multi which walks the broadcast flat indices
+ * [start, end), using iters, which must have room for multi->numiter
+ * iterators, for its sub-iterators.
+ */
+NDARRAY_API void
+NpyArray_MultiIterRangeInit(NpyArrayMultiIterObject *clone,
+                            NpyArrayIterObject *iters,
+                            NpyArrayMultiIterObject *multi,
+                            npy_intp start, npy_intp end)
+{
+    int i;
+
+    assert(0 <= start && start <= end && end <= multi->size);
+
+    *clone = *multi;
+    for (i = 0; i < multi->numiter; i++) {
+        iters[i] = *multi->iters[i];
+        NpyArray_IterGotoIndex(&iters[i], start);
+        iters[i].size = end;
+        clone->iters[i] = &iters[i];
+    }
+    clone->index = start;
+    clone->size = end;
+}
+
+
+
+
+/*========================= External loop iterator =====================*/
+
+static void
+arrayloopiter_dealloc(NpyArrayLoopIterObject *it)
+{
+    int i;
+
+    assert(0 == it->nob_refcnt);
+
+    for (i = 0; i < it->nop; i++) {
+        Npy_XDECREF(it->dtypes[i]);
+        NpyArray_free(it->rawbuf[i]);
+        NpyArray_free(it->castbuf[i]);
+    }
+    Npy_XDECREF(it->multi);
+    it->nob_magic_number = NPY_INVALID_MAGIC;
+    NpyArray_free(it);
+}
+
+NDARRAY_API NpyTypeObject NpyArrayLoopIter_Type = {
+    (npy_destructor)arrayloopiter_dealloc,
+    NULL
+};
+
+
+/*
+ * Points the inner loop at the current position and fills the buffers
+ * of buffered input operands.
+ */
+static int
+_loopiter_load(NpyArrayLoopIterObject *it)
+{
+    NpyArrayMultiIterObject *multi = it->multi;
+    npy_intp count;
+    char *ptr;
+    int i;
+
+    count = it->innersize - it->inneroffset;
+    if (it->bufsize > 0 && count > it->bufsize) {
+        count = it->bufsize;
+    }
+    it->count = count;
+    for (i = 0; i < it->nop; i++) {
+        NpyArrayIterObject *sub = multi->iters[i];
+        npy_intp stride = sub->strides[multi->nd - 1];
+        NpyArray *ao = sub->ao;
+
+        ptr = sub->dataptr + it->inneroffset * stride;
+        if (it->rawbuf[i] == NULL) {
+            it->dataptrs[i] = ptr;
+            continue;
+        }
+        if (it->opflags[i] & NPY_LOOPITER_READ) {
+            ao->descr->f->copyswapn(it->rawbuf[i], ao->descr->elsize,
+                                    ptr, stride, count,
+                                    NpyArray_ISBYTESWAPPED(ao), ao);
+            if (it->castbuf[i] != NULL) {
+                it->tocast[i](it->rawbuf[i], it->castbuf[i], count,
+                              ao, NULL);
+            }
+        }
+        it->dataptrs[i] = (it->castbuf[i] != NULL) ? it->castbuf[i] :
+                                                     it->rawbuf[i];
+    }
+    return (it->bufsize > 0 && NpyErr_Occurred()) ? -1 : 0;
+}
+
+/* Writes the buffers of buffered output operands back. */
+static int
+_loopiter_flush(NpyArrayLoopIterObject *it)
+{
+    NpyArrayMultiIterObject *multi = it->multi;
+    int i;
+
+    for (i = 0; i < it->nop; i++) {
+        NpyArrayIterObject *sub = multi->iters[i];
+        npy_intp stride = sub->strides[multi->nd - 1];
+        NpyArray *ao = sub->ao;
+
+        if (it->rawbuf[i] == NULL || !(it->opflags[i] & NPY_LOOPITER_WRITE)) {
+            continue;
+        }
+        if (it->castbuf[i] != NULL) {
+            it->fromcast[i](it->castbuf[i], it->rawbuf[i], it->count,
+                            NULL, ao);
+        }
+        ao->descr->f->copyswapn(sub->dataptr + it->inneroffset * stride,
+                                stride, it->rawbuf[i], ao->descr->elsize,
+                                it->count, NpyArray_ISBYTESWAPPED(ao), ao);
+    }
+    return NpyErr_Occurred() ? -1 : 0;
+}
+
+/*
+ * Sets up buffering of operand i if it needs it.  Returns 1 if the
+ * operand is buffered, 0 if it is used in place and -1 on error.
+ */
+static int
+_loopiter_setup_buffer(NpyArrayLoopIterObject *it, int i, int flags)
+{
+    NpyArray *ao = it->multi->iters[i]->ao;
+    NpyArray_Descr *dtype = it->dtypes[i];
+    int cast = (ao->descr->type_num != dtype->type_num ||
+                ao->descr->elsize != dtype->elsize);
+
+    if (!cast && NpyArray_ISALIGNED(ao) && NpyArray_ISNOTSWAPPED(ao)) {
+        return 0;
+    }
+    if (!(flags & NPY_LOOPITER_BUFFERED)) {
+        if (!cast) {
+            return 0;
+        }
+        NpyErr_SetString(NpyExc_TypeError,
+                         "operand requires a cast but the iterator "
+                         "is not buffered");
+        return -1;
+    }
+    if (NpyDataType_REFCHK(ao->descr) || NpyDataType_REFCHK(dtype) ||
+        NpyTypeNum_ISFLEXIBLE(ao->descr->type_num) ||
+        NpyTypeNum_ISFLEXIBLE(dtype->type_num) ||
+        !NpyArray_ISNBO(dtype->byteorder)) {
+        NpyErr_SetString(NpyExc_TypeError,
+                         "operand cannot be buffered by the iterator");
+        return -1;
+    }
+
+    it->rawbuf[i] = NpyArray_malloc(it->bufsize * ao->descr->elsize);
+    if (it->rawbuf[i] == NULL) {
+        NpyErr_MEMORY;
+        return -1;
+    }
+    if (!cast) {
+        return 1;
+    }
+    it->castbuf[i] = NpyArray_malloc(it->bufsize * dtype->elsize);
+    if (it->castbuf[i] == NULL) {
+        NpyErr_MEMORY;
+        return -1;
+    }
+    if (it->opflags[i] & NPY_LOOPITER_READ) {
+        it->tocast[i] = NpyArray_GetCastFunc(ao->descr, dtype->type_num);
+        if (it->tocast[i] == NULL) {
+            return -1;
+        }
+    }
+    if (it->opflags[i] & NPY_LOOPITER_WRITE) {
+        it->fromcast[i] = NpyArray_GetCastFunc(dtype, ao->descr->type_num);
+        if (it->fromcast[i] == NULL) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Creates an iterator over nop broadcast operands handing out inner
+ * loops.  opflags gives NPY_LOOPITER_READ and/or NPY_LOOPITER_WRITE for
+ * each operand.  dtypes, or any entry of it, may be NULL to use the
+ * operand's own type; a different type requires NPY_LOOPITER_BUFFERED
+ * in flags.  bufsize is the buffer length in elements, NPY_BUFSIZE if 0.
+ * The first inner loop is ready on return.
+ */
+NDARRAY_API NpyArrayLoopIterObject *
+NpyArray_LoopIterNew(int nop, NpyArray **ops, int *opflags,
+                     NpyArray_Descr **dtypes, int flags, npy_intp bufsize)
+{
+    NpyArrayLoopIterObject *it;
+    NpyArrayMultiIterObject *multi;
+    int i, buffered = 0;
+
+    if (nop < 1 || nop > NPY_MAXARGS) {
+        char msg[1024];
+
+        sprintf(msg, "Need between 1 and (%d) operands (inclusive).",
+                NPY_MAXARGS);
+        NpyErr_SetString(NpyExc_ValueError, msg);
+        return NULL;
+    }
+    for (i = 0; i < nop; i++) {
+        if ((opflags[i] & NPY_LOOPITER_WRITE) &&
+            !NpyArray_ISWRITEABLE(ops[i])) {
+            NpyErr_SetString(NpyExc_ValueError,
+                             "output array is not writeable");
+            return NULL;
+        }
+    }
+
+    it = NpyArray_malloc(sizeof(NpyArrayLoopIterObject));
+    if (it == NULL) {
+        NpyErr_MEMORY;
+        return NULL;
+    }
+    NpyObject_Init((_NpyObject *)it, &NpyArrayLoopIter_Type);
+    it->nop = nop;
+    it->multi = NULL;
+    for (i = 0; i < nop; i++) {
+        it->opflags[i] = opflags[i];
+        it->dtypes[i] = NULL;
+        it->rawbuf[i] = NULL;
+        it->castbuf[i] = NULL;
+        it->tocast[i] = NULL;
+        it->fromcast[i] = NULL;
+    }
+
+    multi = NpyArray_MultiIterNew();
+    if (multi == NULL) {
+        goto fail;
+    }
+    it->multi = multi;
+    multi->numiter = 0;
+    multi->index = 0;
+    for (i = 0; i < nop; i++) {
+        multi->iters[i] = NpyArray_IterNew(ops[i]);
+        if (multi->iters[i] == NULL) {
+            goto fail;
+        }
+        multi->numiter++;
+    }
+    if (NpyArray_Broadcast(multi) < 0) {
+        goto fail;
+    }
+    NpyArray_MultiIter_RESET(multi);
+    npy_multiiter_coalesce(multi);
+    if (multi->nd == 0) {
+        /* Give 0-d operands a single axis of length one. */
+        multi->nd = 1;
+        multi->dimensions[0] = 1;
+        for (i = 0; i < nop; i++) {
+            multi->iters[i]->strides[0] = 0;
+        }
+    }
+
+    it->size = multi->size;
+    it->index = 0;
+    it->count = 0;
+    it->innersize = multi->dimensions[multi->nd - 1];
+    it->inneroffset = 0;
+    it->bufsize = (bufsize > 0) ? bufsize : NPY_BUFSIZE;
+    for (i = 0; i < nop; i++) {
+        if (dtypes != NULL && dtypes[i] != NULL) {
+            it->dtypes[i] = dtypes[i];
+            Npy_INCREF(it->dtypes[i]);
+        }
+        else if (NpyArray_ISNOTSWAPPED(ops[i])) {
+            it->dtypes[i] = ops[i]->descr;
+            Npy_INCREF(it->dtypes[i]);
+        }
+        else {
+            it->dtypes[i] = NpyArray_DescrNewByteorder(ops[i]->descr,
+                                                       NPY_NATIVE);
+            if (it->dtypes[i] == NULL) {
+                goto fail;
+            }
+        }
+        switch (_loopiter_setup_buffer(it, i, flags)) {
+            case -1:
+                goto fail;
+            case 1:
+                buffered = 1;
+                break;
+        }
+    }
+    if (!buffered) {
+        it->bufsize = 0;
+    }
+    for (i = 0; i < nop; i++) {
+        it->strides[i] = (it->castbuf[i] != NULL) ? it->dtypes[i]->elsize :
+                         (it->rawbuf[i] != NULL) ? ops[i]->descr->elsize :
+                         multi->iters[i]->strides[multi->nd - 1];
+    }
+
+    if (it->size > 0 && _loopiter_load(it) < 0) {
+        goto fail;
+    }
+    /* Defer creation of the wrapper - will be handled by Npy_INTERFACE. */
+    return it;
+
+ fail:
+    Npy_DECREF(it);
+    return NULL;
+}
+
+/*
+ * Moves to the next inner loop, writing back any buffered outputs of
+ * the current one.  Returns 1 if there is another inner loop, 0 when the
+ * iteration is done and -1 on error.
+ */
+NDARRAY_API int
+NpyArray_LoopIterNext(NpyArrayLoopIterObject *it)
+{
+    NpyArrayMultiIterObject *multi = it->multi;
+    int i, k;
+
+    assert(NPY_VALID_MAGIC == it->nob_magic_number);
+    if (it->index >= it->size) {
+        return 0;
+    }
+    if (it->bufsize > 0 && _loopiter_flush(it) < 0) {
+        return -1;
+    }
+    it->index += it->count;
+    if (it->index >= it->size) {
+        it->count = 0;
+        return 0;
+    }
+
+    it->inneroffset += it->count;
+    if (it->inneroffset == it->innersize) {
+        /* Step the outer dimensions of every operand. */
+        it->inneroffset = 0;
+        for (i = 0; i < it->nop; i++) {
+            NpyArrayIterObject *sub = multi->iters[i];
+
+            for (k = multi->nd - 2; k >= 0; k--) {
+                if (sub->coordinates[k] < sub->dims_m1[k]) {
+                    sub->coordinates[k]++;
+                    sub->dataptr += sub->strides[k];
+                    break;
+                }
+                sub->coordinates[k] = 0;
+                sub->dataptr -= sub->backstrides[k];
+            }
+        }
+    }
+    if (_loopiter_load(it) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+
+
+
 /*========================= Neighborhood iterator ======================*/
 
 #define _INF_SET_PTR(c) \
@@ -1336,3 +1900,151 @@ NDARRAY_API NpyTypeObject NpyArrayNeighborhoodIter_Type = {
     (npy_destructor)neighiter_dealloc,
     NULL
 };
+
+
+/*========================= Neighborhood stencil =======================*/
+
+/*
+ * Calls func for the neighborhood of every point of in, writing the
+ * points of out, which must have the same shape.  bounds, mode and fill
+ * are as for NpyArray_NeighborhoodIterNew; fill stays owned by the
+ * caller.
+ *
+ * The points whose whole neighborhood lies inside the array are handed
+ * to func a row at a time, with the neighbours found from offsets
+ * computed once.  Only the points of the boundary shell go through the
+ * neighborhood iterator and its padding mode, one at a time.
+ */
+NDARRAY_API int
+NpyArray_NeighborhoodStencil(NpyArray *in, NpyArray *out, npy_intp *bounds,
+                             int mode, void *fill,
+                             npy_stencil_func_t func, void *data)
+{
+    NpyArrayIterObject *x = NULL;
+    NpyArrayNeighborhoodIterObject *niter = NULL;
+    npy_intp lo[NPY_MAXDIMS], hi[NPY_MAXDIMS], coord[NPY_MAXDIMS];
+    npy_intp *offsets = NULL;
+    char **ptrs = NULL;
+    npy_intp nneigh, n, i, k, step, outstep;
+    int nd = in->nd, last = in->nd - 1, d, inner;
+    int ret = -1;
+
+    if (!NpyArray_SAMESHAPE(in, out)) {
+        NpyErr_SetString(NpyExc_ValueError,
+                         "stencil output must have the shape of the input");
+        return -1;
+    }
+    if (NpyArray_SIZE(in) == 0) {
+        return 0;
+    }
+
+    x = NpyArray_IterNew(in);
+    if (x == NULL) {
+        return -1;
+    }
+    niter = NpyArray_NeighborhoodIterNew(x, bounds, mode, fill, NULL);
+    if (niter == NULL) {
+        goto finish;
+    }
+    nneigh = niter->size;
+    offsets = NpyArray_malloc(nneigh * sizeof(npy_intp));
+    ptrs = NpyArray_malloc(nneigh * sizeof(char *));
+    if (offsets == NULL || ptrs == NULL) {
+        NpyErr_MEMORY;
+        goto finish;
+    }
+
+    /*
+     * Offsets of the neighbours from the centre, in iterator order, and
+     * along each axis the range of centres [lo, hi] needing no padding.
+     */
+    for (d = 0; d < nd; d++) {
+        coord[d] = bounds[2*d];
+        lo[d] = (bounds[2*d] < 0) ? -bounds[2*d] : 0;
+        hi[d] = in->dimensions[d] - 1 -
+                ((bounds[2*d+1] > 0) ? bounds[2*d+1] : 0);
+    }
+    for (k = 0; k < nneigh; k++) {
+        offsets[k] = 0;
+        for (d = 0; d < nd; d++) {
+            offsets[k] += coord[d] * in->strides[d];
+        }
+        for (d = nd - 1; d >= 0; d--) {
+            if (coord[d] < bounds[2*d+1]) {
+                coord[d]++;
+                break;
+            }
+            coord[d] = bounds[2*d];
+        }
+    }
+
+    step = (nd > 0) ? in->strides[last] : 0;
+    outstep = (nd > 0) ? out->strides[last] : 0;
+    n = (nd > 0) ? in->dimensions[last] : 1;
+    for (d = 0; d < nd; d++) {
+        coord[d] = 0;
+    }
+    for (;;) {
+        char *iptr = in->data, *optr = out->data;
+
+        /* The row is interior if the outer coordinates all are. */
+        inner = (nd > 0);
+        for (d = 0; d < last; d++) {
+            iptr += coord[d] * in->strides[d];
+            optr += coord[d] * out->strides[d];
+            if (coord[d] < lo[d] || coord[d] > hi[d]) {
+                inner = 0;
+            }
+        }
+        if (inner && lo[last] > hi[last]) {
+            inner = 0;
+        }
+
+        for (i = 0; i < n; ) {
+            if (inner && i == lo[last]) {
+                char *center = iptr + i * step;
+
+                for (k = 0; k < nneigh; k++) {
+                    ptrs[k] = center + offsets[k];
+                }
+                func(ptrs, step, hi[last] - lo[last] + 1,
+                     optr + i * outstep, outstep, data);
+                i = hi[last] + 1;
+                continue;
+            }
+            /* A boundary point, through the padding mode. */
+            if (nd > 0) {
+                coord[last] = i;
+                NpyArray_ITER_GOTO(x, coord);
+            }
+            NpyArrayNeighborhoodIter_Reset(niter);
+            for (k = 0; k < nneigh; k++) {
+                ptrs[k] = niter->dataptr;
+                NpyArrayNeighborhoodIter_Next(niter);
+            }
+            func(ptrs, 0, 1, optr + i * outstep, outstep, data);
+            if (NpyErr_Occurred()) {
+                goto finish;
+            }
+            i++;
+        }
+
+        for (d = last - 1; d >= 0; d--) {
+            if (++coord[d] < in->dimensions[d]) {
+                break;
+            }
+            coord[d] = 0;
+        }
+        if (d < 0) {
+            break;
+        }
+    }
+    ret = NpyErr_Occurred() ? -1 : 0;
+
+ finish:
+    NpyArray_free(offsets);
+    NpyArray_free(ptrs);
+    Npy_XDECREF(niter);
+    Npy_DECREF(x);
+    return ret;
+}
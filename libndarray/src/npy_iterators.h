@@ -60,6 +60,30 @@ NpyArray_IterSubscriptAssign(NpyArrayIterObject *self,
                              NpyIndex *indexes, int n,
                              NpyArray *value);
 
+NDARRAY_API void
+NpyArray_IterGotoIndex(NpyArrayIterObject *it, npy_intp index);
+
+/*
+ * Range clones: iterators which walk only the flat indices [start, end)
+ * of another, so that several threads can each take a part of one
+ * traversal.  The Init versions fill caller provided storage, allocate
+ * nothing and do not take a reference to the array, so the clone must
+ * not outlive the iterator it was made from and is not released.
+ * NpyArray_ITER_NOTDONE stops a clone at end; NpyArray_ITER_RESET
+ * moves it back to the start of the whole array, not of its range.
+ */
+NDARRAY_API void
+NpyArray_IterRangeInit(NpyArrayIterObject *clone, NpyArrayIterObject *it,
+                       npy_intp start, npy_intp end);
+
+NDARRAY_API void
+NpyArray_IterOuterRangeInit(NpyArrayIterObject *clone,
+                            NpyArrayIterObject *it,
+                            npy_intp start, npy_intp end);
+
+NDARRAY_API NpyArrayIterObject *
+NpyArray_IterRangeNew(NpyArrayIterObject *it, npy_intp start, npy_intp end);
+
 
 #define NpyArrayIter_Check(op) NpyObject_TypeCheck(op, &PyArrayIter_Type)
 
@@ -224,6 +248,12 @@ NpyArray_RemoveSmallest(NpyArrayMultiIterObject *multi);
 NDARRAY_API int
 NpyArray_Broadcast(NpyArrayMultiIterObject *mit);
 
+NDARRAY_API void
+NpyArray_MultiIterRangeInit(NpyArrayMultiIterObject *clone,
+                            NpyArrayIterObject *iters,
+                            NpyArrayMultiIterObject *multi,
+                            npy_intp start, npy_intp end);
+
 
 #define NpyArray_MultiIter_RESET(multi) {                               \
         int __npy_mi;                                                   \
@@ -270,6 +300,71 @@ NpyArray_Broadcast(NpyArrayMultiIterObject *mit);
 #define NpyArray_MultiIter_NOTDONE(multi)                \
         ((multi)->index < (multi)->size)
 
+
+/*
+ * Iterator handing out an external inner loop: the operands are
+ * broadcast together, their axes are sorted by stride and coalesced, and
+ * each step exposes a data pointer and stride per operand plus a count,
+ * which is what a strided inner loop (for example a ufunc loop) takes.
+ * When NPY_LOOPITER_BUFFERED is given, operands which are of a different
+ * type than requested, misaligned or byte swapped are copied through
+ * aligned, native buffers in chunks of at most bufsize elements.
+ *
+ *     it = NpyArray_LoopIterNew(nop, ops, opflags, dtypes, flags, 0);
+ *     while (NpyArray_LoopIter_NOTDONE(it)) {
+ *         inner(it->dataptrs, it->count, it->strides);
+ *         if (NpyArray_LoopIterNext(it) < 0) ...
+ *     }
+ *
+ * Buffered output operands are written back by NpyArray_LoopIterNext,
+ * so it must be called until the iteration is done.
+ */
+
+/* Per operand flags */
+#define NPY_LOOPITER_READ       0x01
+#define NPY_LOOPITER_WRITE      0x02
+#define NPY_LOOPITER_READWRITE  (NPY_LOOPITER_READ | NPY_LOOPITER_WRITE)
+
+/* Iterator flags */
+#define NPY_LOOPITER_BUFFERED   0x01
+
+struct NpyArrayLoopIterObject {
+        NpyObject_HEAD
+
+        int                  nop;                     /* number of operands */
+        npy_intp             size;                    /* broadcasted size */
+        npy_intp             index;                   /* start of inner loop */
+        npy_intp             count;                   /* inner loop length */
+        char                 *dataptrs[NPY_MAXARGS];  /* inner loop data */
+        npy_intp             strides[NPY_MAXARGS];    /* inner loop strides */
+
+        /* Private */
+        NpyArrayMultiIterObject *multi;               /* coalesced outer loop */
+        npy_intp             innersize;               /* innermost dimension */
+        npy_intp             inneroffset;             /* position within it */
+        npy_intp             bufsize;                 /* 0 if not buffering */
+        int                  opflags[NPY_MAXARGS];
+        NpyArray_Descr       *dtypes[NPY_MAXARGS];    /* as seen by the loop */
+        char                 *rawbuf[NPY_MAXARGS];    /* aligned, native copy */
+        char                 *castbuf[NPY_MAXARGS];   /* cast copy or NULL */
+        NpyArray_VectorUnaryFunc *tocast[NPY_MAXARGS];
+        NpyArray_VectorUnaryFunc *fromcast[NPY_MAXARGS];
+};
+
+typedef struct NpyArrayLoopIterObject NpyArrayLoopIterObject;
+
+NDARRAY_API extern NpyTypeObject NpyArrayLoopIter_Type;
+
+NDARRAY_API NpyArrayLoopIterObject *
+NpyArray_LoopIterNew(int nop, struct NpyArray **ops, int *opflags,
+                     NpyArray_Descr **dtypes, int flags, npy_intp bufsize);
+
+NDARRAY_API int
+NpyArray_LoopIterNext(NpyArrayLoopIterObject *it);
+
+#define NpyArray_LoopIter_NOTDONE(it)                    \
+        ((it)->index < (it)->size)
+
 /* Store the information needed for fancy-indexing over an array */
 
 struct NpyArrayMapIterObject {
@@ -387,6 +482,22 @@ NDARRAY_API NpyArrayNeighborhoodIterObject*
 NpyArray_NeighborhoodIterNew(NpyArrayIterObject *x, npy_intp *bounds,
                              int mode, void *fill,  npy_free_func fillfree);
 
+/*
+ * Stencil kernel for NpyArray_NeighborhoodStencil: computes n points of
+ * the output, at out + i*outstep.  neighbors[k] points at the k-th
+ * neighbour of the first point, in the order the neighborhood iterator
+ * visits them, and the k-th neighbour of point i is at
+ * neighbors[k] + i*step.
+ */
+typedef void (*npy_stencil_func_t)(char **neighbors, npy_intp step,
+                                   npy_intp n, char *out, npy_intp outstep,
+                                   void *data);
+
+NDARRAY_API int
+NpyArray_NeighborhoodStencil(struct NpyArray *in, struct NpyArray *out,
+                             npy_intp *bounds, int mode, void *fill,
+                             npy_stencil_func_t func, void *data);
+
 /* General: those work for any mode */
 static NPY_INLINE int
 NpyArrayNeighborhoodIter_Reset(NpyArrayNeighborhoodIterObject* iter);
@@ -16,6 +16,8 @@
 #include "npy_iterators.h"
 #include "npy_os.h"
 #include "npy_calculation.h"
+#include "npy_threads.h"
+#include "npy_cpu_features.h"
 
 #if defined(_WIN32)
 #include <Windows.h>
@@ -70,6 +72,8 @@ npy_initlib(struct NpyArray_FunctionDefs *functionDefs,
 
     npy_enable_threads = enable_threads;
     npy_disable_threads = disable_threads;
+    npy_threads_init();
+    npy_cpu_init();
     
     // Verify that the structure definition is correct and has the memory layout
     // that we expect. 
@@ -617,7 +621,7 @@ NpyArray_CopyAndTranspose(NpyArray *arr)
 {
     NpyArray *ret, *tmp;
     int nd, eltsize, stride2;
-    npy_intp dims[2], i, j;
+    npy_intp dims[2], tstrides[2], i, j;
     char *iptr, *optr;
     NPY_BEGIN_THREADS_DEF;
 
@@ -651,17 +655,23 @@ NpyArray_CopyAndTranspose(NpyArray *arr)
         return NULL;
     }
 
-    /* do 2-d loop */
+    /* do 2-d loop, in tiles when the array is big enough */
     NPY_BEGIN_THREADS;
     optr = NpyArray_DATA(ret);
     stride2 = eltsize * dims[0];
-    for (i = 0; i < dims[0]; i++) {
-        iptr = NpyArray_BYTES(arr) + i * eltsize;
-        for (j = 0; j < dims[1]; j++) {
-            /* optr[i,j] = iptr[j,i] */
-            memcpy(optr, iptr, eltsize);
-            optr += eltsize;
-            iptr += stride2;
+    tstrides[0] = NpyArray_STRIDE(arr, 1);
+    tstrides[1] = NpyArray_STRIDE(arr, 0);
+    if (!NpyArray_ISALIGNED(arr) ||
+        _tiled_strided_copy(optr, NpyArray_STRIDES(ret), NpyArray_BYTES(arr),
+                            tstrides, dims, 2, eltsize) != 0) {
+        for (i = 0; i < dims[0]; i++) {
+            iptr = NpyArray_BYTES(arr) + i * eltsize;
+            for (j = 0; j < dims[1]; j++) {
+                /* optr[i,j] = iptr[j,i] */
+                memcpy(optr, iptr, eltsize);
+                optr += eltsize;
+                iptr += stride2;
+            }
         }
     }
     NPY_END_THREADS;
@@ -164,6 +164,93 @@ NpyArray_SetNumericOp(enum NpyArray_Ops op, NpyUFuncObject *func)
 }
 
 
+/*
+ * Temporary elision.  In an expression such as a + b + c the result of
+ * a + b is dropped as soon as c has been added to it, so it can take
+ * the result itself instead of a newly allocated array.  The core
+ * reference count cannot tell whether the interface still refers to an
+ * array, so this is only done once the interface has installed a
+ * function which confirms it, and only for arrays large enough that
+ * the allocation costs more than the checks.
+ */
+#define NPY_ELIDE_DEFAULT_BYTES (256 * 1024)
+
+static npy_temp_elision_func npy_elision_func = NULL;
+static npy_intp npy_elision_bytes = NPY_ELIDE_DEFAULT_BYTES;
+
+
+/*
+ * Sets the function confirming that an operand of a binary operator is
+ * a temporary which nothing else refers to, and the smallest size in
+ * bytes at which it is asked.  A NULL function turns elision off and a
+ * size of 0 restores the default.
+ */
+NDARRAY_API void
+NpyArray_SetTempElision(npy_temp_elision_func func, npy_intp minbytes)
+{
+    npy_elision_func = func;
+    npy_elision_bytes = (minbytes > 0) ? minbytes : NPY_ELIDE_DEFAULT_BYTES;
+}
+
+
+/*
+ * True if m, operand i of the binary ufunc op, can be overwritten with
+ * the result: it owns its data, has the shape and type of the result
+ * and is a temporary according to the interface.
+ */
+static int
+_can_elide_temp(NpyUFuncObject *op, NpyArray **ops, int i)
+{
+    NpyArray *m = ops[i];
+    NpyArray *other = ops[1 - i];
+    int arg_types[NPY_MAXARGS];
+    NPY_SCALARKIND scalars[NPY_MAXARGS];
+    NpyUFuncGenericFunction function;
+    void *data;
+    int j, diff;
+
+    if (npy_elision_func == NULL || m->nob_refcnt > 1 ||
+        op->nin != 2 || op->nout != 1 || op->core_enabled ||
+        !NpyArray_CHKFLAGS(m, NPY_OWNDATA | NPY_BEHAVED) ||
+        NpyArray_CHKFLAGS(m, NPY_UPDATEIFCOPY) ||
+        NpyArray_BASE_ARRAY(m) != NULL || NpyArray_BASE(m) != NULL ||
+        !NpyArray_ISNOTSWAPPED(m) || NpyDataType_REFCHK(NpyArray_DESCR(m)) ||
+        NpyArray_NBYTES(m) < npy_elision_bytes) {
+        return 0;
+    }
+
+    /* The other operand must broadcast to m without enlarging it */
+    diff = NpyArray_NDIM(m) - NpyArray_NDIM(other);
+    if (diff < 0) {
+        return 0;
+    }
+    for (j = 0; j < NpyArray_NDIM(other); j++) {
+        if (NpyArray_DIM(other, j) != 1 &&
+            NpyArray_DIM(other, j) != NpyArray_DIM(m, j + diff)) {
+            return 0;
+        }
+    }
+
+    /* The selected loop must produce the type of m */
+    for (j = 0; j < 2; j++) {
+        NpyArray *ao = ops[j];
+
+        arg_types[j] = NpyArray_TYPE(ao);
+        scalars[j] = (NpyArray_NDIM(ao) > 0) ? NPY_NOSCALAR :
+            NpyArray_ScalarKind(arg_types[j], &ao);
+    }
+    if (npy_ufunc_select_loop(op, arg_types, scalars, &function, &data) < 0) {
+        NpyErr_Clear();
+        return 0;
+    }
+    if (arg_types[2] != NpyArray_TYPE(m)) {
+        return 0;
+    }
+
+    return npy_elision_func(m);
+}
+
+
 NDARRAY_API NpyArray *
 NpyArray_GenericBinaryFunction(NpyArray *m1, NpyArray *m2, NpyUFuncObject *op,
                                NpyArray *out)
@@ -182,6 +269,32 @@ NpyArray_GenericBinaryFunction(NpyArray *m1, NpyArray *m2, NpyUFuncObject *op,
     Npy_XINCREF(out);
     mps[2] = out;
 
+    /* Write the result into a temporary operand if there is one */
+    if (out == NULL) {
+        for (i = 0; i < 2; i++) {
+            if (_can_elide_temp(op, mps, i)) {
+                mps[2] = mps[i];
+                break;
+            }
+        }
+    }
+
+    /* A 0-d operand against an array is applied as a scalar */
+    for (i = 0; i < 2; i++) {
+        NpyArray *s = mps[i];
+
+        if (NpyArray_NDIM(s) == 0 && NpyArray_NDIM(mps[1 - i]) > 0 &&
+            NpyArray_ISALIGNED(s) && NpyArray_ISNOTSWAPPED(s) &&
+            !NpyTypeNum_ISEXTENDED(NpyArray_TYPE(s)) &&
+            !NpyDataType_REFCHK(NpyArray_DESCR(s))) {
+            result = NpyUFunc_ScalarFunction(op, mps[1 - i], NpyArray_TYPE(s),
+                                             NpyArray_BYTES(s), i == 0,
+                                             mps[2]);
+            Npy_XDECREF(out);
+            return result;
+        }
+    }
+
     for (i = 0; i < 3; i++) {
         Npy_XINCREF(mps[i]);
     }
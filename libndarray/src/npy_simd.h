@@ -0,0 +1,63 @@
+#ifndef _NPY_SIMD_H_
+#define _NPY_SIMD_H_
+
+/*
+ * Support for the explicitly vectorized inner loops in npy_loops.c.src.
+ *
+ * SSE2 is part of every x86-64 processor, so it is used whenever the
+ * compiler targets it.  On other platforms the loops fall back to plain
+ * C written so that the compiler can vectorize it.
+ *
+ * Versions for newer instruction sets are compiled when the compiler
+ * can generate them for single functions, which are marked with the
+ * NPY_TARGET_* macros, and are only called after npy_cpu_features.c
+ * has found them supported by the processor.
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NPY_HAVE_SSE2_INTRINSICS
+#include <emmintrin.h>
+#endif
+
+#if defined(NPY_HAVE_SSE2_INTRINSICS)
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define NPY_HAVE_AVX2_INTRINSICS
+#define NPY_HAVE_AVX512F_INTRINSICS
+#define NPY_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define NPY_TARGET_AVX512F __attribute__((target("avx512f")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && _MSC_VER >= 1700
+#define NPY_HAVE_AVX2_INTRINSICS
+#define NPY_TARGET_AVX2
+#if _MSC_VER >= 1911
+#define NPY_HAVE_AVX512F_INTRINSICS
+#define NPY_TARGET_AVX512F
+#endif
+#include <immintrin.h>
+#endif
+#endif
+
+#define NPY_TARGET_SSE2
+
+/* Vector types by width and element type, for use in templates */
+#define npy_vec128ps __m128
+#define npy_vec128pd __m128d
+#define npy_vec256ps __m256
+#define npy_vec256pd __m256d
+#define npy_vec512ps __m512
+#define npy_vec512pd __m512d
+
+
+/*
+ * True if the na bytes at a and the nb bytes at b are either the same
+ * memory or do not overlap at all.  Vectorized loops read several
+ * elements ahead of the ones they write, which gives different results
+ * from the scalar loops when an output partially overlaps an input.
+ */
+#define NPY_SIMD_NOPARTIAL_OVERLAP(a, na, b, nb)                        \
+    (((char *)(a) == (char *)(b) && (na) == (nb)) ||                    \
+     (char *)(a) + (na) <= (char *)(b) ||                               \
+     (char *)(b) + (nb) <= (char *)(a))
+
+#endif
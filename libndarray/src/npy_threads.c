@@ -0,0 +1,554 @@
+/*
+ *  npy_threads.c -
+ *
+ *  Worker thread pool used to split loops across several threads, and
+ *  the per-thread cache of scratch buffers used by loops.
+ */
+
+#include <stdlib.h>
+
+#include "npy_config.h"
+#include "npy_api.h"
+#include "npy_threads.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+
+/*
+ * Thin wrappers around the native mutex / condition variable types.
+ */
+#if defined(_WIN32)
+
+typedef CRITICAL_SECTION npy_mutex;
+typedef CONDITION_VARIABLE npy_cond;
+
+#define npy_mutex_init(m)       InitializeCriticalSection(m)
+#define npy_mutex_lock(m)       EnterCriticalSection(m)
+#define npy_mutex_unlock(m)     LeaveCriticalSection(m)
+#define npy_cond_init(c)        InitializeConditionVariable(c)
+#define npy_cond_wait(c, m)     SleepConditionVariableCS(c, m, INFINITE)
+#define npy_cond_signal(c)      WakeConditionVariable(c)
+#define npy_cond_broadcast(c)   WakeAllConditionVariable(c)
+
+#else
+
+typedef pthread_mutex_t npy_mutex;
+typedef pthread_cond_t npy_cond;
+
+#define npy_mutex_init(m)       pthread_mutex_init(m, NULL)
+#define npy_mutex_lock(m)       pthread_mutex_lock(m)
+#define npy_mutex_unlock(m)     pthread_mutex_unlock(m)
+#define npy_cond_init(c)        pthread_cond_init(c, NULL)
+#define npy_cond_wait(c, m)     pthread_cond_wait(c, m)
+#define npy_cond_signal(c)      pthread_cond_signal(c)
+#define npy_cond_broadcast(c)   pthread_cond_broadcast(c)
+
+#endif
+
+
+/*
+ * Thread local storage for the buffer caches.  The destructor frees the
+ * cache of a thread when the thread exits.
+ */
+#if defined(_WIN32)
+
+typedef DWORD npy_tls_key;
+
+#define npy_tls_create(k, d)    ((*(k) = FlsAlloc(d)) != FLS_OUT_OF_INDEXES)
+#define npy_tls_get(k)          FlsGetValue(k)
+#define npy_tls_set(k, v)       (FlsSetValue(k, v) != 0)
+#define NPY_TLS_DESTRUCTOR      static void WINAPI
+
+#else
+
+typedef pthread_key_t npy_tls_key;
+
+#define npy_tls_create(k, d)    (pthread_key_create(k, d) == 0)
+#define npy_tls_get(k)          pthread_getspecific(k)
+#define npy_tls_set(k, v)       (pthread_setspecific(k, v) == 0)
+#define NPY_TLS_DESTRUCTOR      static void
+
+#endif
+
+
+static int npy_num_threads = 1;
+static npy_intp npy_threads_threshold = NPY_THREADS_DEFAULT_THRESHOLD;
+
+/*
+ * Pool state.  Everything below is protected by pool_lock.  Workers
+ * sleep on work_cond until the generation count changes, run their
+ * share of the job if their id is below job_nthreads and then
+ * decrement pending.  The caller waits on done_cond for pending to
+ * reach zero.
+ */
+static npy_mutex pool_lock;
+static npy_cond work_cond;
+static npy_cond done_cond;
+static int pool_initialized = 0;
+static int pool_started = 0;    /* Number of workers, excluding the caller */
+static int pool_busy = 0;
+static unsigned long pool_generation = 0;
+static unsigned long pool_spawn_generation = 0;
+static npy_thread_work_func job_func;
+static void *job_arg;
+static int job_nthreads;
+static int job_pending;
+
+
+static void
+pool_init(void)
+{
+    npy_mutex_init(&pool_lock);
+    npy_cond_init(&work_cond);
+    npy_cond_init(&done_cond);
+    pool_started = 0;
+    pool_busy = 0;
+    pool_initialized = 1;
+}
+
+
+#if defined(_WIN32)
+static unsigned __stdcall
+#else
+static void *
+#endif
+pool_worker(void *p)
+{
+    int tid = (int)(npy_intp)p;
+    unsigned long seen;
+    npy_thread_work_func func;
+    void *arg;
+    int nthreads;
+
+    npy_mutex_lock(&pool_lock);
+    /*
+     * The job we were started for may already have been posted by the
+     * time we get the lock.
+     */
+    seen = pool_spawn_generation;
+    for (;;) {
+        while (seen == pool_generation) {
+            npy_cond_wait(&work_cond, &pool_lock);
+        }
+        seen = pool_generation;
+        if (tid >= job_nthreads) {
+            continue;
+        }
+        func = job_func;
+        arg = job_arg;
+        nthreads = job_nthreads;
+        npy_mutex_unlock(&pool_lock);
+
+        func(arg, tid, nthreads);
+
+        npy_mutex_lock(&pool_lock);
+        if (--job_pending == 0) {
+            npy_cond_signal(&done_cond);
+        }
+    }
+#if !defined(_WIN32)
+    return NULL;
+#endif
+}
+
+
+/*
+ * Starts workers until there are n of them.  Called with pool_lock
+ * held.  Returns the number of workers actually available.
+ */
+static int
+pool_grow(int n)
+{
+    pool_spawn_generation = pool_generation;
+    while (pool_started < n) {
+        npy_intp tid = pool_started + 1;
+#if defined(_WIN32)
+        HANDLE h = (HANDLE)_beginthreadex(NULL, 0, pool_worker,
+                                          (void *)tid, 0, NULL);
+        if (h == 0) {
+            break;
+        }
+        CloseHandle(h);
+#else
+        pthread_t thread;
+        pthread_attr_t attr;
+        int ret;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, pool_worker, (void *)tid);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+            break;
+        }
+#endif
+        pool_started++;
+    }
+    return pool_started;
+}
+
+
+#if !defined(_WIN32)
+/*
+ * The workers do not survive a fork, so the child starts over with an
+ * empty pool.
+ */
+static void
+pool_atfork_child(void)
+{
+    pool_init();
+}
+#endif
+
+
+/*
+ * Sets the number of threads used by parallel loops and returns the
+ * previous value.  Values less than 1 select serial execution.
+ */
+NDARRAY_API int
+NpyThreads_SetNumThreads(int nthreads)
+{
+    int old = npy_num_threads;
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    else if (nthreads > NPY_MAXTHREADS) {
+        nthreads = NPY_MAXTHREADS;
+    }
+    npy_num_threads = nthreads;
+    return old;
+}
+
+
+NDARRAY_API int
+NpyThreads_GetNumThreads(void)
+{
+    return npy_num_threads;
+}
+
+
+/*
+ * Sets the minimum number of elements a loop must have before it is
+ * split across threads.  Returns the previous value.
+ */
+NDARRAY_API npy_intp
+NpyThreads_SetThreshold(npy_intp threshold)
+{
+    npy_intp old = npy_threads_threshold;
+
+    npy_threads_threshold = (threshold < 1) ? 1 : threshold;
+    return old;
+}
+
+
+NDARRAY_API npy_intp
+NpyThreads_GetThreshold(void)
+{
+    return npy_threads_threshold;
+}
+
+
+/*
+ * Returns the number of threads to use for a loop over size elements
+ * which can be split into at most nchunks independent pieces.
+ */
+NDARRAY_API int
+NpyThreads_WorkerCount(npy_intp size, npy_intp nchunks)
+{
+    int n = npy_num_threads;
+
+    if (n <= 1 || size < npy_threads_threshold) {
+        return 1;
+    }
+    if (nchunks < n) {
+        n = (int)nchunks;
+    }
+    return (n < 1) ? 1 : n;
+}
+
+
+/*
+ * Calls func(arg, tid, nthreads) once for every tid in [0, nthreads)
+ * and returns when all calls have completed.  Thread id 0 runs on the
+ * caller.  If the pool is already in use (by another thread or by a
+ * nested call from a worker) or workers cannot be started, the
+ * remaining ids are run on the caller instead.
+ */
+NDARRAY_API void
+NpyThreads_Run(npy_thread_work_func func, void *arg, int nthreads)
+{
+    int i, nworkers;
+
+    if (nthreads <= 1) {
+        func(arg, 0, 1);
+        return;
+    }
+    if (!pool_initialized) {
+        for (i = 0; i < nthreads; i++) {
+            func(arg, i, nthreads);
+        }
+        return;
+    }
+
+    npy_mutex_lock(&pool_lock);
+    if (pool_busy) {
+        npy_mutex_unlock(&pool_lock);
+        for (i = 0; i < nthreads; i++) {
+            func(arg, i, nthreads);
+        }
+        return;
+    }
+    nworkers = pool_grow(nthreads - 1);
+    if (nworkers > nthreads - 1) {
+        nworkers = nthreads - 1;
+    }
+    pool_busy = 1;
+    job_func = func;
+    job_arg = arg;
+    job_nthreads = nthreads;
+    job_pending = nworkers;
+    pool_generation++;
+    npy_cond_broadcast(&work_cond);
+    npy_mutex_unlock(&pool_lock);
+
+    func(arg, 0, nthreads);
+    for (i = nworkers + 1; i < nthreads; i++) {
+        func(arg, i, nthreads);
+    }
+
+    npy_mutex_lock(&pool_lock);
+    while (job_pending > 0) {
+        npy_cond_wait(&done_cond, &pool_lock);
+    }
+    pool_busy = 0;
+    npy_mutex_unlock(&pool_lock);
+}
+
+
+/*
+ * Splits [0, n) into nthreads nearly equal contiguous pieces and
+ * returns the piece belonging to tid as [*start, *end).
+ */
+NDARRAY_API void
+NpyThreads_Partition(npy_intp n, int tid, int nthreads,
+                     npy_intp *start, npy_intp *end)
+{
+    npy_intp chunk = n / nthreads;
+    npy_intp rem = n % nthreads;
+
+    *start = tid * chunk + ((tid < rem) ? tid : rem);
+    *end = *start + chunk + ((tid < rem) ? 1 : 0);
+}
+
+
+/*
+ * Scratch buffers.  A buffer is preceded by a header recording its
+ * capacity and the address actually allocated.  Released buffers are
+ * kept in a small cache belonging to the thread which released them, up
+ * to NPY_BUFFER_CACHE_BYTES in all, and handed out again to the next
+ * request from that thread which fits.  A cached buffer has already
+ * been touched, so reusing it also avoids the page faults of fresh
+ * memory.
+ */
+typedef struct {
+    void *base;                 /* as returned by npy_malloc */
+    npy_intp size;              /* usable bytes */
+} npy_buffer_header;
+
+typedef struct {
+    int n;
+    npy_intp nbytes;
+    char *bufs[NPY_BUFFER_CACHE_SIZE];
+} npy_buffer_cache;
+
+static npy_tls_key buffer_key;
+static int buffer_key_created = 0;
+
+#define NPY_BUFFER_HEADER(buf) (((npy_buffer_header *)(buf)) - 1)
+
+
+static void
+buffer_release(char *buf)
+{
+    npy_free(NPY_BUFFER_HEADER(buf)->base);
+}
+
+
+NPY_TLS_DESTRUCTOR
+buffer_cache_destroy(void *p)
+{
+    npy_buffer_cache *cache = (npy_buffer_cache *)p;
+    int i;
+
+    if (cache == NULL) {
+        return;
+    }
+    for (i = 0; i < cache->n; i++) {
+        buffer_release(cache->bufs[i]);
+    }
+    npy_free(cache);
+}
+
+
+/* Returns the cache of the calling thread, creating it if create is set */
+static npy_buffer_cache *
+buffer_cache_get(int create)
+{
+    npy_buffer_cache *cache;
+
+    if (!buffer_key_created) {
+        return NULL;
+    }
+    cache = (npy_buffer_cache *)npy_tls_get(buffer_key);
+    if (cache == NULL && create) {
+        cache = (npy_buffer_cache *)npy_malloc(sizeof(npy_buffer_cache));
+        if (cache == NULL) {
+            return NULL;
+        }
+        cache->n = 0;
+        cache->nbytes = 0;
+        if (!npy_tls_set(buffer_key, cache)) {
+            npy_free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+
+/*
+ * Returns a buffer of at least size bytes aligned to NPY_BUFFER_ALIGN,
+ * or NULL if it cannot be allocated.  The contents are undefined.  The
+ * buffer must be released with NpyThreads_BufferFree, from any thread.
+ */
+NDARRAY_API void *
+NpyThreads_BufferAlloc(npy_intp size)
+{
+    npy_buffer_cache *cache = buffer_cache_get(0);
+    npy_buffer_header *header;
+    char *base, *buf;
+    int i, best = -1;
+
+    if (size < 1) {
+        size = 1;
+    }
+    if (cache != NULL) {
+        for (i = 0; i < cache->n; i++) {
+            npy_intp bsize = NPY_BUFFER_HEADER(cache->bufs[i])->size;
+
+            if (bsize >= size && (best < 0 || bsize <
+                    NPY_BUFFER_HEADER(cache->bufs[best])->size)) {
+                best = i;
+            }
+        }
+        if (best >= 0) {
+            buf = cache->bufs[best];
+            cache->nbytes -= NPY_BUFFER_HEADER(buf)->size;
+            cache->bufs[best] = cache->bufs[--cache->n];
+            return buf;
+        }
+    }
+
+    /* Round up so that the buffer fits more of the later requests */
+    size = (size + NPY_BUFFER_ALIGN - 1) & ~(npy_intp)(NPY_BUFFER_ALIGN - 1);
+    base = npy_malloc(size + sizeof(npy_buffer_header) + NPY_BUFFER_ALIGN);
+    if (base == NULL) {
+        return NULL;
+    }
+    buf = (char *)(((npy_uintp)base + sizeof(npy_buffer_header) +
+                    NPY_BUFFER_ALIGN - 1) &
+                   ~(npy_uintp)(NPY_BUFFER_ALIGN - 1));
+    header = NPY_BUFFER_HEADER(buf);
+    header->base = base;
+    header->size = size;
+    return buf;
+}
+
+
+/*
+ * Releases a buffer returned by NpyThreads_BufferAlloc into the cache of
+ * the calling thread.  When the cache is full the smallest buffer is
+ * freed.
+ */
+NDARRAY_API void
+NpyThreads_BufferFree(void *p)
+{
+    npy_buffer_cache *cache;
+    char *buf = (char *)p;
+    npy_intp size;
+    int i, smallest;
+
+    if (buf == NULL) {
+        return;
+    }
+    size = NPY_BUFFER_HEADER(buf)->size;
+    cache = (size <= NPY_BUFFER_CACHE_BYTES) ? buffer_cache_get(1) : NULL;
+    if (cache == NULL) {
+        buffer_release(buf);
+        return;
+    }
+    while (cache->n > 0 && (cache->n == NPY_BUFFER_CACHE_SIZE ||
+                            cache->nbytes + size > NPY_BUFFER_CACHE_BYTES)) {
+        smallest = 0;
+        for (i = 1; i < cache->n; i++) {
+            if (NPY_BUFFER_HEADER(cache->bufs[i])->size <
+                NPY_BUFFER_HEADER(cache->bufs[smallest])->size) {
+                smallest = i;
+            }
+        }
+        cache->nbytes -= NPY_BUFFER_HEADER(cache->bufs[smallest])->size;
+        buffer_release(cache->bufs[smallest]);
+        cache->bufs[smallest] = cache->bufs[--cache->n];
+    }
+    cache->bufs[cache->n++] = buf;
+    cache->nbytes += size;
+}
+
+
+/*
+ * Frees the buffers cached by the calling thread.
+ */
+NDARRAY_API void
+NpyThreads_BufferCacheClear(void)
+{
+    npy_buffer_cache *cache = buffer_cache_get(0);
+
+    while (cache != NULL && cache->n > 0) {
+        buffer_release(cache->bufs[--cache->n]);
+    }
+    if (cache != NULL) {
+        cache->nbytes = 0;
+    }
+}
+
+
+/*
+ * Called once from npy_initlib.
+ */
+void
+npy_threads_init(void)
+{
+    char *env;
+
+    if (!pool_initialized) {
+        pool_init();
+#if !defined(_WIN32)
+        pthread_atfork(NULL, NULL, pool_atfork_child);
+#endif
+    }
+    if (!buffer_key_created) {
+        buffer_key_created = npy_tls_create(&buffer_key,
+                                            buffer_cache_destroy);
+    }
+
+    env = getenv("NPY_NUM_THREADS");
+    if (env != NULL && atoi(env) > 0) {
+        NpyThreads_SetNumThreads(atoi(env));
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef _NPY_THREADS_H_
+#define _NPY_THREADS_H_
+
+#include "npy_common.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+
+/*
+ * A small pool of worker threads used to run loops in parallel.  The
+ * pool is opt-in: the default number of threads is 1 and nothing is
+ * started until more threads are requested, either by calling
+ * NpyThreads_SetNumThreads or through the NPY_NUM_THREADS environment
+ * variable read in npy_initlib.
+ *
+ * Work is handed out as a function which is called once for each
+ * thread id in [0, nthreads).  Thread id 0 always runs on the calling
+ * thread.  Work functions must not call back into the interface layer
+ * and must not use reference counting.
+ */
+
+typedef void (*npy_thread_work_func)(void *arg, int tid, int nthreads);
+
+/* Upper limit on the number of threads */
+#define NPY_MAXTHREADS 256
+
+/* Default minimum number of elements a loop must have to be split */
+#define NPY_THREADS_DEFAULT_THRESHOLD 65536
+
+/*
+ * Loops borrow their scratch buffers from a cache kept by every thread,
+ * holding at most NPY_BUFFER_CACHE_SIZE buffers and NPY_BUFFER_CACHE_BYTES
+ * bytes.  Buffers are aligned to NPY_BUFFER_ALIGN bytes.
+ */
+#define NPY_BUFFER_CACHE_SIZE 4
+#define NPY_BUFFER_CACHE_BYTES (4 * 1024 * 1024)
+#define NPY_BUFFER_ALIGN 64
+
+
+NDARRAY_API int
+NpyThreads_SetNumThreads(int nthreads);
+NDARRAY_API int
+NpyThreads_GetNumThreads(void);
+NDARRAY_API npy_intp
+NpyThreads_SetThreshold(npy_intp threshold);
+NDARRAY_API npy_intp
+NpyThreads_GetThreshold(void);
+
+NDARRAY_API int
+NpyThreads_WorkerCount(npy_intp size, npy_intp nchunks);
+NDARRAY_API void
+NpyThreads_Run(npy_thread_work_func func, void *arg, int nthreads);
+NDARRAY_API void
+NpyThreads_Partition(npy_intp n, int tid, int nthreads,
+                     npy_intp *start, npy_intp *end);
+
+NDARRAY_API void *
+NpyThreads_BufferAlloc(npy_intp size);
+NDARRAY_API void
+NpyThreads_BufferFree(void *buf);
+NDARRAY_API void
+NpyThreads_BufferCacheClear(void);
+
+void
+npy_threads_init(void);
+
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
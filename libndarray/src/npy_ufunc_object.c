@@ -13,6 +13,8 @@
 #include "npy_arrayobject.h"
 #include "npy_iterators.h"
 #include "npy_ufunc_object.h"
+#include "npy_threads.h"
+#include "npy_cpu_features.h"
 #include "npy_os.h"
 #include "npy_math.h"
 #include "npy_internal.h"
@@ -49,6 +51,45 @@ _create_reduce_copy(NpyUFuncReduceObject *loop, NpyArray **arr, int rtype);
 static int
 _create_copies(NpyUFuncLoopObject *loop, int *arg_types, NpyArray **mps);
 static int
+ufuncloop_execute(NpyUFuncLoopObject *loop, NpyArray **mps);
+static void
+_get_array_extent(NpyArray *ap, char **low, char **high);
+static int
+ufuncloop_nthreads(NpyUFuncLoopObject *loop, NpyArray **mps);
+static int
+ufuncloop_execute_parallel(NpyUFuncLoopObject *loop, NpyArray **mps,
+                           int nthreads);
+struct ufuncreduce_rows;
+static int
+ufuncreduce_rows_init(NpyUFuncReduceObject *loop, NpyArray *arr, int axis,
+                      struct ufuncreduce_rows *rows);
+static void
+ufuncreduce_rows_execute(NpyUFuncReduceObject *loop,
+                         struct ufuncreduce_rows *rows,
+                         npy_intp start, npy_intp end);
+static int
+ufuncreduce_nthreads(NpyUFuncReduceObject *loop, NpyArray *arr,
+                     struct ufuncreduce_rows *rows, npy_intp *nchunks);
+static int
+ufuncreduce_execute_parallel(NpyUFuncReduceObject *loop,
+                             struct ufuncreduce_rows *rows,
+                             npy_intp nchunks, int nthreads);
+static int
+ufuncaccumulate_execute_parallel(NpyUFuncReduceObject *loop,
+                                 npy_intp nchunks, int nthreads);
+struct ufuncreduceat_parallel;
+static void
+ufuncreduceat_batch(struct ufuncreduceat_parallel *par, char *ip, char *op,
+                    npy_intp i, npy_intp r, char *buf);
+static void
+ufuncreduceat_execute(struct ufuncreduceat_parallel *par,
+                      npy_intp start, npy_intp end);
+static int
+ufuncreduceat_nthreads(struct ufuncreduceat_parallel *par, NpyArray *arr);
+static void
+ufuncreduceat_execute_parallel(struct ufuncreduceat_parallel *par,
+                               int nthreads);
+static int
 _compute_dimension_size(NpyUFuncLoopObject *loop, NpyArray **mps, int i);
 static npy_intp*
 _compute_output_dims(NpyUFuncLoopObject *loop, int iarg,
@@ -124,15 +165,49 @@ int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
                              int originalArgWasObjArray,
                              npy_prepare_outputs_func prepare_outputs,
                              void *prepare_out_args)
+{
+    return NpyUFunc_GenericFunctionWhere(self, nargs, mps, NULL,
+                                         ntypenums, rtypenums,
+                                         originalArgWasObjArray,
+                                         prepare_outputs, prepare_out_args);
+}
+
+
+/*
+ * Like NpyUFunc_GenericFunction, but only computes the elements for
+ * which the broadcast where array is true.  The other elements of the
+ * outputs are left as they are, so are undefined in allocated outputs.
+ * A NULL where computes every element.
+ */
+int NpyUFunc_GenericFunctionWhere(NpyUFuncObject *self, int nargs,
+                                  NpyArray **mps, NpyArray *where,
+                                  int ntypenums, int *rtypenums,
+                                  int originalArgWasObjArray,
+                                  npy_prepare_outputs_func prepare_outputs,
+                                  void *prepare_out_args)
 {
     NpyUFuncLoopObject *loop;
     char *name = (NULL != self->name) ? self->name : "";
     int res;
     int i;
+    int nthreads;
     NPY_BEGIN_THREADS_DEF
 
     assert(NPY_VALID_MAGIC == self->nob_magic_number);
 
+    if (where != NULL) {
+        if (self->core_enabled) {
+            NpyErr_SetString(NpyExc_ValueError,
+                    "where is not supported for ufuncs with a signature");
+            return -1;
+        }
+        if (self->nargs >= NPY_MAXARGS) {
+            NpyErr_SetString(NpyExc_ValueError,
+                    "too many arguments to use where");
+            return -1;
+        }
+    }
+
     NpyUFunc_clearfperr();
 
     /* Build the loop. */
@@ -142,6 +217,17 @@ int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
     }
     fp_error_state(&loop->bufsize, &loop->errormask, &loop->errobj);
 
+    if (where != NULL) {
+        loop->where = NpyArray_FromArray(where,
+                                         NpyArray_DescrFromType(NPY_BOOL),
+                                         NPY_FORCECAST | NPY_ALIGNED);
+        if (loop->where == NULL) {
+            ufuncloop_dealloc(loop);
+            return -1;
+        }
+        loop->iter->iters[self->nargs] = NULL;
+    }
+
     /* Setup the arrays */
     res = construct_arrays(loop, nargs, mps, ntypenums, rtypenums,
                            prepare_outputs, prepare_out_args);
@@ -177,6 +263,361 @@ int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
     }
 
     NPY_LOOP_BEGIN_THREADS;
+    nthreads = ufuncloop_nthreads(loop, mps);
+    if (nthreads > 1) {
+        res = ufuncloop_execute_parallel(loop, mps, nthreads);
+    }
+    else {
+        res = ufuncloop_execute(loop, mps);
+    }
+    if (res < 0) {
+        goto fail;
+    }
+
+    NPY_LOOP_END_THREADS;
+    for (i=0; i<nargs; i++) {
+        if (mps[i] && (mps[i]->flags&NPY_UPDATEIFCOPY)) {
+            NpyArray_ForceUpdate(mps[i]);
+        }
+    }
+
+    ufuncloop_dealloc(loop);
+    return 0;
+
+fail:
+    NPY_LOOP_END_THREADS;
+    if (loop) {
+        if (loop->objfunc) {
+            char **castbuf = loop->castbuf;
+            npy_intp *steps = loop->steps;
+            int ninnerloops = loop->ninnerloops;
+            int j;
+
+            /*
+             * DECREF castbuf when underlying function used
+             * object arrays and casting was needed to get
+             * to object arrays
+             */
+            for (i = 0; i < self->nargs; i++) {
+                if (loop->cast[i]) {
+                    if (steps[i] == 0) {
+                        NpyInterface_DECREF(*((void **)castbuf[i]));
+                    }
+                    else {
+                        int size = loop->bufsize;
+
+                        void **objptr = (void **)castbuf[i];
+                        /*
+                         * size is loop->bufsize unless there
+                         * was only one loop
+                         */
+                        if (ninnerloops == 1) {
+                            size = loop->leftover;
+                        }
+                        for (j = 0; j < size; j++) {
+                            NpyInterface_DECREF(*objptr);
+                            *objptr = NULL;
+                            objptr += 1;
+                        }
+                    }
+                }
+            }
+        }
+        ufuncloop_dealloc(loop);
+    }
+    return -1;
+}
+
+
+/* Types the scalar fast path leaves to the general machinery */
+#define _SCALAR_SLOWTYPE(t) (NpyTypeNum_ISEXTENDED(t) || (t) == NPY_OBJECT || \
+                             (t) == NPY_DATETIME || (t) == NPY_TIMEDELTA)
+
+/*
+ * True if ap can be stepped through with a single stride, the way the
+ * ONE_UFUNCLOOP method does it.
+ */
+static int
+_scalar_onestride(NpyArray *ap)
+{
+    return (NpyArray_ISCONTIGUOUS(ap) || NpyArray_NDIM(ap) <= 1) &&
+        NpyArray_ISALIGNED(ap) && NpyArray_ISNOTSWAPPED(ap);
+}
+
+
+/*
+ * Applies the binary ufunc self to the array arr and a scalar of type
+ * scalar_type at scalar, given in native byte order, which is the first
+ * operand if scalar_first is set and the second otherwise.  This gives
+ * the same result as passing the scalar as a 0-d array, but when arr and
+ * out can be stepped through with one stride the inner loop is called
+ * directly, with the scalar cast to the loop type and a zero step, and
+ * no iterators or buffers are set up.  A 0-d arr is itself a scalar to
+ * the loop selection and always takes the general path.  out may be
+ * NULL.  Returns a new reference to the result.
+ */
+NpyArray *
+NpyUFunc_ScalarFunction(NpyUFuncObject *self, NpyArray *arr, int scalar_type,
+                        void *scalar, int scalar_first, NpyArray *out)
+{
+    union {
+        npy_clongdouble align;
+        char bytes[4*sizeof(npy_clongdouble)];
+    } sbuf;
+    int arg_types[NPY_MAXARGS];
+    NPY_SCALARKIND scalars[NPY_MAXARGS];
+    NpyUFuncGenericFunction function;
+    void *funcdata;
+    char *args[NPY_MAXARGS];
+    npy_intp steps[NPY_MAXARGS];
+    npy_intp n;
+    NpyArray *ret = NULL;
+    NpyArray_Descr *descr;
+    int ai = scalar_first ? 1 : 0;
+    int si = 1 - ai;
+    int selsize;
+    int bufsize, errormask, first = 1;
+    void *errobj;
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+
+    if (self->nin != 2 || self->nout != 1 || self->core_enabled ||
+        _SCALAR_SLOWTYPE(scalar_type) ||
+        _SCALAR_SLOWTYPE(NpyArray_TYPE(arr)) || NpyArray_NDIM(arr) == 0 ||
+        !_scalar_onestride(arr) || NpyArray_SIZE(arr) == 0) {
+        goto general;
+    }
+    if (NpyThreads_GetNumThreads() > 1 &&
+        NpyArray_SIZE(arr) >= NpyThreads_GetThreshold()) {
+        goto general;
+    }
+
+    /* Select the loop with the rules construct_arrays applies */
+    arg_types[ai] = NpyArray_TYPE(arr);
+    arg_types[si] = scalar_type;
+    scalars[ai] = NPY_NOSCALAR;
+    descr = NpyArray_DescrFromType(scalar_type);
+    selsize = descr->elsize;
+    Npy_DECREF(descr);
+    if (NpyTypeNum_ISSIGNED(scalar_type)) {
+        char msb = ((char *)scalar)[NpyArray_ISNBO(NPY_LITTLE) ?
+                                     selsize - 1 : 0];
+
+        scalars[si] = (msb & 0x80) ? NPY_INTNEG_SCALAR : NPY_INTPOS_SCALAR;
+    }
+    else {
+        scalars[si] = NpyArray_ScalarKind(scalar_type, NULL);
+    }
+    if (npy_ufunc_select_loop(self, arg_types, scalars,
+                              &function, &funcdata) < 0) {
+        return NULL;
+    }
+    if (arg_types[ai] != NpyArray_TYPE(arr) ||
+        _SCALAR_SLOWTYPE(arg_types[2])) {
+        goto general;
+    }
+
+    if (out != NULL) {
+        char *olow, *ohigh, *alow, *ahigh;
+
+        if (NpyArray_TYPE(out) != arg_types[2] || !_scalar_onestride(out) ||
+            !NpyArray_ISWRITEABLE(out) ||
+            NpyArray_NDIM(out) != NpyArray_NDIM(arr) ||
+            !NpyArray_CompareLists(NpyArray_DIMS(out), NpyArray_DIMS(arr),
+                                   NpyArray_NDIM(arr))) {
+            goto general;
+        }
+        /* Only an exact alias of the input may overlap it */
+        _get_array_extent(out, &olow, &ohigh);
+        _get_array_extent(arr, &alow, &ahigh);
+        if (olow < ahigh && alow < ohigh &&
+            (NpyArray_BYTES(out) != NpyArray_BYTES(arr) ||
+             (NpyArray_NDIM(arr) > 0 &&
+              NpyArray_STRIDE(out, NpyArray_NDIM(out) - 1) !=
+              NpyArray_STRIDE(arr, NpyArray_NDIM(arr) - 1)))) {
+            goto general;
+        }
+        ret = out;
+        Npy_INCREF(ret);
+    }
+    else {
+        ret = NpyArray_New(NULL, NpyArray_NDIM(arr), NpyArray_DIMS(arr),
+                           arg_types[2], NULL, NULL, 0, 0, NULL);
+        if (ret == NULL) {
+            return NULL;
+        }
+    }
+
+    /* The scalar in the type of the loop */
+    if (arg_types[si] == scalar_type) {
+        memcpy(sbuf.bytes, scalar, selsize);
+    }
+    else {
+        NpyArray_VectorUnaryFunc *cast;
+        union {
+            npy_clongdouble align;
+            char bytes[sizeof(sbuf)];
+        } tmp;
+
+        descr = NpyArray_DescrFromType(scalar_type);
+        cast = NpyArray_GetCastFunc(descr, arg_types[si]);
+        Npy_DECREF(descr);
+        if (cast == NULL) {
+            Npy_DECREF(ret);
+            return NULL;
+        }
+        memcpy(tmp.bytes, scalar, selsize);
+        cast(tmp.bytes, sbuf.bytes, 1, NULL, NULL);
+    }
+
+    n = NpyArray_SIZE(arr);
+    args[ai] = NpyArray_BYTES(arr);
+    args[si] = sbuf.bytes;
+    args[2] = NpyArray_BYTES(ret);
+    steps[si] = 0;
+    if (n == 1) {
+        steps[ai] = 0;
+        steps[2] = 0;
+    }
+    else {
+        steps[ai] = NpyArray_STRIDE(arr, NpyArray_NDIM(arr) - 1);
+        steps[2] = NpyArray_STRIDE(ret, NpyArray_NDIM(ret) - 1);
+    }
+
+    fp_error_state(&bufsize, &errormask, &errobj);
+    NpyUFunc_clearfperr();
+    function(args, &n, steps, funcdata);
+    if (errormask &&
+        NpyUFunc_checkfperr(self->name, errormask, errobj, &first)) {
+        NpyInterface_DECREF(errobj);
+        Npy_DECREF(ret);
+        return NULL;
+    }
+    NpyInterface_DECREF(errobj);
+    return ret;
+
+ general:
+    {
+        NpyArray *mps[NPY_MAXARGS];
+        int i;
+
+        descr = NpyArray_DescrFromType(scalar_type);
+        mps[si] = NpyArray_NewFromDescr(descr, 0, NULL, NULL, NULL, 0,
+                                        NPY_FALSE, NULL, NULL);
+        if (mps[si] == NULL) {
+            return NULL;
+        }
+        memcpy(NpyArray_BYTES(mps[si]), scalar, NpyArray_ITEMSIZE(mps[si]));
+        mps[ai] = arr;
+        Npy_INCREF(arr);
+        mps[2] = out;
+        Npy_XINCREF(out);
+
+        if (NpyUFunc_GenericFunction(self, 3, mps, 0, NULL, NPY_FALSE,
+                                     NULL, NULL) < 0) {
+            ret = NULL;
+        }
+        else {
+            /* mps[2] may be a temporary copy of out */
+            ret = (out != NULL) ? out : mps[2];
+            Npy_INCREF(ret);
+        }
+        for (i = 0; i < 3; i++) {
+            if (mps[i] != NULL) {
+                if (mps[i]->flags & NPY_UPDATEIFCOPY) {
+                    NpyArray_ForceUpdate(mps[i]);
+                }
+                Npy_DECREF(mps[i]);
+            }
+        }
+        return ret;
+    }
+}
+
+#undef _SCALAR_SLOWTYPE
+
+
+/* True if any of the eight bytes of w is zero */
+#define _NPY_MASK_HASZERO(w)                                            \
+    ((((w) - (npy_uint64)0x0101010101010101ULL) & ~(w) &                \
+      (npy_uint64)0x8080808080808080ULL) != 0)
+
+/*
+ * Calls the inner loop once for each run of elements whose mask is true,
+ * skipping the others.  A contiguous mask is scanned eight bytes at a
+ * time, so long runs of either value cost little more than a memchr.
+ */
+static void
+_ufunc_masked_call(NpyUFuncLoopObject *loop, char **args, npy_intp n,
+                   npy_intp *steps, char *mask, npy_intp maskstep)
+{
+    int nargs = loop->ufunc->nargs;
+    char *ptrs[NPY_MAXARGS];
+    npy_uint64 w;
+    npy_intp i, start, count;
+    int j;
+
+    if (maskstep == 0) {
+        if (*mask) {
+            loop->function(args, &n, steps, loop->funcdata);
+        }
+        return;
+    }
+    i = 0;
+    while (i < n) {
+        if (maskstep == 1) {
+            while (i + 8 <= n) {
+                memcpy(&w, mask + i, 8);
+                if (w != 0) {
+                    break;
+                }
+                i += 8;
+            }
+        }
+        while (i < n && !mask[i*maskstep]) {
+            i++;
+        }
+        if (i == n) {
+            break;
+        }
+        start = i;
+        if (maskstep == 1) {
+            while (i + 8 <= n) {
+                memcpy(&w, mask + i, 8);
+                if (_NPY_MASK_HASZERO(w)) {
+                    break;
+                }
+                i += 8;
+            }
+        }
+        while (i < n && mask[i*maskstep]) {
+            i++;
+        }
+
+        count = i - start;
+        for (j = 0; j < nargs; j++) {
+            ptrs[j] = args[j] + start*steps[j];
+        }
+        loop->function(ptrs, &count, steps, loop->funcdata);
+        if ((loop->obj & NPY_UFUNC_OBJ_NEEDS_API) && NpyErr_Occurred()) {
+            return;
+        }
+    }
+}
+
+#undef _NPY_MASK_HASZERO
+
+
+/*
+ * Runs the inner loops for loop->iter->index up to loop->iter->size using
+ * the method selected by construct_arrays.  Returns -1 on error.
+ */
+static int
+ufuncloop_execute(NpyUFuncLoopObject *loop, NpyArray **mps)
+{
+    NpyUFuncObject *self = loop->ufunc;
+    int i;
+
     switch(loop->meth) {
         case ONE_UFUNCLOOP:
             /*
@@ -186,8 +627,16 @@ int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
              * increment moves through the entire array.
              */
             /*fprintf(stderr, "ONE...%d\n", loop->size);*/
-            loop->function((char **)loop->bufptr, &(loop->iter->size),
-                           loop->steps, loop->funcdata);
+            if (loop->where != NULL) {
+                _ufunc_masked_call(loop, (char **)loop->bufptr,
+                                   loop->iter->size, loop->steps,
+                                   loop->bufptr[self->nargs],
+                                   loop->steps[self->nargs]);
+            }
+            else {
+                loop->function((char **)loop->bufptr, &(loop->iter->size),
+                               loop->steps, loop->funcdata);
+            }
             NPY_UFUNC_CHECK_ERROR(loop);
             break;
         case NOBUFFER_UFUNCLOOP:
@@ -196,15 +645,23 @@ int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
              * right type but not contiguous. -- Almost as fast.
              */
             while (loop->iter->index < loop->iter->size) {
-                for (i = 0; i < self->nargs; i++) {
+                for (i = 0; i < loop->iter->numiter; i++) {
                     loop->bufptr[i] = loop->iter->iters[i]->dataptr;
                 }
-                loop->function((char **)loop->bufptr, &(loop->bufcnt),
-                               loop->steps, loop->funcdata);
+                if (loop->where != NULL) {
+                    _ufunc_masked_call(loop, (char **)loop->bufptr,
+                                       loop->bufcnt, loop->steps,
+                                       loop->bufptr[self->nargs],
+                                       loop->steps[self->nargs]);
+                }
+                else {
+                    loop->function((char **)loop->bufptr, &(loop->bufcnt),
+                                   loop->steps, loop->funcdata);
+                }
                 NPY_UFUNC_CHECK_ERROR(loop);
 
                 /* Adjust loop pointers */
-                for (i = 0; i < self->nargs; i++) {
+                for (i = 0; i < loop->iter->numiter; i++) {
                     NpyArray_ITER_NEXT(loop->iter->iters[i]);
                 }
                 loop->iter->index++;
@@ -469,389 +926,1232 @@ int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
             }
         } /* end of last case statement */
     }
+    NPY_UFUNC_CHECK_ERROR_END(loop);
+    return 0;
 
-    NPY_LOOP_END_THREADS;
-    for (i=0; i<nargs; i++) {
-        if (mps[i] && (mps[i]->flags&NPY_UPDATEIFCOPY)) {
-            NpyArray_ForceUpdate(mps[i]);
+fail:
+    return -1;
+}
+
+
+/*
+ * Parallel execution of ONE_UFUNCLOOP, NOBUFFER_UFUNCLOOP and
+ * BUFFER_UFUNCLOOP.  The outer iteration space (the whole 1-d range for
+ * ONE_UFUNCLOOP) is split into contiguous pieces and each worker runs
+ * ufuncloop_execute on a private copy of the loop object with its own
+ * iterators, buffers and floating point status.
+ */
+struct ufuncloop_parallel {
+    NpyUFuncLoopObject *loop;
+    NpyArray **mps;
+    NpyArrayIterObject *iters;  /* nthreads * nargs iterator copies */
+    char *buffers;              /* nthreads - 1 extra buffer blocks */
+    npy_intp *core_dims;        /* nthreads copies of core_dim_sizes */
+    int *fpstatus;
+};
+
+
+/*
+ * Returns the lowest and one-past-the-highest addresses touched by ap.
+ */
+static void
+_get_array_extent(NpyArray *ap, char **low, char **high)
+{
+    npy_intp lo = 0, hi = NpyArray_ITEMSIZE(ap);
+    int i;
+
+    for (i = 0; i < NpyArray_NDIM(ap); i++) {
+        npy_intp ext = (NpyArray_DIM(ap, i) - 1) * NpyArray_STRIDE(ap, i);
+
+        if (NpyArray_DIM(ap, i) == 0) {
+            lo = hi = 0;
+            break;
+        }
+        if (ext < 0) {
+            lo += ext;
+        }
+        else {
+            hi += ext;
         }
     }
+    *low = NpyArray_BYTES(ap) + lo;
+    *high = NpyArray_BYTES(ap) + hi;
+}
 
-    ufuncloop_dealloc(loop);
-    return 0;
 
-fail:
-    NPY_LOOP_END_THREADS;
-    if (loop) {
-        if (loop->objfunc) {
-            char **castbuf = loop->castbuf;
-            npy_intp *steps = loop->steps;
-            int ninnerloops = loop->ninnerloops;
-            int j;
+/*
+ * Returns 1 if some output shares memory with an input in any way other
+ * than being exactly the same view of it.  Those loops depend on the
+ * serial iteration order and are not split.
+ */
+static int
+_outputs_overlap_inputs(NpyUFuncLoopObject *loop, NpyArray **mps)
+{
+    NpyUFuncObject *self = loop->ufunc;
+    char *olow, *ohigh, *ilow, *ihigh;
+    int i, j;
 
-            /*
-             * DECREF castbuf when underlying function used
-             * object arrays and casting was needed to get
-             * to object arrays
-             */
-            for (i = 0; i < self->nargs; i++) {
-                if (loop->cast[i]) {
-                    if (steps[i] == 0) {
-                        NpyInterface_DECREF(*((void **)castbuf[i]));
-                    }
-                    else {
-                        int size = loop->bufsize;
-
-                        void **objptr = (void **)castbuf[i];
-                        /*
-                         * size is loop->bufsize unless there
-                         * was only one loop
-                         */
-                        if (ninnerloops == 1) {
-                            size = loop->leftover;
-                        }
-                        for (j = 0; j < size; j++) {
-                            NpyInterface_DECREF(*objptr);
-                            *objptr = NULL;
-                            objptr += 1;
-                        }
-                    }
-                }
+    for (i = self->nin; i < self->nargs; i++) {
+        _get_array_extent(mps[i], &olow, &ohigh);
+        for (j = 0; j < self->nargs; j++) {
+            if (j == i) {
+                continue;
+            }
+            _get_array_extent(mps[j], &ilow, &ihigh);
+            if (ohigh <= ilow || ihigh <= olow) {
+                continue;
+            }
+            if (j >= self->nin ||
+                NpyArray_NDIM(mps[i]) != NpyArray_NDIM(mps[j]) ||
+                NpyArray_BYTES(mps[i]) != NpyArray_BYTES(mps[j]) ||
+                !NpyArray_CompareLists(NpyArray_DIMS(mps[i]),
+                                       NpyArray_DIMS(mps[j]),
+                                       NpyArray_NDIM(mps[i])) ||
+                !NpyArray_CompareLists(NpyArray_STRIDES(mps[i]),
+                                       NpyArray_STRIDES(mps[j]),
+                                       NpyArray_NDIM(mps[i]))) {
+                return 1;
             }
         }
-        ufuncloop_dealloc(loop);
     }
-    return -1;
+    return 0;
 }
 
 
+/*
+ * Returns the number of threads to run the loop with, 1 if the loop
+ * should run serially.
+ */
+static int
+ufuncloop_nthreads(NpyUFuncLoopObject *loop, NpyArray **mps)
+{
+    npy_intp size;
+    npy_intp nchunks = loop->iter->size;
+    int i;
+
+    if (NpyThreads_GetNumThreads() <= 1 || loop->obj) {
+        return 1;
+    }
+    switch (loop->meth) {
+        case ONE_UFUNCLOOP:
+            size = loop->iter->size;
+            break;
+        case NOBUFFER_UFUNCLOOP:
+        case BUFFER_UFUNCLOOP:
+            size = loop->iter->size * loop->bufcnt;
+            break;
+        case SIGNATURE_NOBUFFER_UFUNCLOOP:
+            if (loop->iter->nd == 0) {
+                return 1;
+            }
+            /* Rows of outer elements are split too; count the core work */
+            nchunks = loop->iter->size * loop->bufcnt;
+            size = nchunks;
+            for (i = 1; i <= loop->ufunc->core_num_dim_ix; i++) {
+                size *= loop->core_dim_sizes[i];
+            }
+            break;
+        default:
+            return 1;
+    }
+    if (size < NpyThreads_GetThreshold() ||
+        _outputs_overlap_inputs(loop, mps)) {
+        return 1;
+    }
+    return NpyThreads_WorkerCount(size, nchunks);
+}
 
 
-NpyArray *
-NpyUFunc_GenericReduction(NpyUFuncObject *self, NpyArray *arr, NpyArray *indices,
-                          NpyArray *out, int axis, NpyArray_Descr *otype, int operation)
+/*
+ * Runs the outer elements [start, end) of a generalized ufunc loop,
+ * numbering them along the rows of loop->bufcnt elements which each
+ * call of the core function is given.  iters and dims receive copies of
+ * the operand iterators and of core_dim_sizes, since the first core
+ * dimension changes for partial rows.
+ */
+static void
+ufuncloop_signature_range(NpyUFuncLoopObject *loop,
+                          NpyArrayIterObject *iters, npy_intp *dims,
+                          npy_intp start, npy_intp end)
 {
-    static char *_reduce_type[] = {"reduce", "accumulate", "reduceat", NULL};
+    int nargs = loop->ufunc->nargs;
+    npy_intp n = loop->bufcnt;
+    npy_intp off = start % n;
+    char *ptrs[NPY_MAXARGS];
+    int i;
 
-    NpyArray *ret = NULL;
-    
-    /* Check to see if input is zero-dimensional */
-    if (NpyArray_NDIM(arr) == 0) {
-        char buf[256];
-        
-        sprintf(buf, "cannot %s on a scalar",
-                _reduce_type[operation]);
-        NpyErr_SetString(NpyExc_TypeError, buf);
-        Npy_DECREF(arr);
-        return NULL;
-    }
-    /* Check to see that type (and otype) is not FLEXIBLE */
-    if (NpyArray_ISFLEXIBLE(arr) ||
-        (NULL != otype && NpyTypeNum_ISFLEXIBLE(otype->type_num))) {
-        char buf[256];
-        
-        sprintf(buf, "cannot perform %s with flexible type",
-                _reduce_type[operation]);
-        NpyErr_SetString(NpyExc_TypeError, buf);
-        return NULL;
+    memcpy(dims, loop->core_dim_sizes,
+           (loop->ufunc->core_num_dim_ix + 1) * sizeof(npy_intp));
+    for (i = 0; i < nargs; i++) {
+        iters[i] = *loop->iter->iters[i];
+        NpyArray_IterGotoIndex(&iters[i], start / n);
     }
-    
-    if (axis < 0) {
-        axis += NpyArray_NDIM(arr);
+    while (start < end) {
+        dims[0] = n - off;
+        if (dims[0] > end - start) {
+            dims[0] = end - start;
+        }
+        for (i = 0; i < nargs; i++) {
+            ptrs[i] = iters[i].dataptr + off * loop->core_strides[i];
+        }
+        loop->function(ptrs, dims, loop->core_strides, loop->funcdata);
+        start += dims[0];
+        off = 0;
+        for (i = 0; i < nargs; i++) {
+            NpyArray_ITER_NEXT(&iters[i]);
+        }
     }
-    if (axis < 0 || axis >= NpyArray_NDIM(arr)) {
-        NpyErr_SetString(NpyExc_ValueError, "axis not in array");
-        return NULL;
+}
+
+
+static void
+ufuncloop_worker(void *arg, int tid, int nthreads)
+{
+    struct ufuncloop_parallel *par = (struct ufuncloop_parallel *)arg;
+    NpyUFuncLoopObject *loop = par->loop;
+    NpyUFuncLoopObject wloop;
+    NpyArrayMultiIterObject witer;
+    npy_intp start, end;
+    int nargs = loop->ufunc->nargs;
+    int niters = loop->iter->numiter;
+    int i;
+
+    if (loop->meth == SIGNATURE_NOBUFFER_UFUNCLOOP) {
+        NpyThreads_Partition(loop->iter->size * loop->bufcnt,
+                             tid, nthreads, &start, &end);
+        if (start < end) {
+            ufuncloop_signature_range(loop, &par->iters[tid * niters],
+                    par->core_dims +
+                    tid * (loop->ufunc->core_num_dim_ix + 1),
+                    start, end);
+        }
+        par->fpstatus[tid] = NpyUFunc_getfperr();
+        return;
     }
-    
-    /*
-     * If out is specified it determines otype
-     * unless otype already specified.
-     */
-    if (otype == NULL && out != NULL) {
-        otype = NpyArray_DESCR(out);
-        Npy_INCREF(otype);
+
+    NpyThreads_Partition(loop->iter->size, tid, nthreads, &start, &end);
+
+    wloop = *loop;
+    witer = *loop->iter;
+    wloop.iter = &witer;
+    /* Errors are collected from fpstatus once all workers are done. */
+    wloop.errormask = 0;
+
+    if (loop->meth == ONE_UFUNCLOOP) {
+        for (i = 0; i < niters; i++) {
+            wloop.bufptr[i] += start * loop->steps[i];
+        }
+        witer.index = 0;
+        witer.size = end - start;
     }
-    if (otype == NULL) {
-        /*
-         * For integer types --- make sure at least a long
-         * is used for add and multiply reduction to avoid overflow
-         */
-        int typenum = NpyArray_TYPE(arr);
-        if ((typenum < NPY_FLOAT)
-            && ((strcmp(self->name,"add") == 0)
-                || (strcmp(self->name,"multiply") == 0))) {
-                if (NpyTypeNum_ISBOOL(typenum)) {
-                    typenum = NPY_LONG;
-                }
-                else if ((size_t)NpyArray_ITEMSIZE(arr) < sizeof(long)) {
-                    if (NpyTypeNum_ISUNSIGNED(typenum)) {
-                        typenum = NPY_ULONG;
-                    }
-                    else {
-                        typenum = NPY_LONG;
-                    }
+    else {
+        NpyArray_MultiIterRangeInit(&witer, &par->iters[tid * niters],
+                                    loop->iter, start, end);
+
+        if (loop->meth == BUFFER_UFUNCLOOP && tid > 0) {
+            char *base = loop->buffer[0];
+            char *wbase = par->buffers + (tid - 1) * (npy_intp)loop->memsize;
+
+            for (i = 0; i < nargs; i++) {
+                if (!loop->needbuffer[i]) {
+                    continue;
                 }
+                wloop.buffer[i] = wbase + (loop->buffer[i] - base);
+                if (loop->cast[i]) {
+                    wloop.castbuf[i] = wbase + (loop->castbuf[i] - base);
+                }
+                wloop.bufptr[i] = wbase + (loop->bufptr[i] - base);
             }
-        otype = NpyArray_DescrFromType(typenum);
+        }
     }
-        
-    
-    switch(operation) {
-        case NPY_UFUNC_REDUCE:
-            ret = NpyUFunc_Reduce(self, arr, out, axis,
-                                  otype->type_num);
-            break;
-        case NPY_UFUNC_ACCUMULATE:
-            ret = NpyUFunc_Accumulate(self, arr, out, axis,
-                                      otype->type_num);
-            break;
-        case NPY_UFUNC_REDUCEAT:
-            ret = NpyUFunc_Reduceat(self, arr, indices, out,
-                                    axis, otype->type_num);
-            Npy_DECREF(indices);
-            break;
-        default:
-            assert(0);
-            break;
+
+    if (start < end) {
+        ufuncloop_execute(&wloop, par->mps);
     }
-    return ret;
+    par->fpstatus[tid] = NpyUFunc_getfperr();
+}
+
+
+static int
+ufuncloop_execute_parallel(NpyUFuncLoopObject *loop, NpyArray **mps,
+                           int nthreads)
+{
+    struct ufuncloop_parallel par;
+    int fpstatus[NPY_MAXTHREADS];
+    int retstatus = 0;
+    int i;
+
+    par.loop = loop;
+    par.mps = mps;
+    par.iters = NULL;
+    par.buffers = NULL;
+    par.core_dims = NULL;
+    par.fpstatus = fpstatus;
+
+    if (loop->meth != ONE_UFUNCLOOP) {
+        par.iters = (NpyArrayIterObject *)
+            npy_malloc(nthreads * loop->iter->numiter *
+                       sizeof(NpyArrayIterObject));
+        if (par.iters == NULL) {
+            return ufuncloop_execute(loop, mps);
+        }
+    }
+    if (loop->meth == BUFFER_UFUNCLOOP) {
+        par.buffers = NpyThreads_BufferAlloc((nthreads - 1) *
+                                             (npy_intp)loop->memsize);
+        if (par.buffers == NULL) {
+            npy_free(par.iters);
+            return ufuncloop_execute(loop, mps);
+        }
+    }
+    if (loop->meth == SIGNATURE_NOBUFFER_UFUNCLOOP) {
+        par.core_dims = (npy_intp *)
+            npy_malloc(nthreads * (loop->ufunc->core_num_dim_ix + 1) *
+                       sizeof(npy_intp));
+        if (par.core_dims == NULL) {
+            npy_free(par.iters);
+            return ufuncloop_execute(loop, mps);
+        }
+    }
+
+    NpyThreads_Run(ufuncloop_worker, &par, nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+        retstatus |= fpstatus[i];
+    }
+    if (loop->errormask) {
+        fp_error_handler((NULL != loop->ufunc->name) ? loop->ufunc->name : "",
+                         loop->errormask, loop->errobj, retstatus,
+                         &loop->first);
+    }
+
+    if (par.buffers != NULL) {
+        NpyThreads_BufferFree(par.buffers);
+    }
+    if (par.iters != NULL) {
+        npy_free(par.iters);
+    }
+    if (par.core_dims != NULL) {
+        npy_free(par.core_dims);
+    }
+    return 0;
 }
 
 
+/*
+ * Reduction along an axis other than the innermost one, for example the
+ * column sums of a C-contiguous matrix.  Instead of reducing one strided
+ * column at a time, whole rows are accumulated element-wise into a row
+ * of the output, so that both are read contiguously.  Rows are split
+ * into blocks small enough that the block of the output stays in cache
+ * while every row is added into it.
+ */
+struct ufuncreduce_rows {
+    NpyArrayIterObject it;      /* over the rows, excluding the last axis */
+    npy_intp len;               /* elements in a row */
+    npy_intp stride;            /* input stride along a row */
+    npy_intp rowstride;         /* input stride along the reduced axis */
+    npy_intp block;             /* elements in a block */
+    npy_intp nblocks;           /* blocks in a row */
+    npy_intp ntasks;            /* rows * nblocks */
+};
+
+/* Bytes of output in a block and minimum row length to accumulate rows */
+#define NPY_REDUCE_ROWBLOCK 8192
+#define NPY_REDUCE_MINROW 4
+
+#define _NPY_ABS_STRIDE(s) ((s) < 0 ? -(s) : (s))
+
 
 /*
- * We have two basic kinds of loops. One is used when arr is not-swapped
- * and aligned and output type is the same as input type.  The other uses
- * buffers when one of these is not satisfied.
- *
- *  Zero-length and one-length axes-to-be-reduced are handled separately.
+ * Returns 1 if the output of a reduction shares memory with its input.
+ * The result then depends on the serial order of the loop.
  */
-NpyArray *
-NpyUFunc_Reduce(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
-               int axis, int otype)
+static int
+_reduce_output_overlaps(NpyUFuncReduceObject *loop, NpyArray *arr)
 {
-    NpyArray *ret = NULL;
-    NpyUFuncReduceObject *loop;
-    npy_intp i, n;
-    char *dptr;
-    NPY_BEGIN_THREADS_DEF
+    char *olow, *ohigh, *ilow, *ihigh;
 
-    assert(arr == NULL ||
-           (NPY_VALID_MAGIC == arr->nob_magic_number &&
-            NPY_VALID_MAGIC == NpyArray_DESCR(arr)->nob_magic_number));
-    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+    _get_array_extent(loop->ret, &olow, &ohigh);
+    _get_array_extent(arr, &ilow, &ihigh);
+    return ohigh > ilow && ihigh > olow;
+}
 
-    /* Construct loop object */
-    loop = construct_reduce(self, &arr, out, axis, otype, NPY_UFUNC_REDUCE, 0);
-    if (!loop) {
-        return NULL;
+
+/*
+ * Returns 1 and fills in rows if the reduction of arr along axis should
+ * accumulate rows, 0 to reduce one output element at a time.
+ */
+static int
+ufuncreduce_rows_init(NpyUFuncReduceObject *loop, NpyArray *arr, int axis,
+                      struct ufuncreduce_rows *rows)
+{
+    int last = NpyArray_NDIM(arr) - 1;
+
+    if (loop->obj || loop->meth != NOBUFFER_UFUNCLOOP || axis == last ||
+        NpyArray_DIM(arr, last) < NPY_REDUCE_MINROW ||
+        _NPY_ABS_STRIDE(NpyArray_STRIDE(arr, axis)) <=
+        _NPY_ABS_STRIDE(NpyArray_STRIDE(arr, last)) ||
+        _reduce_output_overlaps(loop, arr)) {
+        return 0;
     }
 
-    NPY_LOOP_BEGIN_THREADS;
-    switch(loop->meth) {
-        case ZERO_EL_REDUCELOOP:
-            /* fprintf(stderr, "ZERO..%d\n", loop->size); */
-            for (i = 0; i < loop->size; i++) {
-                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                    void** pDest = (void**)loop->bufptr[0];
-                    *pDest = NpyInterface_INCREF(*((void **)loop->idptr));
-                } else {
-                    memmove(loop->bufptr[0], loop->idptr, loop->outsize);
-                }
-                loop->bufptr[0] += loop->outsize;
-            }
-            break;
-        case ONE_EL_REDUCELOOP:
-            /*fprintf(stderr, "ONEDIM..%d\n", loop->size); */
-            while (loop->index < loop->size) {
-                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                    void** pDest = (void**)loop->bufptr[0];
-                    *pDest = NpyInterface_INCREF(*((void **)loop->it->dataptr));
-                } else {
-                    memmove(loop->bufptr[0], loop->it->dataptr, loop->outsize);
-                }
-                NpyArray_ITER_NEXT(loop->it);
-                loop->bufptr[0] += loop->outsize;
-                loop->index++;
-            }
-            break;
-        case NOBUFFER_UFUNCLOOP:
-            /*fprintf(stderr, "NOBUFFER..%d\n", loop->size); */
-            while (loop->index < loop->size) {
-                /* Copy first element to output */
-                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                    void** pDest = (void**)loop->bufptr[0];
-                    *pDest = NpyInterface_INCREF(*((void **)loop->it->dataptr));
-                } else {
-                    memmove(loop->bufptr[0], loop->it->dataptr, loop->outsize);
-                }
-                /* Adjust input pointer */
-                loop->bufptr[1] = loop->it->dataptr+loop->steps[1];
-                loop->function((char **)loop->bufptr, &(loop->N),
-                               loop->steps, loop->funcdata);
-                NPY_UFUNC_CHECK_ERROR(loop);
-                NpyArray_ITER_NEXT(loop->it);
-                loop->bufptr[0] += loop->outsize;
-                loop->bufptr[2] = loop->bufptr[0];
-                loop->index++;
+    rows->it = *loop->it;
+    rows->it.size /= NpyArray_DIM(arr, last);
+    rows->it.dims_m1[last] = 0;
+    rows->it.backstrides[last] = 0;
+    rows->len = NpyArray_DIM(arr, last);
+    rows->stride = NpyArray_STRIDE(arr, last);
+    rows->rowstride = loop->steps[1];
+    rows->block = NPY_REDUCE_ROWBLOCK / loop->outsize;
+    if (rows->block < 1) {
+        rows->block = 1;
+    }
+    rows->nblocks = (rows->len + rows->block - 1) / rows->block;
+    rows->ntasks = rows->it.size * rows->nblocks;
+    return 1;
+}
+
+
+/*
+ * Reduces the blocks [start, end), numbered in C order over the output
+ * rows and the blocks within them.
+ */
+static void
+ufuncreduce_rows_execute(NpyUFuncReduceObject *loop,
+                         struct ufuncreduce_rows *rows,
+                         npy_intp start, npy_intp end)
+{
+    NpyArrayIterObject it;
+    char *bufptr[3], *in, *out;
+    npy_intp steps[3];
+    npy_intp i, j, k, n, row = -1;
+    int outsize = loop->outsize;
+
+    it = rows->it;
+    steps[0] = outsize;
+    steps[1] = rows->stride;
+    steps[2] = outsize;
+    for (i = start; i < end; i++) {
+        if (i / rows->nblocks != row) {
+            row = i / rows->nblocks;
+            NpyArray_IterGotoIndex(&it, row);
+        }
+        j = (i % rows->nblocks) * rows->block;
+        n = rows->len - j;
+        if (n > rows->block) {
+            n = rows->block;
+        }
+        in = it.dataptr + j * rows->stride;
+        out = loop->bufptr[0] + (row * rows->len + j) * outsize;
+
+        /* Copy the first row over to the output */
+        if (rows->stride == outsize) {
+            memmove(out, in, n * outsize);
+        }
+        else {
+            for (k = 0; k < n; k++) {
+                memmove(out + k * outsize, in + k * rows->stride, outsize);
             }
-            break;
-        case BUFFER_UFUNCLOOP:
-            /*
-             * use buffer for arr
-             *
-             * For each row to reduce
-             * 1. copy first item over to output (casting if necessary)
-             * 2. Fill inner buffer
-             * 3. When buffer is filled or end of row
-             * a. Cast input buffers if needed
-             * b. Call inner function.
-             * 4. Repeat 2 until row is done.
-             */
-            /* fprintf(stderr, "BUFFERED..%d %d\n", loop->size, loop->swap); */
-            while(loop->index < loop->size) {
-                loop->inptr = loop->it->dataptr;
-                /* Copy (cast) First term over to output */
-                if (loop->cast) {
-                    /* A little tricky because we need to cast it first */
-                    NpyArray_DESCR(arr)->f->copyswap(loop->buffer, loop->inptr,
-                                                     loop->swap, NULL);
-                    loop->cast(loop->buffer, loop->castbuf, 1, NULL, NULL);
-                    if ((loop->obj & NPY_UFUNC_OBJ_ISOBJECT) &&
-                        !NpyArray_ISOBJECT(arr)) {
-                        /*
-                         * In this case the cast function is creating
-                         * an object reference so we need to incref
-                         * it since we care copying it to bufptr[0].
-                         */
-                        void** pDest = (void**)loop->bufptr[0];
-                        *pDest = NpyInterface_INCREF(*((void **)loop->castbuf));
-                    } else {
-                        memcpy(loop->bufptr[0], loop->castbuf, loop->outsize);
-                    }
-                }
-                else {
-                    /* Simple copy */
-                    NpyArray_DESCR(arr)->f->copyswap(loop->bufptr[0],
-                                                     loop->inptr,
-                                                     loop->swap, NULL);
-                }
-                loop->inptr += loop->instrides;
-                n = 1;
-                while(n < loop->N) {
-                    /* Copy up to loop->bufsize elements to buffer */
-                    dptr = loop->buffer;
-                    for (i = 0; i < loop->bufsize; i++, n++) {
-                        if (n == loop->N) {
-                            break;
-                        }
-                        NpyArray_DESCR(arr)->f->copyswap(dptr, loop->inptr,
-                                                         loop->swap, NULL);
-                        loop->inptr += loop->instrides;
-                        dptr += loop->insize;
-                    }
-                    if (loop->cast) {
-                        loop->cast(loop->buffer, loop->castbuf, i, NULL, NULL);
-                    }
-                    loop->function((char **)loop->bufptr, &i,
-                                   loop->steps, loop->funcdata);
-                    loop->bufptr[0] += loop->steps[0]*i;
-                    loop->bufptr[2] += loop->steps[2]*i;
-                    NPY_UFUNC_CHECK_ERROR(loop);
-                }
-                NpyArray_ITER_NEXT(loop->it);
-                loop->bufptr[0] += loop->outsize;
-                loop->bufptr[2] = loop->bufptr[0];
-                loop->index++;
+        }
+        bufptr[0] = out;
+        bufptr[2] = out;
+        for (k = 1; k <= loop->N; k++) {
+            bufptr[1] = in + k * rows->rowstride;
+            loop->function(bufptr, &n, steps, loop->funcdata);
+        }
+    }
+}
+
+
+/*
+ * Parallel execution of the NOBUFFER_UFUNCLOOP reduction.  Reductions
+ * which accumulate rows are split by blocks of the output.  Otherwise,
+ * for ufuncs whose operands can be reordered, each long row is split
+ * into a number of chunks that depends only on its length, also when
+ * running on one thread.  The chunks are reduced into partial results
+ * by the workers, and the partials of a row are then combined pairwise
+ * in a fixed order by the caller, so the result does not depend on the
+ * number of threads or on timing.  Rows which are not split are divided
+ * between the workers and each is reduced exactly as in the serial loop.
+ */
+struct ufuncreduce_parallel {
+    NpyUFuncReduceObject *loop;
+    struct ufuncreduce_rows *rows;  /* NULL unless accumulating rows */
+    npy_intp nchunks;           /* chunks per row, 1 to split rows */
+    char *partials;             /* size * nchunks partial results */
+    int *fpstatus;
+};
+
+/* Minimum number of elements in a chunk and maximum chunks per row */
+#define NPY_REDUCE_MINCHUNK 16384
+#define NPY_REDUCE_MAXCHUNKS 64
+
+
+/*
+ * Returns 1 if the ufunc gives the same result, up to rounding, when
+ * the elements of a reduction are combined in a different order.
+ */
+static int
+_is_reorderable(NpyUFuncObject *self)
+{
+    static const char *names[] = {
+        "add", "multiply", "maximum", "minimum", "fmax", "fmin",
+        "logical_and", "logical_or", "logical_xor",
+        "bitwise_and", "bitwise_or", "bitwise_xor", NULL
+    };
+    int i;
+
+    if (self->name == NULL || self->nin != 2 || self->nout != 1) {
+        return 0;
+    }
+    for (i = 0; names[i] != NULL; i++) {
+        if (strcmp(self->name, names[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Returns the number of threads to run the reduction or accumulation
+ * with, 1 if it should run serially, and sets *nchunks to the number of
+ * chunks each row is split into.  The number of chunks depends only on
+ * the length of the rows, not on the number of threads.
+ */
+static int
+ufuncreduce_nthreads(NpyUFuncReduceObject *loop, NpyArray *arr,
+                     struct ufuncreduce_rows *rows, npy_intp *nchunks)
+{
+    npy_intp size, len = loop->N + 1;
+
+    *nchunks = 1;
+    if (loop->obj || loop->meth != NOBUFFER_UFUNCLOOP ||
+        _reduce_output_overlaps(loop, arr)) {
+        return 1;
+    }
+    if (rows == NULL && _is_reorderable(loop->ufunc)) {
+        *nchunks = len / NPY_REDUCE_MINCHUNK;
+        if (*nchunks > NPY_REDUCE_MAXCHUNKS) {
+            *nchunks = NPY_REDUCE_MAXCHUNKS;
+        }
+        if (*nchunks < 2) {
+            *nchunks = 1;
+        }
+    }
+    size = loop->size * len;
+    if (rows != NULL) {
+        return NpyThreads_WorkerCount(size, rows->ntasks);
+    }
+    return NpyThreads_WorkerCount(size, loop->size * (*nchunks));
+}
+
+
+static void
+ufuncreduce_worker(void *arg, int tid, int nthreads)
+{
+    struct ufuncreduce_parallel *par = (struct ufuncreduce_parallel *)arg;
+    NpyUFuncReduceObject *loop = par->loop;
+    NpyArrayIterObject it;
+    char *bufptr[3];
+    npy_intp start, end, i, row, lo, hi, n;
+    int outsize = loop->outsize;
+
+    if (par->rows != NULL) {
+        NpyThreads_Partition(par->rows->ntasks, tid, nthreads, &start, &end);
+        ufuncreduce_rows_execute(loop, par->rows, start, end);
+        par->fpstatus[tid] = NpyUFunc_getfperr();
+        return;
+    }
+
+    it = *loop->it;
+    NpyThreads_Partition(loop->size * par->nchunks, tid, nthreads,
+                         &start, &end);
+    if (start >= end) {
+        par->fpstatus[tid] = 0;
+        return;
+    }
+
+    if (par->nchunks == 1) {
+        NpyArray_IterGotoIndex(&it, start);
+        bufptr[0] = loop->bufptr[0] + start * outsize;
+        for (i = start; i < end; i++) {
+            memmove(bufptr[0], it.dataptr, outsize);
+            bufptr[1] = it.dataptr + loop->steps[1];
+            bufptr[2] = bufptr[0];
+            loop->function(bufptr, &loop->N, loop->steps, loop->funcdata);
+            NpyArray_ITER_NEXT(&it);
+            bufptr[0] += outsize;
+        }
+    }
+    else {
+        row = -1;
+        for (i = start; i < end; i++) {
+            if (i / par->nchunks != row) {
+                row = i / par->nchunks;
+                NpyArray_IterGotoIndex(&it, row);
             }
+            NpyThreads_Partition(loop->N + 1, (int)(i % par->nchunks),
+                                 (int)par->nchunks, &lo, &hi);
+            bufptr[0] = par->partials + i * outsize;
+            memmove(bufptr[0], it.dataptr + lo * loop->steps[1], outsize);
+            n = hi - lo - 1;
+            if (n > 0) {
+                bufptr[1] = it.dataptr + (lo + 1) * loop->steps[1];
+                bufptr[2] = bufptr[0];
+                loop->function(bufptr, &n, loop->steps, loop->funcdata);
+            }
+        }
+    }
+    par->fpstatus[tid] = NpyUFunc_getfperr();
+}
 
-            if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                /*
-                 * DECREF left-over objects if buffering was used.
-                 * There are 2 cases here.
-                 * 1. The output is an object. In this case the
-                 * castfunc will produce objects and castbuf needs
-                 * to be decrefed.
-                 * 2. The input is an object array.  In this case
-                 * the copyswap will produce object references and
-                 * the buffer needs to be decrefed.
-                 */
-                if (!NpyArray_ISOBJECT(arr)) {
-                    for (i=0; i<loop->bufsize; i++) {
-                        NpyInterface_CLEAR(((void **)loop->castbuf)[i]);
-                    }
-                } else {
-                    for (i=0; i<loop->bufsize; i++) {
-                        NpyInterface_CLEAR(((void **)loop->buffer)[i]);
-                    }
+
+/*
+ * Returns -1 if the buffer for the partial results cannot be allocated,
+ * in which case nothing has been done and the serial loop should be
+ * used.
+ */
+static int
+ufuncreduce_execute_parallel(NpyUFuncReduceObject *loop,
+                             struct ufuncreduce_rows *rows,
+                             npy_intp nchunks, int nthreads)
+{
+    struct ufuncreduce_parallel par;
+    int fpstatus[NPY_MAXTHREADS];
+    int retstatus = 0;
+    npy_intp one = 1, row, c, step;
+    char *bufptr[3], *partials;
+    int i;
+
+    par.loop = loop;
+    par.rows = rows;
+    par.nchunks = nchunks;
+    par.partials = NULL;
+    par.fpstatus = fpstatus;
+    if (nchunks > 1) {
+        par.partials = npy_malloc(loop->size * nchunks * loop->outsize);
+        if (par.partials == NULL) {
+            return -1;
+        }
+    }
+
+    NpyThreads_Run(ufuncreduce_worker, &par, nthreads);
+
+    if (nchunks > 1) {
+        for (row = 0; row < loop->size; row++) {
+            partials = par.partials + row * nchunks * loop->outsize;
+            for (step = 1; step < nchunks; step *= 2) {
+                for (c = 0; c + step < nchunks; c += 2 * step) {
+                    bufptr[0] = partials + c * loop->outsize;
+                    bufptr[1] = partials + (c + step) * loop->outsize;
+                    bufptr[2] = bufptr[0];
+                    loop->function(bufptr, &one, loop->steps,
+                                   loop->funcdata);
                 }
             }
+            memmove(loop->bufptr[0] + row * loop->outsize, partials,
+                    loop->outsize);
+        }
+        npy_free(par.partials);
+        retstatus = NpyUFunc_getfperr();
     }
 
-    NPY_LOOP_END_THREADS;
-    /* Hang on to this reference -- will be decref'd with loop */
-    if (loop->retbase) {
-        ret = loop->ret->base_arr;
-        NpyArray_ForceUpdate(loop->ret);
+    for (i = 0; i < nthreads; i++) {
+        retstatus |= fpstatus[i];
     }
-    else {
-        ret = loop->ret;
+    if (loop->errormask) {
+        fp_error_handler((NULL != loop->ufunc->name) ? loop->ufunc->name : "",
+                         loop->errormask, loop->errobj, retstatus,
+                         &loop->first);
     }
-    Npy_INCREF(ret);
-    ufuncreduce_dealloc(loop);
-    return ret;
+    return 0;
+}
 
-fail:
-    NPY_LOOP_END_THREADS;
-    if (loop) {
-        ufuncreduce_dealloc(loop);
+
+/*
+ * Parallel execution of the NOBUFFER_UFUNCLOOP accumulation.  When there
+ * are enough rows, the rows are split between the workers.  Otherwise,
+ * for ufuncs which can be reordered, each row is scanned in two passes
+ * over chunks as in the parallel reduction.  In the first pass the
+ * workers reduce every chunk to its total, then the caller combines the
+ * totals into the value preceding each chunk, and in the second pass
+ * the workers accumulate every chunk starting from that value.  Rows
+ * are only split when there are threads to spare, so unlike those of
+ * the reduction the rounding of the results depends on the number of
+ * threads.
+ */
+struct ufuncaccumulate_parallel {
+    NpyUFuncReduceObject *loop;
+    npy_intp nchunks;           /* chunks per row, 1 to split rows */
+    int pass;
+    char *totals;               /* size * nchunks chunk totals */
+    char *carries;              /* size * nchunks preceding values */
+    int *fpstatus;
+};
+
+
+static void
+ufuncaccumulate_worker(void *arg, int tid, int nthreads)
+{
+    struct ufuncaccumulate_parallel *par =
+        (struct ufuncaccumulate_parallel *)arg;
+    NpyUFuncReduceObject *loop = par->loop;
+    NpyArrayIterObject it, rit;
+    char *bufptr[3], *in, *out;
+    npy_intp rsteps[3];
+    npy_intp start, end, i, row, lo, hi, n, one = 1;
+    int outsize = loop->outsize;
+
+    it = *loop->it;
+    rit = *loop->rit;
+    NpyThreads_Partition(loop->size * par->nchunks, tid, nthreads,
+                         &start, &end);
+
+    if (par->nchunks == 1) {
+        if (start < end) {
+            NpyArray_IterGotoIndex(&it, start);
+            NpyArray_IterGotoIndex(&rit, start);
+        }
+        for (i = start; i < end; i++) {
+            memmove(rit.dataptr, it.dataptr, outsize);
+            bufptr[0] = rit.dataptr;
+            bufptr[1] = it.dataptr + loop->steps[1];
+            bufptr[2] = rit.dataptr + loop->steps[0];
+            loop->function(bufptr, &loop->N, loop->steps, loop->funcdata);
+            NpyArray_ITER_NEXT(&it);
+            NpyArray_ITER_NEXT(&rit);
+        }
+        par->fpstatus[tid] |= NpyUFunc_getfperr();
+        return;
+    }
+
+    rsteps[0] = 0;
+    rsteps[1] = loop->steps[1];
+    rsteps[2] = 0;
+    row = -1;
+    for (i = start; i < end; i++) {
+        if (i / par->nchunks != row) {
+            row = i / par->nchunks;
+            NpyArray_IterGotoIndex(&it, row);
+            NpyArray_IterGotoIndex(&rit, row);
+        }
+        NpyThreads_Partition(loop->N + 1, (int)(i % par->nchunks),
+                             (int)par->nchunks, &lo, &hi);
+        in = it.dataptr + lo * loop->steps[1];
+        out = rit.dataptr + lo * loop->steps[0];
+        n = hi - lo - 1;
+
+        if (par->pass == 0) {
+            /* The total of the last chunk of a row is not needed */
+            if (i % par->nchunks == par->nchunks - 1) {
+                continue;
+            }
+            bufptr[0] = par->totals + i * outsize;
+            memmove(bufptr[0], in, outsize);
+            if (n > 0) {
+                bufptr[1] = in + loop->steps[1];
+                bufptr[2] = bufptr[0];
+                loop->function(bufptr, &n, rsteps, loop->funcdata);
+            }
+            continue;
+        }
+
+        if (i % par->nchunks == 0) {
+            memmove(out, in, outsize);
+        }
+        else {
+            bufptr[0] = par->carries + i * outsize;
+            bufptr[1] = in;
+            bufptr[2] = out;
+            loop->function(bufptr, &one, loop->steps, loop->funcdata);
+        }
+        if (n > 0) {
+            bufptr[0] = out;
+            bufptr[1] = in + loop->steps[1];
+            bufptr[2] = out + loop->steps[0];
+            loop->function(bufptr, &n, loop->steps, loop->funcdata);
+        }
     }
-    return NULL;
+    par->fpstatus[tid] |= NpyUFunc_getfperr();
 }
 
 
-
-NpyArray *
-NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
-                    int axis, int otype)
+/*
+ * Returns -1 if the buffers for the chunk totals cannot be allocated,
+ * in which case nothing has been done and the serial loop should be
+ * used.
+ */
+static int
+ufuncaccumulate_execute_parallel(NpyUFuncReduceObject *loop,
+                                 npy_intp nchunks, int nthreads)
 {
-    NpyArray *ret = NULL;
-    NpyUFuncReduceObject *loop;
-    npy_intp i, n;
-    char *dptr;
-    NPY_BEGIN_THREADS_DEF
+    struct ufuncaccumulate_parallel par;
+    int fpstatus[NPY_MAXTHREADS];
+    int retstatus = 0;
+    npy_intp one = 1, zero[3] = {0, 0, 0}, t, c;
+    char *bufptr[3];
+    int i;
 
-    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+    par.loop = loop;
+    par.nchunks = nchunks;
+    par.pass = 0;
+    par.totals = NULL;
+    par.carries = NULL;
+    par.fpstatus = fpstatus;
+    for (i = 0; i < nthreads; i++) {
+        fpstatus[i] = 0;
+    }
 
-    /* Construct loop object */
-    loop = construct_reduce(self, &arr, out, axis, otype,
-                            NPY_UFUNC_ACCUMULATE, 0);
-    if (!loop) {
-        return NULL;
+    if (nchunks > 1) {
+        par.totals = npy_malloc(2 * loop->size * nchunks * loop->outsize);
+        if (par.totals == NULL) {
+            return -1;
+        }
+        par.carries = par.totals + loop->size * nchunks * loop->outsize;
+
+        NpyThreads_Run(ufuncaccumulate_worker, &par, nthreads);
+        for (t = 0; t < loop->size * nchunks; t += nchunks) {
+            memmove(par.carries + (t + 1) * loop->outsize,
+                    par.totals + t * loop->outsize, loop->outsize);
+            for (c = t + 2; c < t + nchunks; c++) {
+                bufptr[0] = par.carries + (c - 1) * loop->outsize;
+                bufptr[1] = par.totals + (c - 1) * loop->outsize;
+                bufptr[2] = par.carries + c * loop->outsize;
+                loop->function(bufptr, &one, zero, loop->funcdata);
+            }
+        }
+        retstatus = NpyUFunc_getfperr();
+        par.pass = 1;
     }
+    NpyThreads_Run(ufuncaccumulate_worker, &par, nthreads);
 
-    NPY_LOOP_BEGIN_THREADS;
-    switch(loop->meth) {
-        case ZERO_EL_REDUCELOOP:
-            /* Accumulate */
-            /* fprintf(stderr, "ZERO..%d\n", loop->size); */
-            for (i = 0; i < loop->size; i++) {
-                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                    void** pDest = (void**)loop->bufptr[0];
-                    *pDest = NpyInterface_INCREF(*((void **)loop->idptr));
-                } else {
-                    memcpy(loop->bufptr[0], loop->idptr, loop->outsize);
-                }
-                loop->bufptr[0] += loop->outsize;
+    if (par.totals != NULL) {
+        npy_free(par.totals);
+    }
+    for (i = 0; i < nthreads; i++) {
+        retstatus |= fpstatus[i];
+    }
+    if (loop->errormask) {
+        fp_error_handler((NULL != loop->ufunc->name) ? loop->ufunc->name : "",
+                         loop->errormask, loop->errobj, retstatus,
+                         &loop->first);
+    }
+    return 0;
+}
+
+
+/*
+ * Segments of a NOBUFFER_UFUNCLOOP reduceat, which are independent of
+ * each other and are split between the workers.  Task t is segment
+ * t % nn of row t / nn.  Group-by style reductions have many short
+ * segments, for which calling the inner loop once per segment costs
+ * more than the reduction itself.  Consecutive short segments are
+ * instead reduced as a batch: the segments are sorted by length, the
+ * elements of all segments of one length are gathered into a buffer
+ * with one column per position in the segment, and every column is
+ * combined into the first with a single contiguous call of the inner
+ * loop.  Each segment is still reduced in order.
+ */
+struct ufuncreduceat_parallel {
+    NpyUFuncReduceObject *loop;
+    npy_intp *ind;              /* the nn indices */
+    npy_intp nn;
+    npy_intp len;               /* length of the reduced axis */
+    npy_intp ostride;           /* output stride along the axis */
+    int *fpstatus;
+};
+
+/*
+ * Longest segment in a batch, and fewest and most segments in a batch.
+ */
+#define NPY_REDUCEAT_MAXSHORT 16
+#define NPY_REDUCEAT_MINBATCH 8
+#define NPY_REDUCEAT_MAXBATCH 1024
+
+/* Length of segment i, which is 1 if the next index is not above it */
+#define _REDUCEAT_SEGLEN(par, i, d)                                     \
+    do {                                                                \
+        (d) = ((i) == (par)->nn - 1 ? (par)->len : (par)->ind[(i) + 1]) - \
+            (par)->ind[i];                                              \
+        if ((d) < 1) {                                                  \
+            (d) = 1;                                                    \
+        }                                                               \
+    } while (0)
+
+/* Copies an element, inline for the common sizes */
+#define _REDUCEAT_COPY(dst, src, size)                                  \
+    switch (size) {                                                     \
+        case 4:                                                         \
+            memcpy((dst), (src), 4);                                    \
+            break;                                                      \
+        case 8:                                                         \
+            memcpy((dst), (src), 8);                                    \
+            break;                                                      \
+        default:                                                        \
+            memcpy((dst), (src), (size));                               \
+    }
+
+
+/*
+ * Reduces the r short segments starting at segment i of the row at ip
+ * into the row of the output at op, using buf for the gathered
+ * elements.
+ */
+static void
+ufuncreduceat_batch(struct ufuncreduceat_parallel *par, char *ip, char *op,
+                    npy_intp i, npy_intp r, char *buf)
+{
+    NpyUFuncReduceObject *loop = par->loop;
+    npy_intp first[NPY_REDUCEAT_MAXSHORT + 1];
+    npy_intp seg[NPY_REDUCEAT_MAXBATCH];
+    npy_intp is = loop->steps[1], os = par->ostride;
+    npy_intp steps[3], k, j, d, c;
+    int outsize = loop->outsize;
+    char *bufptr[3], *src, *dst;
+
+    /* Counting sort of the segments by length */
+    for (d = 0; d <= NPY_REDUCEAT_MAXSHORT; d++) {
+        first[d] = 0;
+    }
+    for (k = i; k < i + r; k++) {
+        _REDUCEAT_SEGLEN(par, k, d);
+        first[d]++;
+    }
+    for (d = 1, c = 0; d <= NPY_REDUCEAT_MAXSHORT; d++) {
+        j = first[d];
+        first[d] = c;
+        c += j;
+    }
+    for (k = i; k < i + r; k++) {
+        _REDUCEAT_SEGLEN(par, k, d);
+        seg[first[d]++] = k;
+    }
+
+    steps[0] = steps[1] = steps[2] = outsize;
+    c = 0;
+    for (d = 1; d <= NPY_REDUCEAT_MAXSHORT; d++) {
+        npy_intp lo = c;
+
+        /* first[d] is now one past the segments of length d */
+        c = first[d] - lo;
+        if (c == 0) {
+            c = lo;
+            continue;
+        }
+        for (k = 0; k < c; k++) {
+            src = ip + par->ind[seg[lo + k]] * is;
+            dst = buf + k * outsize;
+            for (j = 0; j < d; j++) {
+                _REDUCEAT_COPY(dst, src, outsize);
+                src += is;
+                dst += c * outsize;
             }
-            break;
-        case ONE_EL_REDUCELOOP:
-            /* Accumulate */
-            /* fprintf(stderr, "ONEDIM..%d\n", loop->size); */
-            while (loop->index < loop->size) {
-                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                    void** pDest = (void**)loop->bufptr[0];
+        }
+        for (j = 1; j < d; j++) {
+            bufptr[0] = buf;
+            bufptr[1] = buf + j * c * outsize;
+            bufptr[2] = buf;
+            loop->function(bufptr, &c, steps, loop->funcdata);
+        }
+        for (k = 0; k < c; k++) {
+            _REDUCEAT_COPY(op + seg[lo + k] * os, buf + k * outsize, outsize);
+        }
+        c = first[d];
+    }
+}
+
+
+static void
+ufuncreduceat_execute(struct ufuncreduceat_parallel *par,
+                      npy_intp start, npy_intp end)
+{
+    NpyUFuncReduceObject *loop = par->loop;
+    NpyArrayIterObject it, rit;
+    npy_intp is = loop->steps[1];
+    npy_intp t, i, d, r;
+    char *op, *bufptr[3], *buf;
+    int outsize = loop->outsize;
+
+    if (start >= end) {
+        return;
+    }
+    /* Without the buffer every segment is reduced on its own */
+    buf = NpyThreads_BufferAlloc(NPY_REDUCEAT_MAXBATCH *
+                                 NPY_REDUCEAT_MAXSHORT * outsize);
+    it = *loop->it;
+    rit = *loop->rit;
+    NpyArray_IterGotoIndex(&it, start / par->nn);
+    NpyArray_IterGotoIndex(&rit, start / par->nn);
+    i = start % par->nn;
+    for (t = start; t < end; t += r, i += r) {
+        if (i == par->nn) {
+            NpyArray_ITER_NEXT(&it);
+            NpyArray_ITER_NEXT(&rit);
+            i = 0;
+        }
+
+        r = 0;
+        if (buf != NULL) {
+            while (r < NPY_REDUCEAT_MAXBATCH && i + r < par->nn &&
+                   t + r < end) {
+                _REDUCEAT_SEGLEN(par, i + r, d);
+                if (d > NPY_REDUCEAT_MAXSHORT) {
+                    break;
+                }
+                r++;
+            }
+        }
+        if (r >= NPY_REDUCEAT_MINBATCH) {
+            ufuncreduceat_batch(par, it.dataptr, rit.dataptr, i, r, buf);
+            continue;
+        }
+
+        r = 1;
+        op = rit.dataptr + i * par->ostride;
+        bufptr[1] = it.dataptr + par->ind[i] * is;
+        memmove(op, bufptr[1], outsize);
+        _REDUCEAT_SEGLEN(par, i, d);
+        d -= 1;
+        if (d > 0) {
+            bufptr[0] = op;
+            bufptr[1] += is;
+            bufptr[2] = op;
+            loop->function(bufptr, &d, loop->steps, loop->funcdata);
+        }
+    }
+    NpyThreads_BufferFree(buf);
+}
+
+static void
+ufuncreduceat_worker(void *arg, int tid, int nthreads)
+{
+    struct ufuncreduceat_parallel *par = (struct ufuncreduceat_parallel *)arg;
+    npy_intp start, end;
+
+    NpyThreads_Partition(par->loop->size * par->nn, tid, nthreads,
+                         &start, &end);
+    ufuncreduceat_execute(par, start, end);
+    par->fpstatus[tid] = NpyUFunc_getfperr();
+}
+
+
+/*
+ * Returns the number of threads to run the reduceat with, 1 if it should
+ * run serially.
+ */
+static int
+ufuncreduceat_nthreads(struct ufuncreduceat_parallel *par, NpyArray *arr)
+{
+    NpyUFuncReduceObject *loop = par->loop;
+    npy_intp size = loop->size * par->len;
+
+    if (NpyThreads_GetNumThreads() <= 1 ||
+        size < NpyThreads_GetThreshold() ||
+        _reduce_output_overlaps(loop, arr)) {
+        return 1;
+    }
+    return NpyThreads_WorkerCount(size, loop->size * par->nn);
+}
+
+
+static void
+ufuncreduceat_execute_parallel(struct ufuncreduceat_parallel *par,
+                               int nthreads)
+{
+    NpyUFuncReduceObject *loop = par->loop;
+    int fpstatus[NPY_MAXTHREADS];
+    int retstatus = 0;
+    int i;
+
+    par->fpstatus = fpstatus;
+    NpyThreads_Run(ufuncreduceat_worker, par, nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+        retstatus |= fpstatus[i];
+    }
+    if (loop->errormask) {
+        fp_error_handler((NULL != loop->ufunc->name) ? loop->ufunc->name : "",
+                         loop->errormask, loop->errobj, retstatus,
+                         &loop->first);
+    }
+}
+
+
+
+/*
+ * Returns the type to reduce arr in.  If out is specified it determines
+ * the type unless otype is also specified.  Otherwise the type of arr is
+ * used, but for add and multiply integer types are raised to at least a
+ * long to avoid overflow.
+ */
+static int
+_reduce_otype(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+              NpyArray_Descr *otype)
+{
+    int typenum;
+
+    if (otype != NULL) {
+        return otype->type_num;
+    }
+    if (out != NULL) {
+        return NpyArray_TYPE(out);
+    }
+    typenum = NpyArray_TYPE(arr);
+    if ((typenum < NPY_FLOAT)
+        && ((strcmp(self->name,"add") == 0)
+            || (strcmp(self->name,"multiply") == 0))) {
+        if (NpyTypeNum_ISBOOL(typenum)) {
+            typenum = NPY_LONG;
+        }
+        else if ((size_t)NpyArray_ITEMSIZE(arr) < sizeof(long)) {
+            if (NpyTypeNum_ISUNSIGNED(typenum)) {
+                typenum = NPY_ULONG;
+            }
+            else {
+                typenum = NPY_LONG;
+            }
+        }
+    }
+    return typenum;
+}
+
+
+NpyArray *
+NpyUFunc_GenericReduction(NpyUFuncObject *self, NpyArray *arr, NpyArray *indices,
+                          NpyArray *out, int axis, NpyArray_Descr *otype, int operation)
+{
+    static char *_reduce_type[] = {"reduce", "accumulate", "reduceat", NULL};
+
+    NpyArray *ret = NULL;
+    int typenum;
+    
+    /* Check to see if input is zero-dimensional */
+    if (NpyArray_NDIM(arr) == 0) {
+        char buf[256];
+        
+        sprintf(buf, "cannot %s on a scalar",
+                _reduce_type[operation]);
+        NpyErr_SetString(NpyExc_TypeError, buf);
+        Npy_DECREF(arr);
+        return NULL;
+    }
+    /* Check to see that type (and otype) is not FLEXIBLE */
+    if (NpyArray_ISFLEXIBLE(arr) ||
+        (NULL != otype && NpyTypeNum_ISFLEXIBLE(otype->type_num))) {
+        char buf[256];
+        
+        sprintf(buf, "cannot perform %s with flexible type",
+                _reduce_type[operation]);
+        NpyErr_SetString(NpyExc_TypeError, buf);
+        return NULL;
+    }
+    
+    if (axis < 0) {
+        axis += NpyArray_NDIM(arr);
+    }
+    if (axis < 0 || axis >= NpyArray_NDIM(arr)) {
+        NpyErr_SetString(NpyExc_ValueError, "axis not in array");
+        return NULL;
+    }
+    
+    typenum = _reduce_otype(self, arr, out, otype);
+    switch(operation) {
+        case NPY_UFUNC_REDUCE:
+            ret = NpyUFunc_Reduce(self, arr, out, axis, typenum);
+            break;
+        case NPY_UFUNC_ACCUMULATE:
+            ret = NpyUFunc_Accumulate(self, arr, out, axis, typenum);
+            break;
+        case NPY_UFUNC_REDUCEAT:
+            ret = NpyUFunc_Reduceat(self, arr, indices, out,
+                                    axis, typenum);
+            Npy_DECREF(indices);
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    return ret;
+}
+
+
+/*
+ * Reduces arr over the naxes axes listed in axes, or over all of its
+ * axes if axes is NULL.  Performs the same checks and chooses the type
+ * the same way as NpyUFunc_GenericReduction.
+ */
+NpyArray *
+NpyUFunc_GenericReduceAxes(NpyUFuncObject *self, NpyArray *arr,
+                           NpyArray *out, int naxes, int *axes,
+                           NpyArray_Descr *otype)
+{
+    if (NpyArray_NDIM(arr) == 0) {
+        NpyErr_SetString(NpyExc_TypeError, "cannot reduce on a scalar");
+        return NULL;
+    }
+    if (NpyArray_ISFLEXIBLE(arr) ||
+        (NULL != otype && NpyTypeNum_ISFLEXIBLE(otype->type_num))) {
+        NpyErr_SetString(NpyExc_TypeError,
+                         "cannot perform reduce with flexible type");
+        return NULL;
+    }
+    return NpyUFunc_ReduceAxes(self, arr, out, naxes, axes,
+                               _reduce_otype(self, arr, out, otype));
+}
+
+
+
+/*
+ * We have two basic kinds of loops. One is used when arr is not-swapped
+ * and aligned and output type is the same as input type.  The other uses
+ * buffers when one of these is not satisfied.
+ *
+ *  Zero-length and one-length axes-to-be-reduced are handled separately.
+ */
+NpyArray *
+NpyUFunc_Reduce(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+               int axis, int otype)
+{
+    NpyArray *ret = NULL;
+    NpyUFuncReduceObject *loop;
+    struct ufuncreduce_rows rows, *rowsp;
+    npy_intp i, n, nchunks;
+    char *dptr;
+    int nthreads, parallel = 0;
+    NPY_BEGIN_THREADS_DEF
+
+    assert(arr == NULL ||
+           (NPY_VALID_MAGIC == arr->nob_magic_number &&
+            NPY_VALID_MAGIC == NpyArray_DESCR(arr)->nob_magic_number));
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+
+    /* Construct loop object */
+    loop = construct_reduce(self, &arr, out, axis, otype, NPY_UFUNC_REDUCE, 0);
+    if (!loop) {
+        return NULL;
+    }
+
+    NPY_LOOP_BEGIN_THREADS;
+    switch(loop->meth) {
+        case ZERO_EL_REDUCELOOP:
+            /* fprintf(stderr, "ZERO..%d\n", loop->size); */
+            for (i = 0; i < loop->size; i++) {
+                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                    void** pDest = (void**)loop->bufptr[0];
+                    *pDest = NpyInterface_INCREF(*((void **)loop->idptr));
+                } else {
+                    memmove(loop->bufptr[0], loop->idptr, loop->outsize);
+                }
+                loop->bufptr[0] += loop->outsize;
+            }
+            break;
+        case ONE_EL_REDUCELOOP:
+            /*fprintf(stderr, "ONEDIM..%d\n", loop->size); */
+            while (loop->index < loop->size) {
+                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                    void** pDest = (void**)loop->bufptr[0];
                     *pDest = NpyInterface_INCREF(*((void **)loop->it->dataptr));
                 } else {
                     memmove(loop->bufptr[0], loop->it->dataptr, loop->outsize);
@@ -862,8 +2162,23 @@ NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
             }
             break;
         case NOBUFFER_UFUNCLOOP:
-            /* Accumulate */
-            /* fprintf(stderr, "NOBUFFER..%d\n", loop->size); */
+            rowsp = NULL;
+            if (ufuncreduce_rows_init(loop, arr, axis, &rows)) {
+                rowsp = &rows;
+            }
+            nthreads = ufuncreduce_nthreads(loop, arr, rowsp, &nchunks);
+            if ((nthreads > 1 || nchunks > 1) &&
+                ufuncreduce_execute_parallel(loop, rowsp, nchunks,
+                                             nthreads) == 0) {
+                parallel = 1;
+                break;
+            }
+            if (rowsp != NULL) {
+                ufuncreduce_rows_execute(loop, rowsp, 0, rowsp->ntasks);
+                NPY_UFUNC_CHECK_ERROR(loop);
+                break;
+            }
+            /*fprintf(stderr, "NOBUFFER..%d\n", loop->size); */
             while (loop->index < loop->size) {
                 /* Copy first element to output */
                 if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
@@ -873,41 +2188,44 @@ NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
                     memmove(loop->bufptr[0], loop->it->dataptr, loop->outsize);
                 }
                 /* Adjust input pointer */
-                loop->bufptr[1] = loop->it->dataptr + loop->steps[1];
+                loop->bufptr[1] = loop->it->dataptr+loop->steps[1];
                 loop->function((char **)loop->bufptr, &(loop->N),
                                loop->steps, loop->funcdata);
                 NPY_UFUNC_CHECK_ERROR(loop);
                 NpyArray_ITER_NEXT(loop->it);
-                NpyArray_ITER_NEXT(loop->rit);
-                loop->bufptr[0] = loop->rit->dataptr;
-                loop->bufptr[2] = loop->bufptr[0] + loop->steps[0];
+                loop->bufptr[0] += loop->outsize;
+                loop->bufptr[2] = loop->bufptr[0];
                 loop->index++;
             }
             break;
         case BUFFER_UFUNCLOOP:
-            /* Accumulate
-             *
+            /*
              * use buffer for arr
              *
              * For each row to reduce
-             * 1. copy identity over to output (casting if necessary)
+             * 1. copy first item over to output (casting if necessary)
              * 2. Fill inner buffer
              * 3. When buffer is filled or end of row
              * a. Cast input buffers if needed
              * b. Call inner function.
              * 4. Repeat 2 until row is done.
              */
-            /* fprintf(stderr, "BUFFERED..%d %p\n", loop->size, loop->cast); */
-            while (loop->index < loop->size) {
+            /* fprintf(stderr, "BUFFERED..%d %d\n", loop->size, loop->swap); */
+            while(loop->index < loop->size) {
                 loop->inptr = loop->it->dataptr;
                 /* Copy (cast) First term over to output */
                 if (loop->cast) {
-                    /* A little tricky because we need to
-                     cast it first */
+                    /* A little tricky because we need to cast it first */
                     NpyArray_DESCR(arr)->f->copyswap(loop->buffer, loop->inptr,
                                                      loop->swap, NULL);
                     loop->cast(loop->buffer, loop->castbuf, 1, NULL, NULL);
-                    if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                    if ((loop->obj & NPY_UFUNC_OBJ_ISOBJECT) &&
+                        !NpyArray_ISOBJECT(arr)) {
+                        /*
+                         * In this case the cast function is creating
+                         * an object reference so we need to incref
+                         * it since we care copying it to bufptr[0].
+                         */
                         void** pDest = (void**)loop->bufptr[0];
                         *pDest = NpyInterface_INCREF(*((void **)loop->castbuf));
                     } else {
@@ -922,7 +2240,7 @@ NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
                 }
                 loop->inptr += loop->instrides;
                 n = 1;
-                while (n < loop->N) {
+                while(n < loop->N) {
                     /* Copy up to loop->bufsize elements to buffer */
                     dptr = loop->buffer;
                     for (i = 0; i < loop->bufsize; i++, n++) {
@@ -944,493 +2262,1981 @@ NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
                     NPY_UFUNC_CHECK_ERROR(loop);
                 }
                 NpyArray_ITER_NEXT(loop->it);
-                NpyArray_ITER_NEXT(loop->rit);
-                loop->bufptr[0] = loop->rit->dataptr;
-                loop->bufptr[2] = loop->bufptr[0] + loop->steps[0];
+                loop->bufptr[0] += loop->outsize;
+                loop->bufptr[2] = loop->bufptr[0];
                 loop->index++;
             }
 
-            /*
-             * DECREF left-over objects if buffering was used.
-             * It is needed when casting created new objects in
-             * castbuf.  Intermediate copying into castbuf (via
-             * loop->function) decref'd what was already there.
-
-             * It's the final copy into the castbuf that needs a DECREF.
-             */
+            if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                /*
+                 * DECREF left-over objects if buffering was used.
+                 * There are 2 cases here.
+                 * 1. The output is an object. In this case the
+                 * castfunc will produce objects and castbuf needs
+                 * to be decrefed.
+                 * 2. The input is an object array.  In this case
+                 * the copyswap will produce object references and
+                 * the buffer needs to be decrefed.
+                 */
+                if (!NpyArray_ISOBJECT(arr)) {
+                    for (i=0; i<loop->bufsize; i++) {
+                        NpyInterface_CLEAR(((void **)loop->castbuf)[i]);
+                    }
+                } else {
+                    for (i=0; i<loop->bufsize; i++) {
+                        NpyInterface_CLEAR(((void **)loop->buffer)[i]);
+                    }
+                }
+            }
+    }
 
-            /* Only when casting needed and it is from a non-object array */
-            if ((loop->obj & NPY_UFUNC_OBJ_ISOBJECT) && loop->cast &&
-                (!NpyArray_ISOBJECT(arr))) {
-                for (i=0; i<loop->bufsize; i++) {
-                    NpyInterface_CLEAR(((void **)loop->castbuf)[i]);
+    /* The parallel versions report the errors of their workers. */
+    if (!parallel) {
+        NPY_UFUNC_CHECK_ERROR_END(loop);
+    }
+    NPY_LOOP_END_THREADS;
+    /* Hang on to this reference -- will be decref'd with loop */
+    if (loop->retbase) {
+        ret = loop->ret->base_arr;
+        NpyArray_ForceUpdate(loop->ret);
+    }
+    else {
+        ret = loop->ret;
+    }
+    Npy_INCREF(ret);
+    ufuncreduce_dealloc(loop);
+    return ret;
+
+fail:
+    NPY_LOOP_END_THREADS;
+    if (loop) {
+        ufuncreduce_dealloc(loop);
+    }
+    return NULL;
+}
+
+
+
+/*
+ * If the axes first to last are all reduced and can be merged into a
+ * single axis, returns a view of arr with them merged, otherwise NULL
+ * without setting an error.
+ */
+static NpyArray *
+_reduce_merged_view(NpyArray *arr, npy_bool *reduce, int first, int last)
+{
+    npy_intp dims[NPY_MAXDIMS], strides[NPY_MAXDIMS];
+    npy_intp dim = 1, stride = NpyArray_ITEMSIZE(arr);
+    int i, nd = 0;
+
+    for (i = last; i >= first; i--) {
+        npy_intp d = NpyArray_DIM(arr, i), s = NpyArray_STRIDE(arr, i);
+
+        if (!reduce[i]) {
+            return NULL;
+        }
+        if (d == 1) {
+            continue;
+        }
+        if (dim == 1) {
+            dim = d;
+            stride = s;
+        }
+        else if (s == stride * dim) {
+            dim *= d;
+        }
+        else {
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < first; i++, nd++) {
+        dims[nd] = NpyArray_DIM(arr, i);
+        strides[nd] = NpyArray_STRIDE(arr, i);
+    }
+    dims[nd] = dim;
+    strides[nd++] = stride;
+    for (i = last + 1; i < NpyArray_NDIM(arr); i++, nd++) {
+        dims[nd] = NpyArray_DIM(arr, i);
+        strides[nd] = NpyArray_STRIDE(arr, i);
+    }
+    Npy_INCREF(NpyArray_DESCR(arr));
+    return NpyArray_NewView(NpyArray_DESCR(arr), nd, dims, strides,
+                            arr, 0, NPY_FALSE);
+}
+
+
+/*
+ * Reduces over the flagged axes one after the other.  Used for object
+ * arrays, which need the reference counting of NpyUFunc_Reduce, and
+ * for empty arrays, which need the identity.
+ */
+static NpyArray *
+_reduce_axes_sequential(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+                        npy_bool *reduce, int otype)
+{
+    NpyArray *ret, *tmp;
+    int i, first = -1;
+
+    for (i = 0; i < NpyArray_NDIM(arr); i++) {
+        if (reduce[i]) {
+            first = i;
+            break;
+        }
+    }
+    if (first < 0) {
+        if (out == NULL) {
+            return NpyArray_FromArray(arr, NpyArray_DescrFromType(otype),
+                                      NPY_ENSURECOPY | NPY_FORCECAST);
+        }
+        if (NpyArray_CopyInto(out, arr) < 0) {
+            return NULL;
+        }
+        Npy_INCREF(out);
+        return out;
+    }
+
+    ret = arr;
+    Npy_INCREF(ret);
+    for (i = NpyArray_NDIM(arr) - 1; i >= first; i--) {
+        if (!reduce[i]) {
+            continue;
+        }
+        tmp = NpyUFunc_Reduce(self, ret, (i == first) ? out : NULL,
+                              i, otype);
+        Npy_DECREF(ret);
+        if (tmp == NULL) {
+            return NULL;
+        }
+        ret = tmp;
+    }
+    return ret;
+}
+
+
+/*
+ * Reduces over the flagged axes in one traversal of arr.  The output is
+ * viewed with zero strides along the reduced axes, and the axes are
+ * ordered by decreasing stride of arr and merged where both strides
+ * allow it.  The innermost axis is handed to the inner loop, which
+ * either reduces along it or combines a run of input into a run of the
+ * output.  The first element of every reduction is copied to the output
+ * instead of combined, which happens where all outer reduced axes are at
+ * position zero.  An input which is misaligned, byte swapped or not of
+ * the output type is copied and cast a block of each run at a time
+ * into a scratch buffer.
+ */
+static NpyArray *
+_reduce_axes_onepass(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+                     npy_bool *reduce, int otype)
+{
+    NpyArray *ret = NULL;
+    NpyUFuncGenericFunction function;
+    NpyArray_CopySwapNFunc *copyswapn = NULL;
+    NpyArray_VectorUnaryFunc *cast = NULL;
+    void *funcdata;
+    int arg_types[3];
+    NPY_SCALARKIND scalars[3] = { NPY_NOSCALAR, NPY_NOSCALAR,
+        NPY_NOSCALAR };
+    npy_intp kept[NPY_MAXDIMS], ostrides[NPY_MAXDIMS];
+    npy_intp dims[NPY_MAXDIMS], astr[NPY_MAXDIMS], ostr[NPY_MAXDIMS];
+    npy_intp coord[NPY_MAXDIMS], steps[3], rsteps[3];
+    npy_intp size, stride, i, k, n, m, b, bs = 0;
+    char *bufptr[3], *aptr, *optr, *buffer = NULL, *castbuf = NULL;
+    int nd = NpyArray_NDIM(arr), nkept = 0, ndim = 0;
+    int j, inner, insize, outsize, outer_first, swap;
+    int bufsize, errormask, first = 1, needs_api;
+    void *errobj = NULL;
+    NPY_BEGIN_THREADS_DEF
+
+    arg_types[0] = arg_types[1] = arg_types[2] = otype;
+    if (select_types(self, arg_types, &function, &funcdata,
+                     scalars, 0, NULL) == -1) {
+        return NULL;
+    }
+    if (otype != arg_types[2]) {
+        otype = arg_types[2];
+        arg_types[0] = arg_types[1] = otype;
+        if (select_types(self, arg_types, &function, &funcdata,
+                         scalars, 0, NULL) == -1) {
+            return NULL;
+        }
+    }
+    needs_api = NpyTypeNum_ISDATETIME(otype);
+
+    for (j = 0; j < nd; j++) {
+        if (!reduce[j]) {
+            kept[nkept++] = NpyArray_DIM(arr, j);
+        }
+    }
+    if (out == NULL) {
+        ret = NpyArray_New(NULL, nkept, kept, otype, NULL, NULL, 0, 0,
+                           Npy_INTERFACE(arr));
+    }
+    else {
+        if (NpyArray_NDIM(out) != nkept ||
+            !NpyArray_CompareLists(NpyArray_DIMS(out), kept, nkept)) {
+            NpyErr_SetString(NpyExc_ValueError,
+                             "wrong shape for output");
+            return NULL;
+        }
+        ret = NpyArray_FromArray(out, NpyArray_DescrFromType(otype),
+                                 NPY_CARRAY | NPY_UPDATEIFCOPY |
+                                 NPY_FORCECAST);
+    }
+    if (ret == NULL) {
+        return NULL;
+    }
+    insize = NpyArray_ITEMSIZE(arr);
+    outsize = NpyArray_ITEMSIZE(ret);
+    swap = !NpyArray_ISNOTSWAPPED(arr);
+
+    /* C order strides of the output, zero along the reduced axes */
+    stride = outsize;
+    for (j = nd - 1; j >= 0; j--) {
+        if (reduce[j]) {
+            ostrides[j] = 0;
+        }
+        else {
+            ostrides[j] = stride;
+            stride *= NpyArray_DIM(arr, j);
+        }
+    }
+
+    /* Drop axes of length one and order the rest by decreasing stride */
+    for (j = 0; j < nd; j++) {
+        npy_intp d = NpyArray_DIM(arr, j), s = NpyArray_STRIDE(arr, j);
+
+        if (d == 1) {
+            continue;
+        }
+        for (k = ndim; k > 0 && _NPY_ABS_STRIDE(astr[k-1]) <
+                                _NPY_ABS_STRIDE(s); k--) {
+            dims[k] = dims[k-1];
+            astr[k] = astr[k-1];
+            ostr[k] = ostr[k-1];
+        }
+        dims[k] = d;
+        astr[k] = s;
+        ostr[k] = ostrides[j];
+        ndim++;
+    }
+
+    /* Merge axes, which never merges a reduced axis with a kept one */
+    for (j = 1, k = 0; j < ndim; j++) {
+        if (astr[k] == astr[j] * dims[j] && ostr[k] == ostr[j] * dims[j]) {
+            dims[k] *= dims[j];
+            astr[k] = astr[j];
+            ostr[k] = ostr[j];
+        }
+        else {
+            k++;
+            dims[k] = dims[j];
+            astr[k] = astr[j];
+            ostr[k] = ostr[j];
+        }
+    }
+    if (ndim > 0) {
+        ndim = (int)k + 1;
+    }
+
+    NpyUFunc_clearfperr();
+    fp_error_state(&bufsize, &errormask, &errobj);
+
+    /* Runs of an input the loop cannot read go through the buffer */
+    if (swap || !NpyArray_ISALIGNED(arr) || NpyArray_TYPE(arr) != otype) {
+        copyswapn = NpyArray_DESCR(arr)->f->copyswapn;
+        if (NpyArray_TYPE(arr) != otype) {
+            cast = NpyArray_GetCastFunc(NpyArray_DESCR(arr), otype);
+            if (cast == NULL) {
+                NpyInterface_DECREF(errobj);
+                goto fail;
+            }
+        }
+        bs = bufsize;
+        buffer = NpyThreads_BufferAlloc(bs * (insize +
+                                              (cast ? outsize : 0)));
+        if (buffer == NULL) {
+            NpyErr_MEMORY;
+            NpyInterface_DECREF(errobj);
+            goto fail;
+        }
+        castbuf = cast ? buffer + bs*insize : buffer;
+    }
+
+    aptr = NpyArray_BYTES(arr);
+    optr = NpyArray_BYTES(ret);
+    if (ndim == 0) {
+        if (copyswapn != NULL) {
+            copyswapn(buffer, insize, aptr, insize, 1, swap, arr);
+            if (cast) {
+                cast(buffer, castbuf, 1, NULL, NULL);
+            }
+            aptr = castbuf;
+        }
+        memmove(optr, aptr, outsize);
+        goto finish;
+    }
+
+    inner = ndim - 1;
+    n = dims[inner];
+    steps[0] = steps[2] = ostr[inner];
+    steps[1] = astr[inner];
+    rsteps[0] = rsteps[2] = steps[0];
+    rsteps[1] = (copyswapn != NULL) ? outsize : steps[1];
+    if (copyswapn == NULL) {
+        bs = n;
+    }
+    size = 1;
+    for (j = 0; j < inner; j++) {
+        coord[j] = 0;
+        size *= dims[j];
+    }
+
+    if (!needs_api) {
+        NPY_BEGIN_THREADS;
+    }
+    for (i = 0; i < size; i++) {
+        outer_first = 1;
+        for (j = 0; j < inner; j++) {
+            if (ostr[j] == 0 && coord[j] != 0) {
+                outer_first = 0;
+                break;
+            }
+        }
+        for (b = 0; b < n; b += m) {
+            char *in = aptr + b*steps[1];
+
+            m = (n - b < bs) ? n - b : bs;
+            if (copyswapn != NULL) {
+                copyswapn(buffer, insize, in, steps[1], m, swap, arr);
+                if (cast) {
+                    cast(buffer, castbuf, m, NULL, NULL);
+                }
+                in = castbuf;
+            }
+            bufptr[0] = bufptr[2] = optr + b*steps[0];
+            bufptr[1] = in;
+            if (!outer_first || (b > 0 && steps[0] == 0)) {
+                function(bufptr, &m, rsteps, funcdata);
+            }
+            else if (steps[0] == 0) {
+                /* Copy the first element and reduce the rest of the run */
+                memmove(bufptr[0], in, outsize);
+                k = m - 1;
+                if (k > 0) {
+                    bufptr[1] = in + rsteps[1];
+                    function(bufptr, &k, rsteps, funcdata);
+                }
+            }
+            else {
+                /* Copy a run of first elements */
+                for (k = 0; k < m; k++) {
+                    memmove(bufptr[0] + k*rsteps[0], in + k*rsteps[1],
+                            outsize);
+                }
+            }
+        }
+
+        for (j = inner - 1; j >= 0; j--) {
+            aptr += astr[j];
+            optr += ostr[j];
+            if (++coord[j] < dims[j]) {
+                break;
+            }
+            aptr -= astr[j] * dims[j];
+            optr -= ostr[j] * dims[j];
+            coord[j] = 0;
+        }
+    }
+    if (!needs_api) {
+        NPY_END_THREADS;
+    }
+
+ finish:
+    if (errormask) {
+        NpyUFunc_checkfperr(self->name, errormask, errobj, &first);
+    }
+    NpyInterface_DECREF(errobj);
+    if (needs_api && NpyErr_Occurred()) {
+        goto fail;
+    }
+    NpyThreads_BufferFree(buffer);
+    if (out != NULL && ret != out) {
+        NpyArray_ForceUpdate(ret);
+        Npy_DECREF(ret);
+        ret = out;
+        Npy_INCREF(ret);
+    }
+    return ret;
+
+ fail:
+    NpyThreads_BufferFree(buffer);
+    Npy_XDECREF(ret);
+    return NULL;
+}
+
+
+/*
+ * Reduces arr over the naxes axes listed in axes, or over all of its
+ * axes if axes is NULL, in otype.  The axes are reduced together in a
+ * single traversal of arr instead of one after the other through
+ * intermediate arrays.  Reducing over more than one axis combines the
+ * elements in a different order than reducing over one axis at a time,
+ * so it is only allowed for ufuncs which can be reordered.
+ */
+NpyArray *
+NpyUFunc_ReduceAxes(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+                    int naxes, int *axes, int otype)
+{
+    npy_bool reduce[NPY_MAXDIMS];
+    NpyArray *view, *ret;
+    int nd = NpyArray_NDIM(arr);
+    int i, axis, nreduce = 0, first = -1, last = -1;
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+
+    for (i = 0; i < nd; i++) {
+        reduce[i] = (axes == NULL);
+    }
+    for (i = 0; axes != NULL && i < naxes; i++) {
+        axis = axes[i];
+        if (axis < 0) {
+            axis += nd;
+        }
+        if (axis < 0 || axis >= nd) {
+            NpyErr_SetString(NpyExc_ValueError, "axis not in array");
+            return NULL;
+        }
+        if (reduce[axis]) {
+            NpyErr_SetString(NpyExc_ValueError, "duplicate value in axes");
+            return NULL;
+        }
+        reduce[axis] = 1;
+    }
+    for (i = 0; i < nd; i++) {
+        if (reduce[i]) {
+            if (first < 0) {
+                first = i;
+            }
+            last = i;
+            nreduce++;
+        }
+    }
+
+    if (nreduce == 1) {
+        return NpyUFunc_Reduce(self, arr, out, first, otype);
+    }
+    if (nreduce > 1 && !_is_reorderable(self)) {
+        char buf[256];
+
+        NpyOS_snprintf(buf, 256, "reduction operation '%s' is not "
+                       "reorderable, so at most one axis may be specified",
+                       (NULL != self->name) ? self->name : "");
+        NpyErr_SetString(NpyExc_ValueError, buf);
+        return NULL;
+    }
+    if (nreduce > 1) {
+        view = _reduce_merged_view(arr, reduce, first, last);
+        if (view != NULL) {
+            ret = NpyUFunc_Reduce(self, view, out, first, otype);
+            Npy_DECREF(view);
+            return ret;
+        }
+    }
+    if (nreduce == 0 || NpyArray_SIZE(arr) == 0 ||
+        otype == NPY_OBJECT || NpyArray_TYPE(arr) == NPY_OBJECT) {
+        return _reduce_axes_sequential(self, arr, out, reduce, otype);
+    }
+    return _reduce_axes_onepass(self, arr, out, reduce, otype);
+}
+
+
+
+NpyArray *
+NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+                    int axis, int otype)
+{
+    NpyArray *ret = NULL;
+    NpyUFuncReduceObject *loop;
+    npy_intp i, n, nchunks;
+    char *dptr;
+    int nthreads, parallel = 0;
+    NPY_BEGIN_THREADS_DEF
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+
+    /* Construct loop object */
+    loop = construct_reduce(self, &arr, out, axis, otype,
+                            NPY_UFUNC_ACCUMULATE, 0);
+    if (!loop) {
+        return NULL;
+    }
+
+    NPY_LOOP_BEGIN_THREADS;
+    switch(loop->meth) {
+        case ZERO_EL_REDUCELOOP:
+            /* Accumulate */
+            /* fprintf(stderr, "ZERO..%d\n", loop->size); */
+            for (i = 0; i < loop->size; i++) {
+                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                    void** pDest = (void**)loop->bufptr[0];
+                    *pDest = NpyInterface_INCREF(*((void **)loop->idptr));
+                } else {
+                    memcpy(loop->bufptr[0], loop->idptr, loop->outsize);
+                }
+                loop->bufptr[0] += loop->outsize;
+            }
+            break;
+        case ONE_EL_REDUCELOOP:
+            /* Accumulate */
+            /* fprintf(stderr, "ONEDIM..%d\n", loop->size); */
+            while (loop->index < loop->size) {
+                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                    void** pDest = (void**)loop->bufptr[0];
+                    *pDest = NpyInterface_INCREF(*((void **)loop->it->dataptr));
+                } else {
+                    memmove(loop->bufptr[0], loop->it->dataptr, loop->outsize);
                 }
+                NpyArray_ITER_NEXT(loop->it);
+                loop->bufptr[0] += loop->outsize;
+                loop->index++;
+            }
+            break;
+        case NOBUFFER_UFUNCLOOP:
+            /* Accumulate */
+            nthreads = ufuncreduce_nthreads(loop, arr, NULL, &nchunks);
+            /* Scans of chunks take two passes, only worth it for idle threads */
+            if (loop->size >= nthreads) {
+                nchunks = 1;
+            }
+            if (nthreads > 1 &&
+                ufuncaccumulate_execute_parallel(loop, nchunks,
+                                                 nthreads) == 0) {
+                parallel = 1;
+                break;
             }
+            /* fprintf(stderr, "NOBUFFER..%d\n", loop->size); */
+            while (loop->index < loop->size) {
+                /* Copy first element to output */
+                if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                    void** pDest = (void**)loop->bufptr[0];
+                    *pDest = NpyInterface_INCREF(*((void **)loop->it->dataptr));
+                } else {
+                    memmove(loop->bufptr[0], loop->it->dataptr, loop->outsize);
+                }
+                /* Adjust input pointer */
+                loop->bufptr[1] = loop->it->dataptr + loop->steps[1];
+                loop->function((char **)loop->bufptr, &(loop->N),
+                               loop->steps, loop->funcdata);
+                NPY_UFUNC_CHECK_ERROR(loop);
+                NpyArray_ITER_NEXT(loop->it);
+                NpyArray_ITER_NEXT(loop->rit);
+                loop->bufptr[0] = loop->rit->dataptr;
+                loop->bufptr[2] = loop->bufptr[0] + loop->steps[0];
+                loop->index++;
+            }
+            break;
+        case BUFFER_UFUNCLOOP:
+            /* Accumulate
+             *
+             * use buffer for arr
+             *
+             * For each row to reduce
+             * 1. copy identity over to output (casting if necessary)
+             * 2. Fill inner buffer
+             * 3. When buffer is filled or end of row
+             * a. Cast input buffers if needed
+             * b. Call inner function.
+             * 4. Repeat 2 until row is done.
+             */
+            /* fprintf(stderr, "BUFFERED..%d %p\n", loop->size, loop->cast); */
+            while (loop->index < loop->size) {
+                loop->inptr = loop->it->dataptr;
+                /* Copy (cast) First term over to output */
+                if (loop->cast) {
+                    /* A little tricky because we need to
+                     cast it first */
+                    NpyArray_DESCR(arr)->f->copyswap(loop->buffer, loop->inptr,
+                                                     loop->swap, NULL);
+                    loop->cast(loop->buffer, loop->castbuf, 1, NULL, NULL);
+                    if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                        void** pDest = (void**)loop->bufptr[0];
+                        *pDest = NpyInterface_INCREF(*((void **)loop->castbuf));
+                    } else {
+                        memcpy(loop->bufptr[0], loop->castbuf, loop->outsize);
+                    }
+                }
+                else {
+                    /* Simple copy */
+                    NpyArray_DESCR(arr)->f->copyswap(loop->bufptr[0],
+                                                     loop->inptr,
+                                                     loop->swap, NULL);
+                }
+                loop->inptr += loop->instrides;
+                n = 1;
+                while (n < loop->N) {
+                    /* Copy up to loop->bufsize elements to buffer */
+                    dptr = loop->buffer;
+                    for (i = 0; i < loop->bufsize; i++, n++) {
+                        if (n == loop->N) {
+                            break;
+                        }
+                        NpyArray_DESCR(arr)->f->copyswap(dptr, loop->inptr,
+                                                         loop->swap, NULL);
+                        loop->inptr += loop->instrides;
+                        dptr += loop->insize;
+                    }
+                    if (loop->cast) {
+                        loop->cast(loop->buffer, loop->castbuf, i, NULL, NULL);
+                    }
+                    loop->function((char **)loop->bufptr, &i,
+                                   loop->steps, loop->funcdata);
+                    loop->bufptr[0] += loop->steps[0]*i;
+                    loop->bufptr[2] += loop->steps[2]*i;
+                    NPY_UFUNC_CHECK_ERROR(loop);
+                }
+                NpyArray_ITER_NEXT(loop->it);
+                NpyArray_ITER_NEXT(loop->rit);
+                loop->bufptr[0] = loop->rit->dataptr;
+                loop->bufptr[2] = loop->bufptr[0] + loop->steps[0];
+                loop->index++;
+            }
+
+            /*
+             * DECREF left-over objects if buffering was used.
+             * It is needed when casting created new objects in
+             * castbuf.  Intermediate copying into castbuf (via
+             * loop->function) decref'd what was already there.
+
+             * It's the final copy into the castbuf that needs a DECREF.
+             */
+
+            /* Only when casting needed and it is from a non-object array */
+            if ((loop->obj & NPY_UFUNC_OBJ_ISOBJECT) && loop->cast &&
+                (!NpyArray_ISOBJECT(arr))) {
+                for (i=0; i<loop->bufsize; i++) {
+                    NpyInterface_CLEAR(((void **)loop->castbuf)[i]);
+                }
+            }
+
+    }
+    /* The parallel versions report the errors of their workers. */
+    if (!parallel) {
+        NPY_UFUNC_CHECK_ERROR_END(loop);
+    }
+    NPY_LOOP_END_THREADS;
+    /* Hang on to this reference -- will be decref'd with loop */
+    if (loop->retbase) {
+        ret = NpyArray_BASE_ARRAY(loop->ret);
+        NpyArray_ForceUpdate(loop->ret);
+    }
+    else {
+        ret = loop->ret;
+    }
+    Npy_INCREF(ret);
+    ufuncreduce_dealloc(loop);
+    return ret;
+
+fail:
+    NPY_LOOP_END_THREADS;
+    if (loop) {
+        ufuncreduce_dealloc(loop);
+    }
+    return NULL;
+}
+
+/*
+ * Reduceat performs a reduce over an axis using the indices as a guide
+ *
+ * op.reduceat(array,indices)  computes
+ * op.reduce(array[indices[i]:indices[i+1]]
+ * for i=0..end with an implicit indices[i+1]=len(array)
+ * assumed when i=end-1
+ *
+ * if indices[i+1] <= indices[i]+1
+ * then the result is array[indices[i]] for that value
+ *
+ * op.accumulate(array) is the same as
+ * op.reduceat(array,indices)[::2]
+ * where indices is range(len(array)-1) with a zero placed in every other sample
+ * indices = zeros(len(array)*2-1)
+ * indices[1::2] = range(1,len(array))
+ *
+ * output shape is based on the size of indices
+ */
+NpyArray *
+NpyUFunc_Reduceat(NpyUFuncObject *self, NpyArray *arr, NpyArray *ind,
+                  NpyArray *out, int axis, int otype)
+{
+    NpyArray *ret;
+    NpyUFuncReduceObject *loop;
+    npy_intp *ptr = (npy_intp *)NpyArray_BYTES(ind);
+    npy_intp nn = NpyArray_DIM(ind, 0);
+    npy_intp mm = NpyArray_DIM(arr, axis) - 1;
+    npy_intp n, i, j;
+    char *dptr;
+    struct ufuncreduceat_parallel par;
+    int nthreads, parallel = 0;
+    NPY_BEGIN_THREADS_DEF;
+
+    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+
+    /* Check for out-of-bounds values in indices array */
+    for (i = 0; i<nn; i++) {
+        if ((*ptr < 0) || (*ptr > mm)) {
+            char buf[256];
+
+            NpyOS_snprintf(buf, 256, "index out-of-bounds (0, %d)", (int)mm);
+            NpyErr_SetString(NpyExc_IndexError, buf);
+            return NULL;
+        }
+        ptr++;
+    }
+
+    ptr = (npy_intp *)NpyArray_BYTES(ind);
+    /* Construct loop object */
+    loop = construct_reduce(self, &arr, out, axis, otype,
+                            NPY_UFUNC_REDUCEAT, nn);
+    if (!loop) {
+        return NULL;
+    }
+
+    NPY_LOOP_BEGIN_THREADS;
+    switch(loop->meth) {
+        case ZERO_EL_REDUCELOOP:
+            /* zero-length index -- return array immediately */
+            /* fprintf(stderr, "ZERO..\n"); */
+            break;
+        case NOBUFFER_UFUNCLOOP:
+            /* Reduceat
+             * NOBUFFER -- behaved array and same type
+             */
+            if (!loop->obj) {
+                par.loop = loop;
+                par.ind = (npy_intp *)NpyArray_BYTES(ind);
+                par.nn = nn;
+                par.len = NpyArray_DIM(arr, axis);
+                par.ostride = NpyArray_STRIDE(loop->ret, axis);
+                nthreads = ufuncreduceat_nthreads(&par, arr);
+                if (nthreads > 1) {
+                    ufuncreduceat_execute_parallel(&par, nthreads);
+                    parallel = 1;
+                }
+                else {
+                    ufuncreduceat_execute(&par, 0, loop->size * nn);
+                    NPY_UFUNC_CHECK_ERROR(loop);
+                }
+                break;
+            }
+            /* fprintf(stderr, "NOBUFFER..%d\n", loop->size); */
+            while (loop->index < loop->size) {
+                ptr = (npy_intp *)NpyArray_BYTES(ind);
+                for (i = 0; i < nn; i++) {
+                    loop->bufptr[1] = loop->it->dataptr + (*ptr)*loop->steps[1];
+                    if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                        void** pDest = (void**)loop->bufptr[0];
+                        *pDest = NpyInterface_INCREF(*((void **)loop->bufptr[1]));
+                    } else {
+                        memcpy(loop->bufptr[0], loop->bufptr[1], loop->outsize);
+                    }
+                    mm = (i == nn - 1 ? NpyArray_DIM(arr, axis) - *ptr :
+                          *(ptr + 1) - *ptr) - 1;
+                    if (mm > 0) {
+                        loop->bufptr[1] += loop->steps[1];
+                        loop->bufptr[2] = loop->bufptr[0];
+                        loop->function((char **)loop->bufptr, &mm,
+                                       loop->steps, loop->funcdata);
+                        NPY_UFUNC_CHECK_ERROR(loop);
+                    }
+                    loop->bufptr[0] += NpyArray_STRIDE(loop->ret, axis);
+                    ptr++;
+                }
+                NpyArray_ITER_NEXT(loop->it);
+                NpyArray_ITER_NEXT(loop->rit);
+                loop->bufptr[0] = loop->rit->dataptr;
+                loop->index++;
+            }
+            break;
+
+        case BUFFER_UFUNCLOOP:
+            /* Reduceat
+             * BUFFER -- misbehaved array or different types
+             */
+            /* fprintf(stderr, "BUFFERED..%d\n", loop->size); */
+            while (loop->index < loop->size) {
+                ptr = (npy_intp *)NpyArray_BYTES(ind);
+                for (i = 0; i < nn; i++) {
+                    if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
+                        void** pDest = (void**)loop->bufptr[0];
+                        *pDest = NpyInterface_INCREF(*((void **)loop->idptr));
+                    } else {
+                        memcpy(loop->bufptr[0], loop->idptr, loop->outsize);
+                    }
+                    n = 0;
+                    mm = (i == nn - 1 ? NpyArray_DIM(arr, axis) - *ptr :
+                          *(ptr + 1) - *ptr);
+                    if (mm < 1) {
+                        mm = 1;
+                    }
+                    loop->inptr = loop->it->dataptr + (*ptr)*loop->instrides;
+                    while (n < mm) {
+                        /* Copy up to loop->bufsize elements to buffer */
+                        dptr = loop->buffer;
+                        for (j = 0; j < loop->bufsize; j++, n++) {
+                            if (n == mm) {
+                                break;
+                            }
+                            NpyArray_DESCR(arr)->f->copyswap(dptr, loop->inptr,
+                                                             loop->swap, NULL);
+                            loop->inptr += loop->instrides;
+                            dptr += loop->insize;
+                        }
+                        if (loop->cast) {
+                            loop->cast(loop->buffer, loop->castbuf, j,
+                                       NULL, NULL);
+                        }
+                        loop->bufptr[2] = loop->bufptr[0];
+                        loop->function((char **)loop->bufptr, &j,
+                                       loop->steps, loop->funcdata);
+                        NPY_UFUNC_CHECK_ERROR(loop);
+                        loop->bufptr[0] += j*loop->steps[0];
+                    }
+                    loop->bufptr[0] += NpyArray_STRIDE(loop->ret, axis);
+                    ptr++;
+                }
+                NpyArray_ITER_NEXT(loop->it);
+                NpyArray_ITER_NEXT(loop->rit);
+                loop->bufptr[0] = loop->rit->dataptr;
+                loop->index++;
+            }
+
+            /*
+             * DECREF left-over objects if buffering was used.
+             * It is needed when casting created new objects in
+             * castbuf.  Intermediate copying into castbuf (via
+             * loop->function) decref'd what was already there.
+
+             * It's the final copy into the castbuf that needs a DECREF.
+             */
+
+            /* Only when casting needed and it is from a non-object array */
+            if ((loop->obj & NPY_UFUNC_OBJ_ISOBJECT) && loop->cast &&
+                (!NpyArray_ISOBJECT(arr))) {
+                for (i=0; i<loop->bufsize; i++) {
+                    NpyInterface_CLEAR(((void **)loop->castbuf)[i]);
+                }
+            }
+
+            break;
+    }
+    /* The parallel versions report the errors of their workers. */
+    if (!parallel) {
+        NPY_UFUNC_CHECK_ERROR_END(loop);
+    }
+    NPY_LOOP_END_THREADS;
+    /* Hang on to this reference -- will be decref'd with loop */
+    if (loop->retbase) {
+        ret = NpyArray_BASE_ARRAY(loop->ret);
+        NpyArray_ForceUpdate(loop->ret);
+    }
+    else {
+        ret = loop->ret;
+    }
+    Npy_INCREF(ret);
+    ufuncreduce_dealloc(loop);
+    return ret;
+
+fail:
+    NPY_LOOP_END_THREADS;
+    if (loop) {
+        ufuncreduce_dealloc(loop);
+    }
+    return NULL;
+}
+
+
+
+int
+NpyUFunc_RegisterLoopForType(NpyUFuncObject *ufunc,
+                             int usertype,
+                             NpyUFuncGenericFunction function,
+                             int *arg_types,
+                             void *data)
+{
+    NpyArray_Descr *descr;
+    NpyUFunc_Loop1d *funcdata, *current = NULL;
+    int i;
+    int *newtypes=NULL;
+
+    descr = NpyArray_DescrFromType(usertype);
+    if ((usertype < NPY_USERDEF) || (descr==NULL)) {
+        NpyErr_SetString(NpyExc_TypeError, "unknown user-defined type");
+        return -1;
+    }
+    Npy_DECREF(descr);
+
+    NpyUFunc_ClearPlanCache(ufunc);
+    if (ufunc->userloops == NULL) {
+        ufunc->userloops = npy_create_userloops_table();
+    }
+    funcdata = npy_malloc(sizeof(NpyUFunc_Loop1d));
+    if (funcdata == NULL) {
+        goto fail;
+    }
+    newtypes = npy_malloc(sizeof(int)*ufunc->nargs);
+    if (newtypes == NULL) {
+        goto fail;
+    }
+    if (arg_types != NULL) {
+        for (i = 0; i < ufunc->nargs; i++) {
+            newtypes[i] = arg_types[i];
+        }
+    }
+    else {
+        for (i = 0; i < ufunc->nargs; i++) {
+            newtypes[i] = usertype;
+        }
+    }
+
+    funcdata->func = function;
+    funcdata->arg_types = newtypes;
+    funcdata->data = data;
+    funcdata->next = NULL;
+
+    /* Get entry for this user-defined type*/
+    current = (NpyUFunc_Loop1d *)NpyDict_Get(ufunc->userloops,
+                                             (void *)(npy_intp)usertype);
+    /* If it's not there, then make one and return. */
+    if (NULL == current) {
+        NpyDict_Put(ufunc->userloops, (void *)(npy_intp)usertype, funcdata);
+        return 0;
+    }
+    else {
+        NpyUFunc_Loop1d *prev = NULL;
+        int cmp = 1;
+        /*
+         * There is already at least 1 loop. Place this one in
+         * lexicographic order.  If the next one signature
+         * is exactly like this one, then just replace.
+         * Otherwise insert.
+         */
+        while (current != NULL) {
+            cmp = cmp_arg_types(current->arg_types, newtypes, ufunc->nargs);
+            if (cmp >= 0) {
+                break;
+            }
+            prev = current;
+            current = current->next;
+        }
+        if (cmp == 0) {
+            /* just replace it with new function */
+            current->func = function;
+            current->data = data;
+            npy_free(newtypes);
+            npy_free(funcdata);
+        }
+        else {
+            /*
+             * insert it before the current one by hacking the internals
+             * of cobject to replace the function pointer --- can't use
+             * CObject API because destructor is set.
+             */
+            funcdata->next = current;
+            if (prev == NULL) {
+                /* place this at front */
+                NpyDict_ForceValue(ufunc->userloops,
+                                   (void *)(npy_intp)usertype, funcdata);
+            }
+            else {
+                prev->next = funcdata;
+            }
+        }
+    }
+    return 0;
+
+fail:
+    npy_free(funcdata);
+    npy_free(newtypes);
+    if (!NpyErr_Occurred())
+        NpyErr_MEMORY;
+    return -1;
+}
+
+
+/*
+ * Registers an inner loop for inputs of the builtin types in arg_types
+ * which otherwise would be cast to the inputs of another loop of the
+ * ufunc, for example int and double inputs of add.  When the types of
+ * the input arrays match and the loop the normal rules select has the
+ * same output types, the loop is used instead and reads the inputs
+ * without casting them.  It must therefore give the same results as
+ * the selected loop on the cast inputs.  Registering the same types
+ * again replaces the loop.
+ */
+int
+NpyUFunc_RegisterMixedLoop(NpyUFuncObject *ufunc,
+                           NpyUFuncGenericFunction function,
+                           int *arg_types,
+                           void *data)
+{
+    NpyUFunc_Loop1d *funcdata, *current;
+    int *newtypes;
+    int i;
+
+    if (ufunc->core_enabled) {
+        NpyErr_SetString(NpyExc_ValueError,
+                         "mixed type loops need a ufunc without signature");
+        return -1;
+    }
+    for (i = 0; i < ufunc->nargs; i++) {
+        if (arg_types[i] < 0 || arg_types[i] >= NPY_NTYPES ||
+            NpyTypeNum_ISFLEXIBLE(arg_types[i]) ||
+            NpyTypeNum_ISOBJECT(arg_types[i])) {
+            NpyErr_SetString(NpyExc_TypeError,
+                             "mixed type loops need builtin numeric types");
+            return -1;
+        }
+    }
+
+    NpyUFunc_ClearPlanCache(ufunc);
+    for (current = ufunc->mixedloops; current != NULL;
+         current = current->next) {
+        if (cmp_arg_types(current->arg_types, arg_types, ufunc->nargs) == 0) {
+            current->func = function;
+            current->data = data;
+            return 0;
+        }
+    }
+
+    funcdata = npy_malloc(sizeof(NpyUFunc_Loop1d));
+    newtypes = npy_malloc(sizeof(int)*ufunc->nargs);
+    if (funcdata == NULL || newtypes == NULL) {
+        npy_free(funcdata);
+        npy_free(newtypes);
+        NpyErr_MEMORY;
+        return -1;
+    }
+    for (i = 0; i < ufunc->nargs; i++) {
+        newtypes[i] = arg_types[i];
+    }
+    funcdata->func = function;
+    funcdata->arg_types = newtypes;
+    funcdata->data = data;
+    funcdata->next = ufunc->mixedloops;
+    ufunc->mixedloops = funcdata;
+    return 0;
+}
+
+
+NpyUFuncObject *
+NpyUFunc_FromFuncAndDataAndSignature(NpyUFuncGenericFunction *func,
+                                     void **data, char *types, int ntypes,
+                                     int nin, int nout, int identity,
+                                     char *name, char *doc,
+                                     int check_return, const char *signature)
+{
+    NpyUFuncObject *self;
+
+    self = (NpyUFuncObject *)npy_malloc(sizeof(NpyUFuncObject));
+    if (NULL == self) {
+        return NULL;
+    }
+    NpyObject_Init(self, &NpyUFunc_Type);
+
+    self->nin = nin;
+    self->nout = nout;
+    self->nargs = nin+nout;
+    self->identity = identity;
+
+    self->functions = func;
+    self->data = data;
+    self->types = types;
+    self->ntypes = ntypes;
+    self->check_return = check_return;
+    self->ptr = NULL;
+    self->userloops=NULL;
+    self->mixedloops = NULL;
+    self->plans = NULL;
+
+    if (name == NULL) {
+        self->name = "?";
+    }
+    else {
+        self->name = name;
+    }
+    if (doc == NULL) {
+        self->doc = "NULL";
+    }
+    else {
+        self->doc = doc;
+    }
+
+    /* generalized ufunc */
+    self->core_enabled = 0;
+    self->core_num_dim_ix = 0;
+    self->core_num_dims = NULL;
+    self->core_dim_ixs = NULL;
+    self->core_offsets = NULL;
+    self->core_signature = NULL;
+    if (signature != NULL) {
+        if (0 != _parse_signature(self, signature)) {
+            Npy_DECREF(self);
+            return NULL;
+        }
+    }
+    
+    if (NULL != _NpyArrayWrapperFuncs.ufunc_new_wrapper) {
+        _NpyArrayWrapperFuncs.ufunc_new_wrapper(self, &self->nob_interface);
+    }
+    return self;
+}
+
+
+NDARRAY_API NpyUFuncObject *
+NpyUFunc_FromFuncAndData(NpyUFuncGenericFunction *func, void **data,
+                         char *types, int ntypes,
+                         int nin, int nout, int identity,
+                         char *name, char *doc, int check_return)
+{
+    return NpyUFunc_FromFuncAndDataAndSignature(func, data, types, ntypes,
+                                                nin, nout, identity, name,
+                                                doc, check_return, NULL);
+}
+
+
+int
+NpyUFunc_SetUsesArraysAsData(void **data, size_t i)
+{
+    data[i] = (void*)NpyUFunc_SetUsesArraysAsData;
+    return 0;
+}
+
+
+static NpyUFuncLoopObject *
+construct_loop(NpyUFuncObject *self)
+{
+    NpyUFuncLoopObject *loop;
+    int i;
+    char *name;
+
+    if (self == NULL) {
+        NpyErr_SetString(NpyExc_ValueError, "function not supported");
+        return NULL;
+    }
+    if ((loop = npy_malloc(sizeof(NpyUFuncLoopObject))) == NULL) {
+        NpyErr_MEMORY;
+        return loop;
+    }
+    loop->nob_interface = NULL;
+    loop->nob_refcnt = 1;
+    loop->nob_type = NULL;
+    loop->nob_magic_number = NPY_VALID_MAGIC;
 
+    loop->iter = NpyArray_MultiIterNew();
+    if (loop->iter == NULL) {
+        npy_free(loop);
+        return NULL;
     }
-    NPY_LOOP_END_THREADS;
-    /* Hang on to this reference -- will be decref'd with loop */
-    if (loop->retbase) {
-        ret = NpyArray_BASE_ARRAY(loop->ret);
-        NpyArray_ForceUpdate(loop->ret);
+
+    loop->iter->index = 0;
+    loop->iter->numiter = self->nargs;
+    loop->ufunc = self;
+    Npy_INCREF(loop->ufunc);
+    loop->buffer[0] = NULL;
+    loop->memsize = 0;
+    for (i = 0; i < self->nargs; i++) {
+        loop->iter->iters[i] = NULL;
+        loop->cast[i] = NULL;
     }
-    else {
-        ret = loop->ret;
+    loop->errormask = 0;
+    loop->errobj = NULL;
+    loop->notimplemented = 0;
+    loop->first = 1;
+    loop->core_dim_sizes = NULL;
+    loop->core_strides = NULL;
+    loop->leftover = 0;
+    loop->where = NULL;
+
+    if (self->core_enabled) {
+        int num_dim_ix = 1 + self->core_num_dim_ix;
+        int nstrides = self->nargs
+        + self->core_offsets[self->nargs - 1]
+        + self->core_num_dims[self->nargs - 1];
+        loop->core_dim_sizes = npy_malloc(sizeof(npy_intp)*num_dim_ix);
+        loop->core_strides = npy_malloc(sizeof(npy_intp)*nstrides);
+        if (loop->core_dim_sizes == NULL || loop->core_strides == NULL) {
+            NpyErr_MEMORY;
+            goto fail;
+        }
+        memset(loop->core_strides, 0, sizeof(npy_intp) * nstrides);
+        for (i = 0; i < num_dim_ix; i++) {
+            loop->core_dim_sizes[i] = 1;
+        }
     }
-    Npy_INCREF(ret);
-    ufuncreduce_dealloc(loop);
-    return ret;
+    name = self->name ? self->name : "";
+
+    return loop;
 
 fail:
-    NPY_LOOP_END_THREADS;
-    if (loop) {
-        ufuncreduce_dealloc(loop);
-    }
+    ufuncloop_dealloc(loop);
     return NULL;
 }
 
+
 /*
- * Reduceat performs a reduce over an axis using the indices as a guide
- *
- * op.reduceat(array,indices)  computes
- * op.reduce(array[indices[i]:indices[i+1]]
- * for i=0..end with an implicit indices[i+1]=len(array)
- * assumed when i=end-1
- *
- * if indices[i+1] <= indices[i]+1
- * then the result is array[indices[i]] for that value
+ * Loop plan cache.
  *
- * op.accumulate(array) is the same as
- * op.reduceat(array,indices)[::2]
- * where indices is range(len(array)-1) with a zero placed in every other sample
- * indices = zeros(len(array)*2-1)
- * indices[1::2] = range(1,len(array))
+ * construct_arrays resolves the inner loop for every call by walking
+ * the ufunc's type list (or the user loops dictionary), looking up cast
+ * functions and deciding on the loop method.  The result only depends on
+ * the operand types, byte order, alignment and contiguity, the scalar
+ * kinds of 0-d inputs, which inputs are small enough to be cast up front
+ * and, for the loop method, whether all operands have the same shape.  Each ufunc keeps a small table of these results
+ * keyed on exactly that information so that repeated calls with the
+ * same kind of operands skip the resolution.
  *
- * output shape is based on the size of indices
+ * Like the user loops dictionary the table is only touched before the
+ * loop releases the interface lock.
  */
-NpyArray *
-NpyUFunc_Reduceat(NpyUFuncObject *self, NpyArray *arr, NpyArray *ind,
-                  NpyArray *out, int axis, int otype)
-{
-    NpyArray *ret;
-    NpyUFuncReduceObject *loop;
-    npy_intp *ptr = (npy_intp *)NpyArray_BYTES(ind);
-    npy_intp nn = NpyArray_DIM(ind, 0);
-    npy_intp mm = NpyArray_DIM(arr, axis) - 1;
-    npy_intp n, i, j;
-    char *dptr;
-    NPY_BEGIN_THREADS_DEF;
+#define NPY_UFUNC_NPLANS 8
 
-    assert(NPY_VALID_MAGIC == self->nob_magic_number);
+/* Per-operand layout flags */
+#define NPY_PLAN_BEHAVED    0x01    /* aligned and not swapped */
+#define NPY_PLAN_CONTIGUOUS 0x02
+#define NPY_PLAN_NOARRAY    0x04    /* output to be allocated */
+#define NPY_PLAN_SMALL      0x08    /* input smaller than the buffer size */
 
-    /* Check for out-of-bounds values in indices array */
-    for (i = 0; i<nn; i++) {
-        if ((*ptr < 0) || (*ptr > mm)) {
-            char buf[256];
+/* Flags for the whole call */
+#define NPY_PLAN_SAMESHAPE  0x01    /* all operands have the same shape */
 
-            NpyOS_snprintf(buf, 256, "index out-of-bounds (0, %d)", (int)mm);
-            NpyErr_SetString(NpyExc_IndexError, buf);
-            return NULL;
-        }
-        ptr++;
-    }
+typedef struct {
+    int nd;
+    int flags;
+    int types[NPY_MAXARGS];
+    char layout[NPY_MAXARGS];
+    char scalars[NPY_MAXARGS];
+} ufunc_plan_key;
 
-    ptr = (npy_intp *)NpyArray_BYTES(ind);
-    /* Construct loop object */
-    loop = construct_reduce(self, &arr, out, axis, otype,
-                            NPY_UFUNC_REDUCEAT, nn);
-    if (!loop) {
-        return NULL;
-    }
+typedef struct {
+    ufunc_plan_key key;
 
-    NPY_LOOP_BEGIN_THREADS;
-    switch(loop->meth) {
-        case ZERO_EL_REDUCELOOP:
-            /* zero-length index -- return array immediately */
-            /* fprintf(stderr, "ZERO..\n"); */
-            break;
-        case NOBUFFER_UFUNCLOOP:
-            /* Reduceat
-             * NOBUFFER -- behaved array and same type
-             */
-            /* fprintf(stderr, "NOBUFFER..%d\n", loop->size); */
-            while (loop->index < loop->size) {
-                ptr = (npy_intp *)NpyArray_BYTES(ind);
-                for (i = 0; i < nn; i++) {
-                    loop->bufptr[1] = loop->it->dataptr + (*ptr)*loop->steps[1];
-                    if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                        void** pDest = (void**)loop->bufptr[0];
-                        *pDest = NpyInterface_INCREF(*((void **)loop->bufptr[1]));
-                    } else {
-                        memcpy(loop->bufptr[0], loop->bufptr[1], loop->outsize);
-                    }
-                    mm = (i == nn - 1 ? NpyArray_DIM(arr, axis) - *ptr :
-                          *(ptr + 1) - *ptr) - 1;
-                    if (mm > 0) {
-                        loop->bufptr[1] += loop->steps[1];
-                        loop->bufptr[2] = loop->bufptr[0];
-                        loop->function((char **)loop->bufptr, &mm,
-                                       loop->steps, loop->funcdata);
-                        NPY_UFUNC_CHECK_ERROR(loop);
-                    }
-                    loop->bufptr[0] += NpyArray_STRIDE(loop->ret, axis);
-                    ptr++;
-                }
-                NpyArray_ITER_NEXT(loop->it);
-                NpyArray_ITER_NEXT(loop->rit);
-                loop->bufptr[0] = loop->rit->dataptr;
-                loop->index++;
-            }
-            break;
+    /* Result of select_types */
+    int arg_types[NPY_MAXARGS];
+    NpyUFuncGenericFunction function;
+    void *funcdata;
+
+    /* Result of the loop set up */
+    int meth;
+    NpyArray_VectorUnaryFunc *cast[NPY_MAXARGS];
+} ufunc_plan;
+
+struct NpyUFuncPlanCache {
+    unsigned int epoch;
+    int nplans;
+    int next;       /* Entry to replace when the table is full */
+    int last;       /* Entry found by the last lookup */
+    ufunc_plan plans[NPY_UFUNC_NPLANS];
+};
 
-        case BUFFER_UFUNCLOOP:
-            /* Reduceat
-             * BUFFER -- misbehaved array or different types
-             */
-            /* fprintf(stderr, "BUFFERED..%d\n", loop->size); */
-            while (loop->index < loop->size) {
-                ptr = (npy_intp *)NpyArray_BYTES(ind);
-                for (i = 0; i < nn; i++) {
-                    if (loop->obj & NPY_UFUNC_OBJ_ISOBJECT) {
-                        void** pDest = (void**)loop->bufptr[0];
-                        *pDest = NpyInterface_INCREF(*((void **)loop->idptr));
-                    } else {
-                        memcpy(loop->bufptr[0], loop->idptr, loop->outsize);
-                    }
-                    n = 0;
-                    mm = (i == nn - 1 ? NpyArray_DIM(arr, axis) - *ptr :
-                          *(ptr + 1) - *ptr);
-                    if (mm < 1) {
-                        mm = 1;
-                    }
-                    loop->inptr = loop->it->dataptr + (*ptr)*loop->instrides;
-                    while (n < mm) {
-                        /* Copy up to loop->bufsize elements to buffer */
-                        dptr = loop->buffer;
-                        for (j = 0; j < loop->bufsize; j++, n++) {
-                            if (n == mm) {
-                                break;
-                            }
-                            NpyArray_DESCR(arr)->f->copyswap(dptr, loop->inptr,
-                                                             loop->swap, NULL);
-                            loop->inptr += loop->instrides;
-                            dptr += loop->insize;
-                        }
-                        if (loop->cast) {
-                            loop->cast(loop->buffer, loop->castbuf, j,
-                                       NULL, NULL);
-                        }
-                        loop->bufptr[2] = loop->bufptr[0];
-                        loop->function((char **)loop->bufptr, &j,
-                                       loop->steps, loop->funcdata);
-                        NPY_UFUNC_CHECK_ERROR(loop);
-                        loop->bufptr[0] += j*loop->steps[0];
-                    }
-                    loop->bufptr[0] += NpyArray_STRIDE(loop->ret, axis);
-                    ptr++;
-                }
-                NpyArray_ITER_NEXT(loop->it);
-                NpyArray_ITER_NEXT(loop->rit);
-                loop->bufptr[0] = loop->rit->dataptr;
-                loop->index++;
-            }
+/* Bumped when registering casts could change type resolution. */
+static unsigned int plan_epoch = 0;
 
-            /*
-             * DECREF left-over objects if buffering was used.
-             * It is needed when casting created new objects in
-             * castbuf.  Intermediate copying into castbuf (via
-             * loop->function) decref'd what was already there.
 
-             * It's the final copy into the castbuf that needs a DECREF.
-             */
+void
+npy_ufunc_invalidate_plans(void)
+{
+    plan_epoch++;
+}
 
-            /* Only when casting needed and it is from a non-object array */
-            if ((loop->obj & NPY_UFUNC_OBJ_ISOBJECT) && loop->cast &&
-                (!NpyArray_ISOBJECT(arr))) {
-                for (i=0; i<loop->bufsize; i++) {
-                    NpyInterface_CLEAR(((void **)loop->castbuf)[i]);
-                }
+
+/*
+ * Drops all cached loop plans of a ufunc.  Must be called when the
+ * ufunc's loops or types are modified.
+ */
+NDARRAY_API void
+NpyUFunc_ClearPlanCache(NpyUFuncObject *self)
+{
+    if (self->plans != NULL) {
+        self->plans->nplans = 0;
+        self->plans->next = 0;
+        self->plans->last = 0;
+    }
+}
+
+
+static void
+_plan_key(NpyUFuncObject *self, NpyArray **mps, NPY_SCALARKIND *scalars,
+          int bufsize, ufunc_plan_key *key)
+{
+    NpyArray *ap;
+    int i, nd = 0;
+
+    memset(key, 0, sizeof(ufunc_plan_key));
+    key->flags = NPY_PLAN_SAMESHAPE;
+    for (i = 0; i < self->nin; i++) {
+        if (NpyArray_NDIM(mps[i]) > nd) {
+            nd = NpyArray_NDIM(mps[i]);
+        }
+    }
+    key->nd = nd;
+    for (i = 0; i < self->nargs; i++) {
+        ap = mps[i];
+        if (ap == NULL) {
+            key->types[i] = NPY_NOTYPE;
+            key->layout[i] = NPY_PLAN_NOARRAY;
+            continue;
+        }
+        key->types[i] = NpyArray_TYPE(ap);
+        if (NpyArray_ISBEHAVED_RO(ap)) {
+            key->layout[i] |= NPY_PLAN_BEHAVED;
+        }
+        if (NpyArray_ISCONTIGUOUS(ap)) {
+            key->layout[i] |= NPY_PLAN_CONTIGUOUS;
+        }
+        if (i < self->nin) {
+            key->scalars[i] = (char)scalars[i];
+            /* Small inputs are cast up front by _create_copies */
+            if (NpyArray_SIZE(ap) < bufsize) {
+                key->layout[i] |= NPY_PLAN_SMALL;
             }
+        }
+        if (NpyArray_NDIM(ap) != NpyArray_NDIM(mps[0]) ||
+            !NpyArray_CompareLists(NpyArray_DIMS(ap), NpyArray_DIMS(mps[0]),
+                                   NpyArray_NDIM(ap))) {
+            key->flags &= ~NPY_PLAN_SAMESHAPE;
+        }
+    }
+}
 
-            break;
+
+static ufunc_plan *
+_plan_find(NpyUFuncObject *self, ufunc_plan_key *key)
+{
+    struct NpyUFuncPlanCache *cache = self->plans;
+    int i, k;
+
+    if (cache == NULL) {
+        return NULL;
     }
-    NPY_LOOP_END_THREADS;
-    /* Hang on to this reference -- will be decref'd with loop */
-    if (loop->retbase) {
-        ret = NpyArray_BASE_ARRAY(loop->ret);
-        NpyArray_ForceUpdate(loop->ret);
+    if (cache->epoch != plan_epoch) {
+        NpyUFunc_ClearPlanCache(self);
+        cache->epoch = plan_epoch;
+        return NULL;
+    }
+    for (i = 0; i < cache->nplans; i++) {
+        k = (cache->last + i) % cache->nplans;
+        if (memcmp(&cache->plans[k].key, key, sizeof(ufunc_plan_key)) == 0) {
+            cache->last = k;
+            return &cache->plans[k];
+        }
+    }
+    return NULL;
+}
+
+
+static void
+_plan_store(NpyUFuncObject *self, ufunc_plan *plan)
+{
+    struct NpyUFuncPlanCache *cache = self->plans;
+
+    if (cache == NULL) {
+        cache = npy_malloc(sizeof(struct NpyUFuncPlanCache));
+        if (cache == NULL) {
+            return;
+        }
+        cache->epoch = plan_epoch;
+        self->plans = cache;
+        NpyUFunc_ClearPlanCache(self);
     }
-    else {
-        ret = loop->ret;
+    else if (cache->epoch != plan_epoch) {
+        NpyUFunc_ClearPlanCache(self);
+        cache->epoch = plan_epoch;
     }
-    Npy_INCREF(ret);
-    ufuncreduce_dealloc(loop);
-    return ret;
-
-fail:
-    NPY_LOOP_END_THREADS;
-    if (loop) {
-        ufuncreduce_dealloc(loop);
+    memcpy(&cache->plans[cache->next], plan, sizeof(ufunc_plan));
+    cache->last = cache->next;
+    if (cache->nplans < NPY_UFUNC_NPLANS) {
+        cache->nplans++;
     }
-    return NULL;
+    cache->next = (cache->next + 1) % NPY_UFUNC_NPLANS;
 }
 
 
+/*
+ * Returns 1 if ap can be used directly by ONE_UFUNCLOOP together with
+ * operands of the given shape.
+ */
+static int
+_is_trivial_operand(NpyArray *ap, int type, int nd, npy_intp *dims,
+                    int isoutput)
+{
+    return (NpyArray_TYPE(ap) == type &&
+            type != NPY_OBJECT &&
+            type != NPY_DATETIME && type != NPY_TIMEDELTA &&
+            NpyArray_ISCONTIGUOUS(ap) && NpyArray_ISBEHAVED_RO(ap) &&
+            (!isoutput || NpyArray_ISWRITEABLE(ap)) &&
+            NpyArray_NDIM(ap) == nd &&
+            NpyArray_CompareLists(NpyArray_DIMS(ap), dims, nd));
+}
+
 
-int
-NpyUFunc_RegisterLoopForType(NpyUFuncObject *ufunc,
-                             int usertype,
-                             NpyUFuncGenericFunction function,
-                             int *arg_types,
-                             void *data)
+/*
+ * Builds the input and output iterators and broadcasts the inputs.
+ */
+static int
+_construct_iterators(NpyUFuncLoopObject *loop, NpyArray **mps)
 {
-    NpyArray_Descr *descr;
-    NpyUFunc_Loop1d *funcdata, *current = NULL;
+    NpyUFuncObject *self = loop->ufunc;
     int i;
-    int *newtypes=NULL;
 
-    descr = NpyArray_DescrFromType(usertype);
-    if ((usertype < NPY_USERDEF) || (descr==NULL)) {
-        NpyErr_SetString(NpyExc_TypeError, "unknown user-defined type");
-        return -1;
+    for (i = 0; i < self->nin; i++) {
+        loop->iter->iters[i] = NpyArray_IterNew(mps[i]);
+        if (loop->iter->iters[i] == NULL) {
+            return -1;
+        }
     }
-    Npy_DECREF(descr);
-
-    if (ufunc->userloops == NULL) {
-        ufunc->userloops = npy_create_userloops_table();
+    loop->iter->numiter = self->nin;
+    if (NpyArray_Broadcast(loop->iter) < 0) {
+        return -1;
     }
-    funcdata = npy_malloc(sizeof(NpyUFunc_Loop1d));
-    if (funcdata == NULL) {
-        goto fail;
+    for (i = self->nin; i < self->nargs; i++) {
+        loop->iter->iters[i] = NpyArray_IterNew(mps[i]);
+        if (loop->iter->iters[i] == NULL) {
+            return -1;
+        }
     }
-    newtypes = npy_malloc(sizeof(int)*ufunc->nargs);
-    if (newtypes == NULL) {
-        goto fail;
+    return 0;
+}
+
+
+/*
+ * Sets up ONE_UFUNCLOOP without building any iterators when all
+ * operands have the same shape and are contiguous, behaved and of the
+ * loop types.  Used when a cached plan says the call will end up with
+ * ONE_UFUNCLOOP.
+ *
+ * Returns 1 when the loop is set up, 0 if nothing was done and the
+ * general set up should be used, 2 if the outputs were already created
+ * and prepared but turned out unsuitable (the iterators have then been
+ * built) and -1 on error.
+ */
+static int
+_construct_trivial_arrays(NpyUFuncLoopObject *loop, NpyArray **mps,
+                          int *arg_types,
+                          npy_prepare_outputs_func prepare,
+                          void *prepare_data)
+{
+    NpyUFuncObject *self = loop->ufunc;
+    NpyArray *prepared[NPY_MAXARGS];
+    int nd = NpyArray_NDIM(mps[0]);
+    npy_intp *dims = NpyArray_DIMS(mps[0]);
+    npy_intp size = NpyArray_SIZE(mps[0]);
+    int i;
+
+    for (i = 0; i < self->nargs; i++) {
+        if (i >= self->nin && mps[i] == NULL) {
+            continue;
+        }
+        if (!_is_trivial_operand(mps[i], arg_types[i], nd, dims,
+                                 i >= self->nin)) {
+            return 0;
+        }
     }
-    if (arg_types != NULL) {
-        for (i = 0; i < ufunc->nargs; i++) {
-            newtypes[i] = arg_types[i];
+
+    for (i = self->nin; i < self->nargs; i++) {
+        if (mps[i] == NULL) {
+            mps[i] = NpyArray_New(NULL, nd, dims, arg_types[i],
+                                  NULL, NULL, 0, 0, NULL);
+            if (mps[i] == NULL) {
+                return -1;
+            }
         }
+        prepared[i] = mps[i];
     }
-    else {
-        for (i = 0; i < ufunc->nargs; i++) {
-            newtypes[i] = usertype;
+
+    /* wrap outputs */
+    if (prepare) {
+        if (prepare(self, mps, prepare_data) < 0) {
+            return -1;
+        }
+        for (i = self->nin; i < self->nargs; i++) {
+            if (mps[i] != prepared[i] &&
+                !_is_trivial_operand(mps[i], arg_types[i], nd, dims, 1)) {
+                if (_construct_iterators(loop, mps) < 0) {
+                    return -1;
+                }
+                return 2;
+            }
         }
     }
 
-    funcdata->func = function;
-    funcdata->arg_types = newtypes;
-    funcdata->data = data;
-    funcdata->next = NULL;
+    loop->iter->nd = nd;
+    for (i = 0; i < nd; i++) {
+        loop->iter->dimensions[i] = dims[i];
+    }
+    loop->iter->size = size;
+    loop->iter->numiter = self->nargs;
+    loop->bufcnt = 0;
+    loop->obj = 0;
+    loop->meth = (size == 0) ? NO_UFUNCLOOP : ONE_UFUNCLOOP;
+    for (i = 0; i < self->nargs; i++) {
+        loop->needbuffer[i] = 0;
+        loop->bufptr[i] = NpyArray_BYTES(mps[i]);
+        loop->steps[i] = (size == 1) ? 0 : NpyArray_STRIDE(mps[i], nd - 1);
+    }
+    return 1;
+}
 
-    /* Get entry for this user-defined type*/
-    current = (NpyUFunc_Loop1d *)NpyDict_Get(ufunc->userloops,
-                                             (void *)(npy_intp)usertype);
-    /* If it's not there, then make one and return. */
-    if (NULL == current) {
-        NpyDict_Put(ufunc->userloops, (void *)(npy_intp)usertype, funcdata);
-        return 0;
+
+/*
+ * Returns the bytes per element taken by the buffers of a
+ * BUFFER_UFUNCLOOP, counting the operand buffer and the cast buffer of
+ * every operand which is not a scalar.
+ */
+static npy_intp
+_buffer_elsize(NpyUFuncLoopObject *loop, int *arg_types, NpyArray **mps)
+{
+    NpyArray_Descr *descr;
+    npy_intp elsize = 0;
+    int i;
+
+    for (i = 0; i < loop->ufunc->nargs; i++) {
+        if (!loop->needbuffer[i] || loop->steps[i] == 0) {
+            continue;
+        }
+        elsize += NpyArray_ITEMSIZE(mps[i]);
+        if (arg_types[i] != NpyArray_TYPE(mps[i])) {
+            descr = NpyArray_DescrFromType(arg_types[i]);
+            if (descr != NULL) {
+                elsize += descr->elsize;
+                Npy_DECREF(descr);
+            }
+        }
     }
-    else {
-        NpyUFunc_Loop1d *prev = NULL;
-        int cmp = 1;
-        /*
-         * There is already at least 1 loop. Place this one in
-         * lexicographic order.  If the next one signature
-         * is exactly like this one, then just replace.
-         * Otherwise insert.
-         */
-        while (current != NULL) {
-            cmp = cmp_arg_types(current->arg_types, newtypes, ufunc->nargs);
-            if (cmp >= 0) {
+    return elsize;
+}
+
+
+/*
+ * Replaces the loop chosen by select_types with a loop registered by
+ * NpyUFunc_RegisterMixedLoop that takes the input arrays as they are
+ * and has the same outputs.
+ */
+static void
+_select_mixed_loop(NpyUFuncObject *self, NpyArray **mps, int *arg_types,
+                   NpyUFuncGenericFunction *function, void **data)
+{
+    NpyUFunc_Loop1d *mixed;
+    int i;
+
+    for (mixed = self->mixedloops; mixed != NULL; mixed = mixed->next) {
+        for (i = 0; i < self->nargs; i++) {
+            if (i < self->nin ?
+                (mixed->arg_types[i] != NpyArray_TYPE(mps[i]) ||
+                 !NpyArray_CanCastSafely(mixed->arg_types[i], arg_types[i])) :
+                mixed->arg_types[i] != arg_types[i]) {
                 break;
             }
-            prev = current;
-            current = current->next;
-        }
-        if (cmp == 0) {
-            /* just replace it with new function */
-            current->func = function;
-            current->data = data;
-            npy_free(newtypes);
-            npy_free(funcdata);
         }
-        else {
-            /*
-             * insert it before the current one by hacking the internals
-             * of cobject to replace the function pointer --- can't use
-             * CObject API because destructor is set.
-             */
-            funcdata->next = current;
-            if (prev == NULL) {
-                /* place this at front */
-                NpyDict_ForceValue(ufunc->userloops,
-                                   (void *)(npy_intp)usertype, funcdata);
-            }
-            else {
-                prev->next = funcdata;
+        if (i == self->nargs) {
+            for (i = 0; i < self->nin; i++) {
+                arg_types[i] = mixed->arg_types[i];
             }
+            *function = mixed->func;
+            *data = mixed->data;
+            return;
         }
     }
-    return 0;
-
-fail:
-    npy_free(funcdata);
-    npy_free(newtypes);
-    if (!NpyErr_Occurred())
-        NpyErr_MEMORY;
-    return -1;
 }
 
 
-NpyUFuncObject *
-NpyUFunc_FromFuncAndDataAndSignature(NpyUFuncGenericFunction *func,
-                                     void **data, char *types, int ntypes,
-                                     int nin, int nout, int identity,
-                                     char *name, char *doc,
-                                     int check_return, const char *signature)
+/*
+ * How an output which shares memory with an input can be computed, see
+ * _resolve_overlap.
+ */
+enum {
+    OVERLAP_NONE,           /* no hazard in either order */
+    OVERLAP_FORWARD,        /* correct only in the normal order */
+    OVERLAP_BACKWARD,       /* correct only in reverse order */
+    OVERLAP_COPY            /* the input has to be copied */
+};
+
+
+/*
+ * Fills n and s with the lengths and strides, outermost first, of the
+ * axes along which the selected loop walks operand i, leaving out axes
+ * of length one.  Returns the number of axes.
+ */
+static int
+_loop_operand_walk(NpyUFuncLoopObject *loop, int i, npy_intp *n, npy_intp *s)
 {
-    NpyUFuncObject *self;
+    NpyArrayIterObject *it;
+    int k, nlev = 0;
 
-    self = (NpyUFuncObject *)npy_malloc(sizeof(NpyUFuncObject));
-    if (NULL == self) {
-        return NULL;
+    if (loop->meth == ONE_UFUNCLOOP) {
+        if (loop->iter->size > 1) {
+            n[nlev] = loop->iter->size;
+            s[nlev++] = loop->steps[i];
+        }
+        return nlev;
     }
-    NpyObject_Init(self, &NpyUFunc_Type);
+    if (loop->iter->nd == 0) {
+        return 0;
+    }
+    it = loop->iter->iters[i];
+    for (k = 0; k < loop->iter->nd; k++) {
+        if (k != loop->lastdim && it->dims_m1[k] > 0) {
+            n[nlev] = it->dims_m1[k] + 1;
+            s[nlev++] = it->strides[k];
+        }
+    }
+    if (loop->bufcnt > 1) {
+        n[nlev] = loop->bufcnt;
+        s[nlev++] = it->strides[loop->lastdim];
+    }
+    return nlev;
+}
 
-    self->nin = nin;
-    self->nout = nout;
-    self->nargs = nin+nout;
-    self->identity = identity;
 
-    self->functions = func;
-    self->data = data;
-    self->types = types;
-    self->ntypes = ntypes;
-    self->check_return = check_return;
-    self->ptr = NULL;
-    self->userloops=NULL;
+/*
+ * Returns 1 if a walk visits strictly increasing addresses at least gap
+ * bytes apart, -1 if it visits strictly decreasing addresses and 0 if
+ * neither.
+ */
+static int
+_walk_direction(int nlev, npy_intp *n, npy_intp *s, npy_intp gap)
+{
+    npy_intp span = 0;
+    int dir = 0;
+    int k;
 
-    if (name == NULL) {
-        self->name = "?";
+    for (k = nlev - 1; k >= 0; k--) {
+        npy_intp step = (s[k] < 0) ? -s[k] : s[k];
+
+        if (s[k] == 0 || step < span + gap ||
+            (dir != 0 && (s[k] < 0) != (dir < 0))) {
+            return 0;
+        }
+        dir = (s[k] < 0) ? -1 : 1;
+        span += (n[k] - 1) * step;
     }
-    else {
-        self->name = name;
+    return dir;
+}
+
+
+/*
+ * Classifies how output i overlaps input j, where the where mask counts
+ * as input nargs.  An input that is exactly the same view as the output
+ * is read before each element is written, as is an input walked the
+ * same way as the output but starting behind it in the order of the
+ * walk.  Any other overlap needs the input to be copied.
+ */
+static int
+_overlap_kind(NpyUFuncLoopObject *loop, NpyArray **mps, int i, int j)
+{
+    NpyUFuncObject *self = loop->ufunc;
+    NpyArray *in = (j == self->nargs) ? loop->where : mps[j];
+    npy_intp on[NPY_MAXDIMS], os[NPY_MAXDIMS];
+    npy_intp in_n[NPY_MAXDIMS], is[NPY_MAXDIMS];
+    char *olow, *ohigh, *ilow, *ihigh;
+    char *optr, *iptr;
+    npy_intp gap;
+    int nlev, k, dir;
+
+    _get_array_extent(mps[i], &olow, &ohigh);
+    _get_array_extent(in, &ilow, &ihigh);
+    if (ohigh <= ilow || ihigh <= olow) {
+        return OVERLAP_NONE;
+    }
+    /* The core functions of generalized ufuncs can read any element */
+    if (loop->meth == SIGNATURE_NOBUFFER_UFUNCLOOP) {
+        return OVERLAP_COPY;
+    }
+
+    nlev = _loop_operand_walk(loop, i, on, os);
+    if (_loop_operand_walk(loop, j, in_n, is) != nlev) {
+        return OVERLAP_COPY;
+    }
+    for (k = 0; k < nlev; k++) {
+        if (on[k] != in_n[k] || os[k] != is[k]) {
+            return OVERLAP_COPY;
+        }
     }
-    if (doc == NULL) {
-        self->doc = "NULL";
+    if (loop->meth == ONE_UFUNCLOOP) {
+        optr = loop->bufptr[i];
+        iptr = loop->bufptr[j];
     }
     else {
-        self->doc = doc;
-    }
-
-    /* generalized ufunc */
-    self->core_enabled = 0;
-    self->core_num_dim_ix = 0;
-    self->core_num_dims = NULL;
-    self->core_dim_ixs = NULL;
-    self->core_offsets = NULL;
-    self->core_signature = NULL;
-    if (signature != NULL) {
-        if (0 != _parse_signature(self, signature)) {
-            Npy_DECREF(self);
-            return NULL;
-        }
+        optr = loop->iter->iters[i]->dataptr;
+        iptr = loop->iter->iters[j]->dataptr;
     }
-    
-    if (NULL != _NpyArrayWrapperFuncs.ufunc_new_wrapper) {
-        _NpyArrayWrapperFuncs.ufunc_new_wrapper(self, &self->nob_interface);
+    if (optr == iptr || nlev == 0) {
+        return OVERLAP_NONE;
     }
-    return self;
+
+    gap = NpyArray_MAX(NpyArray_ITEMSIZE(mps[i]), NpyArray_ITEMSIZE(in));
+    dir = _walk_direction(nlev, on, os, gap);
+    if (dir == 0) {
+        return OVERLAP_COPY;
+    }
+    return ((optr > iptr) == (dir > 0)) ? OVERLAP_BACKWARD : OVERLAP_FORWARD;
 }
 
 
-NDARRAY_API NpyUFuncObject *
-NpyUFunc_FromFuncAndData(NpyUFuncGenericFunction *func, void **data,
-                         char *types, int ntypes,
-                         int nin, int nout, int identity,
-                         char *name, char *doc, int check_return)
+/*
+ * Makes the selected loop walk all operands in reverse order.
+ */
+static void
+_reverse_loop(NpyUFuncLoopObject *loop)
 {
-    return NpyUFunc_FromFuncAndDataAndSignature(func, data, types, ntypes,
-                                                nin, nout, identity, name,
-                                                doc, check_return, NULL);
+    NpyArrayIterObject *it;
+    int i, k;
+
+    for (i = 0; i < loop->iter->numiter; i++) {
+        if (loop->meth == ONE_UFUNCLOOP) {
+            loop->bufptr[i] += (loop->iter->size - 1) * loop->steps[i];
+            loop->steps[i] = -loop->steps[i];
+            continue;
+        }
+        it = loop->iter->iters[i];
+        for (k = 0; k < loop->iter->nd; k++) {
+            if (k == loop->lastdim) {
+                it->dataptr += (loop->bufcnt - 1) * it->strides[k];
+            }
+            else {
+                it->dataptr += it->dims_m1[k] * it->strides[k];
+                it->backstrides[k] = -it->backstrides[k];
+            }
+            it->strides[k] = -it->strides[k];
+        }
+        /* Buffered operands are still walked forward within the buffer */
+        if (loop->meth != BUFFER_UFUNCLOOP || !loop->needbuffer[i]) {
+            loop->steps[i] = -loop->steps[i];
+        }
+    }
 }
 
 
-int
-NpyUFunc_SetUsesArraysAsData(void **data, size_t i)
+/*
+ * Replaces input j by a copy of the memory it spans, laid out the same
+ * so that the iterators and steps stay valid.  Used for generalized
+ * ufuncs, whose core functions can read anywhere in the core data.
+ */
+static int
+_copy_input_extent(NpyUFuncLoopObject *loop, NpyArray **mps, int j)
 {
-    data[i] = (void*)NpyUFunc_SetUsesArraysAsData;
+    NpyUFuncObject *self = loop->ufunc;
+    NpyArray **in = (j == self->nargs) ? &loop->where : &mps[j];
+    NpyArrayIterObject *it = loop->iter->iters[j];
+    NpyArray *buf, *copy;
+    char *low, *high;
+    npy_intp nbytes, delta;
+
+    _get_array_extent(*in, &low, &high);
+    nbytes = high - low;
+    buf = NpyArray_New(NULL, 1, &nbytes, NPY_BYTE, NULL, NULL, 0, 0, NULL);
+    if (buf == NULL) {
+        return -1;
+    }
+    memcpy(NpyArray_BYTES(buf), low, nbytes);
+    delta = NpyArray_BYTES(buf) - low;
+
+    Npy_INCREF(NpyArray_DESCR(*in));
+    copy = NpyArray_NewView(NpyArray_DESCR(*in), NpyArray_NDIM(*in),
+                            NpyArray_DIMS(*in), NpyArray_STRIDES(*in),
+                            buf, NpyArray_BYTES(*in) - low, NPY_FALSE);
+    Npy_DECREF(buf);
+    if (copy == NULL) {
+        return -1;
+    }
+    Npy_DECREF(*in);
+    *in = copy;
+
+    if (loop->meth == ONE_UFUNCLOOP) {
+        loop->bufptr[j] += delta;
+    }
+    else {
+        NpyArray *ao = copy;
+
+        if (self->core_enabled) {
+            ao = _trunc_coredim(copy, self->core_num_dims[j]);
+            if (ao == NULL) {
+                return -1;
+            }
+        }
+        else {
+            Npy_INCREF(ao);
+        }
+        Npy_DECREF(it->ao);
+        it->ao = ao;
+        it->dataptr += delta;
+    }
     return 0;
 }
 
 
-static NpyUFuncLoopObject *
-construct_loop(NpyUFuncObject *self)
+/*
+ * Replaces input j by a compact copy of the elements the selected loop
+ * reads, laid out in the order the loop walks them, and points its
+ * iterator or step at the copy.
+ */
+static int
+_copy_overlapping_input(NpyUFuncLoopObject *loop, NpyArray **mps, int j)
 {
-    NpyUFuncLoopObject *loop;
-    int i;
-    char *name;
+    NpyUFuncObject *self = loop->ufunc;
+    NpyArray **in = (j == self->nargs) ? &loop->where : &mps[j];
+    NpyArrayIterObject *it = NULL;
+    NpyArray *buf, *copy;
+    npy_intp dims[NPY_MAXDIMS], sstrides[NPY_MAXDIMS], dstrides[NPY_MAXDIMS];
+    npy_intp coord[NPY_MAXDIMS];
+    npy_intp nbytes, i, n;
+    int order[NPY_MAXDIMS];
+    int elsize = NpyArray_ITEMSIZE(*in);
+    int nd, last, k, m;
+    char *src, *dst;
 
-    if (self == NULL) {
-        NpyErr_SetString(NpyExc_ValueError, "function not supported");
-        return NULL;
-    }
-    if ((loop = npy_malloc(sizeof(NpyUFuncLoopObject))) == NULL) {
-        NpyErr_MEMORY;
-        return loop;
+    if (self->core_enabled) {
+        return _copy_input_extent(loop, mps, j);
     }
-    loop->nob_interface = NULL;
-    loop->nob_refcnt = 1;
-    loop->nob_type = NULL;
-    loop->nob_magic_number = NPY_VALID_MAGIC;
 
-    loop->iter = NpyArray_MultiIterNew();
-    if (loop->iter == NULL) {
-        npy_free(loop);
-        return NULL;
+    /* The walk of the input, from its innermost axis out */
+    if (loop->meth == ONE_UFUNCLOOP) {
+        nd = 1;
+        last = 0;
+        dims[0] = loop->iter->size;
+        sstrides[0] = loop->steps[j];
+        src = loop->bufptr[j];
     }
-
-    loop->iter->index = 0;
-    loop->iter->numiter = self->nargs;
-    loop->ufunc = self;
-    Npy_INCREF(loop->ufunc);
-    loop->buffer[0] = NULL;
-    for (i = 0; i < self->nargs; i++) {
-        loop->iter->iters[i] = NULL;
-        loop->cast[i] = NULL;
+    else {
+        it = loop->iter->iters[j];
+        nd = loop->iter->nd;
+        last = loop->lastdim;
+        for (k = 0; k < nd; k++) {
+            dims[k] = (k == last) ? loop->bufcnt : it->dims_m1[k] + 1;
+            sstrides[k] = it->strides[k];
+        }
+        src = it->dataptr;
+    }
+    order[0] = last;
+    for (k = nd - 1, m = 1; k >= 0; k--) {
+        if (k != last) {
+            order[m++] = k;
+        }
     }
-    loop->errormask = 0;
-    loop->errobj = NULL;
-    loop->notimplemented = 0;
-    loop->first = 1;
-    loop->core_dim_sizes = NULL;
-    loop->core_strides = NULL;
-    loop->leftover = 0;
 
-    if (self->core_enabled) {
-        int num_dim_ix = 1 + self->core_num_dim_ix;
-        int nstrides = self->nargs
-        + self->core_offsets[self->nargs - 1]
-        + self->core_num_dims[self->nargs - 1];
-        loop->core_dim_sizes = npy_malloc(sizeof(npy_intp)*num_dim_ix);
-        loop->core_strides = npy_malloc(sizeof(npy_intp)*nstrides);
-        if (loop->core_dim_sizes == NULL || loop->core_strides == NULL) {
-            NpyErr_MEMORY;
-            goto fail;
+    /* Broadcast axes stay broadcast in the copy */
+    nbytes = elsize;
+    for (m = 0; m < nd; m++) {
+        k = order[m];
+        coord[k] = 0;
+        if (sstrides[k] == 0 || dims[k] == 1) {
+            dstrides[k] = 0;
         }
-        memset(loop->core_strides, 0, sizeof(npy_intp) * nstrides);
-        for (i = 0; i < num_dim_ix; i++) {
-            loop->core_dim_sizes[i] = 1;
+        else {
+            dstrides[k] = nbytes;
+            nbytes *= dims[k];
         }
     }
-    name = self->name ? self->name : "";
+    buf = NpyArray_New(NULL, 1, &nbytes, NPY_BYTE, NULL, NULL, 0, 0, NULL);
+    if (buf == NULL) {
+        return -1;
+    }
 
-    return loop;
+    dst = NpyArray_BYTES(buf);
+    n = nbytes / elsize;
+    for (i = 0; i < n; i++) {
+        memcpy(dst, src, elsize);
+        for (m = 0; m < nd; m++) {
+            k = order[m];
+            if (dstrides[k] == 0) {
+                continue;
+            }
+            src += sstrides[k];
+            dst += dstrides[k];
+            if (++coord[k] < dims[k]) {
+                break;
+            }
+            src -= sstrides[k] * dims[k];
+            dst -= dstrides[k] * dims[k];
+            coord[k] = 0;
+        }
+    }
 
-fail:
-    ufuncloop_dealloc(loop);
-    return NULL;
+    Npy_INCREF(NpyArray_DESCR(*in));
+    copy = NpyArray_NewView(NpyArray_DESCR(*in), nd, dims, dstrides,
+                            buf, 0, NPY_FALSE);
+    Npy_DECREF(buf);
+    if (copy == NULL) {
+        return -1;
+    }
+    Npy_DECREF(*in);
+    *in = copy;
+
+    if (loop->meth == ONE_UFUNCLOOP) {
+        loop->bufptr[j] = NpyArray_BYTES(copy);
+        loop->steps[j] = dstrides[0];
+        return 0;
+    }
+    Npy_INCREF(copy);
+    Npy_DECREF(it->ao);
+    it->ao = copy;
+    it->dataptr = NpyArray_BYTES(copy);
+    for (k = 0; k < nd; k++) {
+        it->strides[k] = dstrides[k];
+        it->backstrides[k] = dstrides[k] * it->dims_m1[k];
+    }
+    /* Buffered operands keep stepping through the buffer */
+    if (loop->meth != BUFFER_UFUNCLOOP || j >= self->nargs ||
+        !loop->needbuffer[j]) {
+        loop->steps[j] = dstrides[last];
+    }
+    return 0;
+}
+
+
+/*
+ * Makes the selected loop give the same results as if every input was
+ * read before any output is written.  Outputs that are exactly an input
+ * or walked behind it need nothing, overlaps which are only correct
+ * when walked the other way reverse the whole loop, and only when that
+ * is not enough the overlapping inputs are copied.
+ */
+static int
+_resolve_overlap(NpyUFuncLoopObject *loop, NpyArray **mps)
+{
+    NpyUFuncObject *self = loop->ufunc;
+    int kind[NPY_MAXARGS + 1];
+    int nin = self->nin + (loop->where != NULL);
+    int forward = 0, backward = 0;
+    int i, j, jj, k;
+
+    for (jj = 0; jj < nin; jj++) {
+        j = (jj < self->nin) ? jj : self->nargs;
+        kind[jj] = OVERLAP_NONE;
+        for (i = self->nin; i < self->nargs; i++) {
+            k = _overlap_kind(loop, mps, i, j);
+            if (k == OVERLAP_NONE || k == kind[jj]) {
+                continue;
+            }
+            kind[jj] = (kind[jj] == OVERLAP_NONE) ? k : OVERLAP_COPY;
+        }
+        forward |= (kind[jj] == OVERLAP_FORWARD);
+        backward |= (kind[jj] == OVERLAP_BACKWARD);
+    }
+
+    for (jj = 0; jj < nin; jj++) {
+        j = (jj < self->nin) ? jj : self->nargs;
+        if (kind[jj] == OVERLAP_COPY ||
+            (kind[jj] == OVERLAP_BACKWARD && forward)) {
+            if (_copy_overlapping_input(loop, mps, j) < 0) {
+                return -1;
+            }
+        }
+    }
+    if (backward && !forward) {
+        _reverse_loop(loop);
+    }
+    return 0;
 }
 
 
@@ -1448,6 +4254,9 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
     npy_bool allscalars = NPY_TRUE;
     int flexible = 0;
     int object = 0;
+    ufunc_plan newplan;
+    ufunc_plan *plan = NULL;
+    int useplan;
 
     npy_intp temp_dims[NPY_MAXDIMS];
     npy_intp *out_dims;
@@ -1507,11 +4316,41 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
         }
     }
 
-    /* Select an appropriate function for these argument types. */
-    if (select_types(loop->ufunc, arg_types, &(loop->function),
-                     &(loop->funcdata), scalars, ntypenums, 
-                     rtypenums) == -1) {
-        return -1;
+    /*
+     * Look for a cached plan.  Explicitly requested loops and
+     * generalized ufuncs always go through select_types.
+     */
+    useplan = (rtypenums == NULL && !self->core_enabled &&
+               loop->where == NULL);
+    if (useplan) {
+        _plan_key(self, mps, scalars, loop->bufsize, &newplan.key);
+        plan = _plan_find(self, &newplan.key);
+    }
+    if (plan != NULL) {
+        for (i = 0; i < self->nargs; i++) {
+            arg_types[i] = plan->arg_types[i];
+        }
+        loop->function = plan->function;
+        loop->funcdata = plan->funcdata;
+    }
+    else {
+        /* Select an appropriate function for these argument types. */
+        if (select_types(loop->ufunc, arg_types, &(loop->function),
+                         &(loop->funcdata), scalars, ntypenums, 
+                         rtypenums) == -1) {
+            return -1;
+        }
+        if (rtypenums == NULL) {
+            _select_mixed_loop(self, mps, arg_types, &(loop->function),
+                               &(loop->funcdata));
+        }
+        if (useplan) {
+            for (i = 0; i < self->nargs; i++) {
+                newplan.arg_types[i] = arg_types[i];
+            }
+            newplan.function = loop->function;
+            newplan.funcdata = loop->funcdata;
+        }
     }
 
     /*
@@ -1522,6 +4361,19 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
         return -1;
     }
 
+    if (plan != NULL && plan->meth == ONE_UFUNCLOOP &&
+        (plan->key.flags & NPY_PLAN_SAMESHAPE)) {
+        switch (_construct_trivial_arrays(loop, mps, arg_types,
+                                          prepare, prepare_data)) {
+            case -1:
+                return -1;
+            case 1:
+                goto finish;
+            case 2:
+                goto select_method;
+        }
+    }
+
     /*
      * Only use loop dimensions when constructing Iterator:
      * temporarily replace mps[i] (will be recovered below).
@@ -1629,7 +4481,8 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
             /* still not the same -- or will we have to use buffers?*/
             if (NpyArray_TYPE(mps[i]) != arg_types[i]
                 || !NpyArray_ISBEHAVED_RO(mps[i])) {
-                if (loop->iter->size < loop->bufsize || self->core_enabled) {
+                if (loop->iter->size < loop->bufsize || self->core_enabled ||
+                    loop->where != NULL) {
                     NpyArray *newArr;
                     /*
                      * Copy the array to a temporary copy
@@ -1683,6 +4536,25 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
         }
     }
 
+    /* The mask is iterated along with the outputs */
+    if (loop->where != NULL) {
+        NpyArrayIterObject *wit;
+
+        if (loop->iter->nd == 0) {
+            wit = NpyArray_IterNew(loop->where);
+        }
+        else {
+            wit = NpyArray_BroadcastToShape(loop->where,
+                                            loop->iter->dimensions,
+                                            loop->iter->nd);
+        }
+        if (wit == NULL) {
+            return -1;
+        }
+        loop->iter->iters[self->nargs] = wit;
+    }
+
+ select_method:
     /*
      * If any of different type, or misaligned or swapped
      * then must use buffers
@@ -1746,14 +4618,23 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
                 }
             }
         }
+        if (loop->where != NULL &&
+            !loop->iter->iters[self->nargs]->contiguous &&
+            NpyArray_SIZE(loop->where) != 1 &&
+            loop->iter->iters[self->nargs]->nd_m1 > 0) {
+            loop->meth = NOBUFFER_UFUNCLOOP;
+        }
         if (loop->meth == ONE_UFUNCLOOP) {
             for (i = 0; i < self->nargs; i++) {
                 loop->bufptr[i] = NpyArray_BYTES(mps[i]);
             }
+            if (loop->where != NULL) {
+                loop->bufptr[self->nargs] = NpyArray_BYTES(loop->where);
+            }
         }
     }
 
-    loop->iter->numiter = self->nargs;
+    loop->iter->numiter = self->nargs + (loop->where != NULL);
 
     /* Fill in steps  */
     if (loop->meth == SIGNATURE_NOBUFFER_UFUNCLOOP && loop->iter->nd == 0) {
@@ -1781,20 +4662,35 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
          *
          * Thus, choose the axis for which strides of the last iterator is
          * smallest but non-zero.
+         *
+         * Without buffers the iterators can simply be rearranged so that
+         * the last axis is that one, merged with any axes which continue
+         * it in memory.  Generalized ufuncs get the merged axes as one
+         * batch, but still pick the batch axis by stride as the core
+         * data of an element is rarely contiguous with the next.
          */
-        for (i = 0; i < loop->iter->nd; i++) {
-            stride_sum[i] = 0;
-            for (j = 0; j < loop->iter->numiter; j++) {
-                stride_sum[i] += loop->iter->iters[j]->strides[i];
-            }
+        if (loop->meth == NOBUFFER_UFUNCLOOP ||
+            loop->meth == SIGNATURE_NOBUFFER_UFUNCLOOP) {
+            npy_multiiter_coalesce(loop->iter);
+        }
+        if (loop->meth == NOBUFFER_UFUNCLOOP) {
+            ldim = loop->iter->nd - 1;
         }
+        else {
+            for (i = 0; i < loop->iter->nd; i++) {
+                stride_sum[i] = 0;
+                for (j = 0; j < loop->iter->numiter; j++) {
+                    stride_sum[i] += loop->iter->iters[j]->strides[i];
+                }
+            }
 
-        ldim = loop->iter->nd - 1;
-        minsum = stride_sum[loop->iter->nd - 1];
-        for (i = loop->iter->nd - 2; i >= 0; i--) {
-            if (stride_sum[i] < minsum ) {
-                ldim = i;
-                minsum = stride_sum[i];
+            ldim = loop->iter->nd - 1;
+            minsum = stride_sum[loop->iter->nd - 1];
+            for (i = loop->iter->nd - 2; i >= 0; i--) {
+                if (stride_sum[i] < minsum ) {
+                    ldim = i;
+                    minsum = stride_sum[i];
+                }
             }
         }
         maxdim = loop->iter->dimensions[ldim];
@@ -1841,6 +4737,10 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
          * values -- if step size is already zero that is not changed...
          */
         if (loop->meth == BUFFER_UFUNCLOOP) {
+            if (loop->bufsize == NPY_BUFSIZE) {
+                loop->bufsize = NpyUFunc_GetBufferSize(
+                        _buffer_elsize(loop, arg_types, mps));
+            }
             loop->leftover = maxdim % loop->bufsize;
             loop->ninnerloops = (maxdim / loop->bufsize) + 1;
             for (i = 0; i < self->nargs; i++) {
@@ -1862,6 +4762,16 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
                                                  NpyArray_NDIM(mps[i])-1);
             }
         }
+        if (loop->where != NULL) {
+            NpyArrayIterObject *wit = loop->iter->iters[self->nargs];
+
+            if (NpyArray_SIZE(loop->where) == 1) {
+                loop->steps[self->nargs] = 0;
+            }
+            else {
+                loop->steps[self->nargs] = wit->strides[wit->nd_m1];
+            }
+        }
     }
 
     /* Finally, create memory for buffers if we need them */
@@ -1896,7 +4806,10 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
                 else {
                     scntcast += descr->elsize;
                 }
-                if (i < self->nin) {
+                if (plan != NULL && plan->cast[i] != NULL) {
+                    loop->cast[i] = plan->cast[i];
+                }
+                else if (i < self->nin) {
                     loop->cast[i] = NpyArray_GetCastFunc(NpyArray_DESCR(mps[i]),
                                                          arg_types[i]);
                 }
@@ -1918,7 +4831,8 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
             }
         }
         memsize = loop->bufsize*(cnt+cntcast) + scbufsize*(scnt+scntcast);
-        loop->buffer[0] = NpyDataMem_NEW(memsize);
+        loop->buffer[0] = NpyThreads_BufferAlloc(memsize);
+        loop->memsize = memsize;
 
         /*
          * debug
@@ -1971,6 +4885,18 @@ construct_arrays(NpyUFuncLoopObject *loop, size_t nargs, NpyArray **mps,
         }
     }
 
+    if (useplan && plan == NULL) {
+        newplan.meth = loop->meth;
+        for (i = 0; i < self->nargs; i++) {
+            newplan.cast[i] = loop->cast[i];
+        }
+        _plan_store(self, &newplan);
+    }
+
+ finish:
+    if (loop->meth != NO_UFUNCLOOP && _resolve_overlap(loop, mps) < 0) {
+        return -1;
+    }
     if (_does_loop_use_arrays(loop->funcdata)) {
         loop->funcdata = (void*)mps;
     }
@@ -2232,10 +5158,17 @@ construct_reduce(NpyUFuncObject *self, NpyArray **arr, NpyArray *out,
     if (loop->meth == BUFFER_UFUNCLOOP) {
         int _size;
 
+        if (loop->bufsize == NPY_BUFSIZE) {
+            _size = loop->outsize;
+            if (otype != NpyArray_TYPE(aar)) {
+                _size += NpyArray_ITEMSIZE(aar);
+            }
+            loop->bufsize = NpyUFunc_GetBufferSize(_size);
+        }
         loop->steps[1] = loop->outsize;
         if (otype != NpyArray_TYPE(aar)) {
             _size=loop->bufsize*(loop->outsize + NpyArray_ITEMSIZE(aar));
-            loop->buffer = NpyDataMem_NEW(_size);
+            loop->buffer = NpyThreads_BufferAlloc(_size);
             if (loop->buffer == NULL) {
                 goto fail;
             }
@@ -2251,7 +5184,7 @@ construct_reduce(NpyUFuncObject *self, NpyArray **arr, NpyArray *out,
         }
         else {
             _size = loop->bufsize * loop->outsize;
-            loop->buffer = NpyDataMem_NEW(_size);
+            loop->buffer = NpyThreads_BufferAlloc(_size);
             if (loop->buffer == NULL) {
                 goto fail;
             }
@@ -2383,6 +5316,43 @@ select_types(NpyUFuncObject *self, int *arg_types,
 
 
 
+/*
+ * Selects the inner loop a call with inputs of the given types would use.
+ * scalars holds the scalar kind of each 0-d input and NPY_NOSCALAR for
+ * the others, and is overwritten.  On success arg_types holds the types
+ * of all the loop arguments.  Used by the expression evaluator.
+ */
+int
+npy_ufunc_select_loop(NpyUFuncObject *self, int *arg_types,
+                      NPY_SCALARKIND *scalars,
+                      NpyUFuncGenericFunction *function, void **data)
+{
+    NPY_SCALARKIND maxarrkind = NPY_NOSCALAR;
+    NPY_SCALARKIND maxsckind = NPY_NOSCALAR;
+    npy_bool allscalars = NPY_TRUE;
+    int i;
+
+    for (i = 0; i < self->nin; i++) {
+        if (scalars[i] == NPY_NOSCALAR) {
+            allscalars = NPY_FALSE;
+            maxarrkind = NpyArray_MAX(NpyArray_ScalarKind(arg_types[i], NULL),
+                                      maxarrkind);
+        }
+        else {
+            maxsckind = NpyArray_MAX(scalars[i], maxsckind);
+        }
+    }
+    /* Same rule as in construct_arrays */
+    if (allscalars || (maxsckind > maxarrkind)) {
+        for (i = 0; i < self->nin; i++) {
+            scalars[i] = NPY_NOSCALAR;
+        }
+    }
+    return select_types(self, arg_types, function, data, scalars, 0, NULL);
+}
+
+
+
 NpyUFuncObject *
 npy_ufunc_frompyfunc(int nin, int nout, char *fname, size_t fname_len,
                      NpyUFuncGenericFunction *gen_funcs, void *function) {
@@ -2399,6 +5369,8 @@ npy_ufunc_frompyfunc(int nin, int nout, char *fname, size_t fname_len,
     NpyObject_Init(self, &NpyUFunc_Type);
 
     self->userloops = NULL;
+    self->mixedloops = NULL;
+    self->plans = NULL;
     self->nin = nin;
     self->nout = nout;
     self->nargs = nin + nout;
@@ -2569,6 +5541,16 @@ npy_ufunc_dealloc(NpyUFuncObject *self)
     if (NULL != self->userloops) {
         NpyDict_Destroy(self->userloops);
     }
+    while (NULL != self->mixedloops) {
+        NpyUFunc_Loop1d *next = self->mixedloops->next;
+
+        npy_free(self->mixedloops->arg_types);
+        npy_free(self->mixedloops);
+        self->mixedloops = next;
+    }
+    if (NULL != self->plans) {
+        npy_free(self->plans);
+    }
     self->nob_magic_number = NPY_INVALID_MAGIC;
     npy_free(self);
 }
@@ -2584,11 +5566,10 @@ ufuncloop_dealloc(NpyUFuncLoopObject *self)
         if (self->core_strides) {
             npy_free(self->core_strides);
         }
-        self->iter->numiter = self->ufunc->nargs;
+        self->iter->numiter = self->ufunc->nargs + (self->where != NULL);
         Npy_DECREF(self->iter);
-        if (self->buffer[0]) {
-            NpyDataMem_FREE(self->buffer[0]);
-        }
+        Npy_XDECREF(self->where);
+        NpyThreads_BufferFree(self->buffer[0]);
         NpyInterface_DECREF(self->errobj);
         Npy_DECREF(self->ufunc);
     }
@@ -2606,9 +5587,7 @@ ufuncreduce_dealloc(NpyUFuncReduceObject *self)
         Npy_XDECREF(self->ret);
         NpyInterface_DECREF(self->errobj);
         Npy_XDECREF(self->decref_arr);
-        if (self->buffer) {
-            NpyDataMem_FREE(self->buffer);
-        }
+        NpyThreads_BufferFree(self->buffer);
         Npy_DECREF(self->ufunc);
     }
     self->nob_magic_number = NPY_INVALID_MAGIC;
@@ -2618,8 +5597,8 @@ ufuncreduce_dealloc(NpyUFuncReduceObject *self)
 
 /*
  * Create copies for any arrays that are less than loop->bufsize
- * in total size (or core_enabled) and are mis-behaved or in need
- * of casting.
+ * in total size (or core_enabled or masked) and are mis-behaved or in
+ * need of casting.
  */
 static int
 _create_copies(NpyUFuncLoopObject *loop, int *arg_types, NpyArray **mps)
@@ -2644,7 +5623,8 @@ _create_copies(NpyUFuncLoopObject *loop, int *arg_types, NpyArray **mps)
             }
             Npy_DECREF(atype);
         }
-        if (size < loop->bufsize || loop->ufunc->core_enabled) {
+        if (size < loop->bufsize || loop->ufunc->core_enabled ||
+            loop->where != NULL) {
             if (!(NpyArray_ISBEHAVED_RO(mps[i]))
                 || NpyArray_TYPE(mps[i]) != arg_types[i]) {
                 NpyArray *new;
@@ -3159,6 +6139,69 @@ _does_loop_use_arrays(void *data)
 }
 
 
+/*
+ * Buffer sizing.  Buffered loops cast or copy their operands into
+ * buffers a chunk at a time.  The chunk length is chosen so that all of
+ * the buffers of a loop take up to NpyUFunc_GetBufferBytes() bytes,
+ * half of the L2 cache, which leaves room for the data the loop reads
+ * and writes directly.  A bufsize other than NPY_BUFSIZE requested
+ * through fp_error_state is used as is.
+ */
+static npy_intp npy_buffer_bytes = 0;
+
+/* Used when the size of the L2 cache is not known */
+#define NPY_DEFAULT_L2_CACHE (256 * 1024)
+
+
+/*
+ * Sets the number of bytes the buffers of a loop should take up, or
+ * selects the size computed from the cache if nbytes is 0.  Returns the
+ * previous setting.
+ */
+NDARRAY_API npy_intp
+NpyUFunc_SetBufferBytes(npy_intp nbytes)
+{
+    npy_intp old = npy_buffer_bytes;
+
+    npy_buffer_bytes = (nbytes < 0) ? 0 : nbytes;
+    return old;
+}
+
+
+NDARRAY_API npy_intp
+NpyUFunc_GetBufferBytes(void)
+{
+    npy_intp l2;
+
+    if (npy_buffer_bytes > 0) {
+        return npy_buffer_bytes;
+    }
+    l2 = NpyCPU_CacheSize(2);
+    return ((l2 > 0) ? l2 : NPY_DEFAULT_L2_CACHE) / 2;
+}
+
+
+/*
+ * Returns the number of elements a buffered loop should process at a
+ * time when its buffers take elsize bytes per element: a multiple of 16
+ * between NPY_MIN_BUFSIZE and NPY_MAX_BUFSIZE.
+ */
+NDARRAY_API int
+NpyUFunc_GetBufferSize(npy_intp elsize)
+{
+    npy_intp n = NpyUFunc_GetBufferBytes() / ((elsize > 0) ? elsize : 1);
+
+    n -= n % 16;
+    if (n < NPY_MIN_BUFSIZE) {
+        n = NPY_MIN_BUFSIZE;
+    }
+    if (n > NPY_MAX_BUFSIZE) {
+        n = NPY_MAX_BUFSIZE;
+    }
+    return (int)n;
+}
+
+
 /*
  * Floating point error handling.
  */
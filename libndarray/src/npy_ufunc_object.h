@@ -53,6 +53,7 @@ struct NpyUFuncObject {
     char *doc;
     void *ptr;
     struct NpyDict_struct *userloops;
+    struct _loop1d_info *mixedloops;   /* see NpyUFunc_RegisterMixedLoop */
 
     /* generalized ufunc */
     int core_enabled;      /* 0 for scalar ufunc; 1 for generalized ufunc */
@@ -67,6 +68,9 @@ struct NpyUFuncObject {
     int *core_offsets;     /* positions of 1st core dimensions of each
                             argument in core_dim_ixs */
     char *core_signature;  /* signature string for printing purpose */
+
+    /* cache of resolved loops, see construct_arrays */
+    struct NpyUFuncPlanCache *plans;
 };
 
 typedef struct NpyUFuncObject NpyUFuncObject;
@@ -74,6 +78,11 @@ typedef struct NpyUFuncObject NpyUFuncObject;
 
 
 extern struct NpyDict_struct *npy_create_userloops_table(void);
+extern void npy_ufunc_invalidate_plans(void);
+extern int npy_ufunc_select_loop(NpyUFuncObject *self, int *arg_types,
+                                 NPY_SCALARKIND *scalars,
+                                 NpyUFuncGenericFunction *function,
+                                 void **data);
 
 
 /* A linked-list of function information for
@@ -128,6 +137,7 @@ typedef struct NpyUFuncLoopObject {
     char *buffer[NPY_MAXARGS];
     int bufsize;
     npy_intp bufcnt;
+    int memsize;           /* Size of the block buffer[0] points to */
     char *dptr[NPY_MAXARGS];
 
     /* For casting */
@@ -154,6 +164,10 @@ typedef struct NpyUFuncLoopObject {
     npy_intp *core_dim_sizes;   /* stores sizes of core dimensions;
                                  contains 1 + core_num_dim_ix elements */
     npy_intp *core_strides;     /* strides of loop and core dimensions */
+
+    /* Boolean mask of the elements to compute, NULL for all of them.
+       Its iterator follows the outputs in iter. */
+    struct NpyArray *where;
 } NpyUFuncLoopObject;
 
 
@@ -262,6 +276,11 @@ NpyArray_GenericUnaryFunction(NpyArray *m1, NpyUFuncObject *op, NpyArray *out);
 NDARRAY_API NpyUFuncObject *NpyArray_GetNumericOp(enum NpyArray_Ops);
 NDARRAY_API int NpyArray_SetNumericOp(enum NpyArray_Ops, NpyUFuncObject *);
 
+/* Returns true if nothing but the caller refers to the array */
+typedef int (*npy_temp_elision_func)(NpyArray *ao);
+NDARRAY_API void NpyArray_SetTempElision(npy_temp_elision_func func,
+                                         npy_intp minbytes);
+
 NpyArray *
 NpyUFunc_GenericReduction(NpyUFuncObject *self, NpyArray *arr, 
                           NpyArray *indicies, NpyArray *out, int axis, 
@@ -270,11 +289,27 @@ NpyUFunc_GenericReduction(NpyUFuncObject *self, NpyArray *arr,
 NpyArray *
 NpyUFunc_Reduce(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
                 int axis, int otype);
+NpyArray *
+NpyUFunc_GenericReduceAxes(NpyUFuncObject *self, NpyArray *arr,
+                           NpyArray *out, int naxes, int *axes,
+                           NpyArray_Descr *otype);
+NpyArray *
+NpyUFunc_ReduceAxes(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
+                    int naxes, int *axes, int otype);
 int NpyUFunc_GenericFunction(NpyUFuncObject *self, int nargs, NpyArray **mps,
                              int ntypenums, int *rtypenums,
                              int originalArgWasObjArray,
                              npy_prepare_outputs_func prepare_output_func,
                              void *args);
+int NpyUFunc_GenericFunctionWhere(NpyUFuncObject *self, int nargs,
+                                  NpyArray **mps, NpyArray *where,
+                                  int ntypenums, int *rtypenums,
+                                  int originalArgWasObjArray,
+                                  npy_prepare_outputs_func prepare_output_func,
+                                  void *args);
+NpyArray *
+NpyUFunc_ScalarFunction(NpyUFuncObject *self, NpyArray *arr, int scalar_type,
+                        void *scalar, int scalar_first, NpyArray *out);
 
 NpyArray *
 NpyUFunc_Accumulate(NpyUFuncObject *self, NpyArray *arr, NpyArray *out,
@@ -292,6 +327,11 @@ NpyUFunc_RegisterLoopForType(NpyUFuncObject *ufunc,
                              NpyUFuncGenericFunction function,
                              int *arg_types,
                              void *data);
+NDARRAY_API int
+NpyUFunc_RegisterMixedLoop(NpyUFuncObject *ufunc,
+                           NpyUFuncGenericFunction function,
+                           int *arg_types,
+                           void *data);
 NDARRAY_API NpyUFuncObject *
 NpyUFunc_FromFuncAndData(NpyUFuncGenericFunction *func, void **data,
                          char *types, int ntypes,
@@ -308,6 +348,14 @@ npy_ufunc_frompyfunc(int nin, int nout, char *fname, size_t fname_len,
                      NpyUFuncGenericFunction *gen_funcs, void *function);
 void
 npy_ufunc_dealloc(NpyUFuncObject *self);
+NDARRAY_API void
+NpyUFunc_ClearPlanCache(NpyUFuncObject *self);
+NDARRAY_API npy_intp
+NpyUFunc_SetBufferBytes(npy_intp nbytes);
+NDARRAY_API npy_intp
+NpyUFunc_GetBufferBytes(void);
+NDARRAY_API int
+NpyUFunc_GetBufferSize(npy_intp elsize);
 
 
 
@@ -384,15 +432,33 @@ NpyUFunc_clearfperr(void);
 
 
 
+/*
+ * True if errmask raises or calls a function for some floating point
+ * error.  Only then the status flags are read after every inner loop
+ * call, so that the error is handled before the loop goes on.  In the
+ * other modes the flags accumulate and NPY_UFUNC_CHECK_ERROR_END reads
+ * them once for the whole call.
+ */
+#define NPY_UFUNC_ERR_CHECK_EACH(errmask)                                    \
+        ((((errmask) >> 1) & ~((errmask) >> 2) & 0x249) != 0)
+
 #define NPY_UFUNC_CHECK_ERROR(arg)                                           \
         do {if ((((arg)->obj & NPY_UFUNC_OBJ_NEEDS_API) && NpyErr_Occurred()) || \
-            ((arg)->errormask &&                                             \
+            (NPY_UFUNC_ERR_CHECK_EACH((arg)->errormask) &&                   \
              NpyUFunc_checkfperr((arg)->ufunc->name,                         \
                                  (arg)->errormask,                           \
                                  (arg)->errobj,                              \
                                 &(arg)->first)))                             \
                 goto fail;} while (0)
 
+#define NPY_UFUNC_CHECK_ERROR_END(arg)                                       \
+        do {if ((arg)->errormask &&                                          \
+                !NPY_UFUNC_ERR_CHECK_EACH((arg)->errormask))                 \
+                NpyUFunc_checkfperr((arg)->ufunc->name,                      \
+                                    (arg)->errormask,                        \
+                                    (arg)->errobj,                           \
+                                   &(arg)->first);} while (0)
+
 /* This code checks the IEEE status flags in a platform-dependent way */
 /* Adapted from Numarray  */
 
@@ -26,6 +26,7 @@ maintainer email:  oliphant.travis@ieee.org
 #include "npy_config.h"
 #include "npy_api.h"
 #include "npy_arrayobject.h"
+#include "npy_ufunc_object.h"
 
 
 static int numusertypes = 0;
@@ -214,6 +215,8 @@ NDARRAY_API int
 NpyArray_RegisterCastFunc(NpyArray_Descr *descr, int totype,
                           NpyArray_VectorUnaryFunc *castfunc)
 {
+    /* Cached ufunc plans hold on to cast functions. */
+    npy_ufunc_invalidate_plans();
     if (totype < NPY_NTYPES) {
         descr->f->cast[totype] = castfunc;
         return 0;
@@ -241,6 +244,7 @@ NDARRAY_API int
 NpyArray_RegisterCanCast(NpyArray_Descr *descr, int totype,
                          NPY_SCALARKIND scalar)
 {
+    npy_ufunc_invalidate_plans();
     if (scalar == NPY_NOSCALAR) {
         /*
          * register with cancastto
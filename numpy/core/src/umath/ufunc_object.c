@@ -756,6 +756,8 @@ PyUFunc_GenericFunction(PyUFuncObject *pySelf, PyObject *args, PyObject *kwds,
     Py_ssize_t nargs=0;
     PyObject *extobj = NULL;
     PyObject *typetup = NULL;
+    PyObject *where = NULL;
+    PyArrayObject *wherearr = NULL;
     NpyUFuncObject *self;
     int typenumbuf[NPY_MAXARGS];
     int *rtypenums = NULL;
@@ -765,7 +767,7 @@ PyUFunc_GenericFunction(PyUFuncObject *pySelf, PyObject *args, PyObject *kwds,
     int originalArgWasObjArray = 0;
 
     /*
-     * Extract sig= keyword and extobj= keyword if present.
+     * Extract sig=, extobj= and where= keywords if present.
      * Raise an error if anything else is present in the
      * keyword dictionary
      */
@@ -786,6 +788,9 @@ PyUFunc_GenericFunction(PyUFuncObject *pySelf, PyObject *args, PyObject *kwds,
             else if (strncmp(keystring,"sig",3) == 0) {
                 typetup = value;
             }
+            else if (strcmp(keystring,"where") == 0) {
+                where = value;
+            }
             else {
                 char *format = "'%s' is an invalid keyword to %s";
                 PyErr_Format(PyExc_TypeError,format,keystring, name);
@@ -827,10 +832,20 @@ PyUFunc_GenericFunction(PyUFuncObject *pySelf, PyObject *args, PyObject *kwds,
     PyUFunc_clearfperr(); 
     
     self = PyUFunc_UFUNC(pySelf);
+
+    /* The core casts the mask to bool and broadcasts it. */
+    if (where != NULL) {
+        wherearr = (PyArrayObject *)PyArray_FromAny(where, NULL, 0, 0, 0,
+                                                    NULL);
+        if (wherearr == NULL) {
+            return -1;
+        }
+    }
     
     /* Convert args to arrays in mps. */
     if ((i=convert_args(self, args, mps)) < 0) {
 /*        Py_XDECREF(errobj); */
+        Py_XDECREF(wherearr);
         return i;
     }
 
@@ -863,10 +878,13 @@ PyUFunc_GenericFunction(PyUFuncObject *pySelf, PyObject *args, PyObject *kwds,
         }
     }
 
-    result = NpyUFunc_GenericFunction(self, nargs, mpsCore, 
+    result = NpyUFunc_GenericFunctionWhere(self, nargs, mpsCore,
+                                      (wherearr != NULL) ?
+                                      PyArray_ARRAY(wherearr) : NULL,
                                       ntypenums, rtypenums,
                                       originalArgWasObjArray,
                                       (npy_prepare_outputs_func)prepare_outputs, args);
+    Py_XDECREF(wherearr);
 
     for (i=0; i < self->nargs; i++) {
         if (NULL == mpsCore[i]) mps[i] = NULL;
@@ -1384,6 +1402,7 @@ NpyUFunc_ReplaceLoopBySignature(NpyUFuncObject *func,
             *oldfunc = func->functions[i];
         }
         func->functions[i] = newfunc;
+        NpyUFunc_ClearPlanCache(func);
         res = 0;
         break;
     }
@@ -643,6 +643,36 @@ class TestMethods(TestCase):
         assert_equal(a.ravel(), a.reshape(-1))
         assert_equal(a.ravel(order='A'), a.reshape(-1, order='A'))
 
+    def test_copy_transposing(self):
+        # copies between C and Fortran order go through cache-sized tiles,
+        # check sizes which are not a multiple of the tile in every type
+        for dt in [np.int16, np.float32, np.int32, np.float64, np.int64]:
+            for shape in [(33, 35), (65, 127), (100, 37), (3, 40)]:
+                n = shape[0] * shape[1]
+                a = np.arange(n, dtype=dt).reshape(shape)
+                rows = a.tolist()
+                cols = [list(c) for c in zip(*rows)]
+                msg = "%s %s" % (np.dtype(dt), shape)
+
+                b = a.copy('F')
+                assert_(b.flags.f_contiguous, msg)
+                assert_equal(b.tolist(), rows, err_msg=msg)
+                assert_equal(a.ravel('F').tolist(), [x for c in cols for x in c],
+                             err_msg=msg)
+                assert_equal(a.transpose().copy().tolist(), cols,
+                             err_msg=msg)
+                assert_equal(b.copy().tolist(), rows, err_msg=msg)
+                d = np.empty(shape, dtype=dt)
+                d[...] = b
+                assert_equal(d.tolist(), rows, err_msg=msg)
+
+                # strided source
+                c = a[::2, 1:]
+                crows = [r[1:] for r in rows[::2]]
+                assert_equal(c.copy('F').tolist(), crows, err_msg=msg)
+                assert_equal(c.transpose().copy().tolist(),
+                             [list(x) for x in zip(*crows)], err_msg=msg)
+
 
 
 class TestSubscripting(TestCase):
@@ -587,5 +587,130 @@ class TestUfunc(TestCase):
 
         assert_equal(ref, True, err_msg="reference check")
 
+    def test_cached_plan_sizes(self):
+        # a small mixed type call is cast up front, a large one is
+        # buffered, the loop plan cached for one must not be used for
+        # the other
+        for n in [10, 10000, 10]:
+            r = np.add(np.ones(n, np.int8), 0.5)
+            assert_equal(r.dtype, np.dtype(np.double))
+            assert_array_equal(r, 1.5)
+            a = np.arange(n).astype(np.int8)
+            r = np.not_equal(a, np.array(0))
+            assert_array_equal(r, a.astype(np.int_) != 0)
+
+    def test_overlapping_inputs(self):
+        # results are as if all inputs were read before any output is written
+        for n in [10, 10000]:
+            a = np.arange(n, dtype=np.double)
+            b = a.copy()
+            a[1:] += a[:-1]
+            assert_array_equal(a[1:], b[1:] + b[:-1])
+            assert_equal(a[0], b[0])
+
+            a = b.copy()
+            a[:-1] += a[1:]
+            assert_array_equal(a[:-1], b[:-1] + b[1:])
+            assert_equal(a[-1], b[-1])
+
+            # buffered by the cast of the second operand
+            a = b.copy()
+            np.add(a[:-1], np.ones(n-1, dtype=np.int32), a[1:])
+            assert_array_equal(a[1:], b[:-1] + 1)
+
+    def test_overlapping_inputs_strides(self):
+        n = 1000
+        b = np.arange(n, dtype=np.double)
+        a = b.copy()
+        np.add(a[:n//2], 1, a[::2])
+        assert_array_equal(a[::2], b[:n//2] + 1)
+        assert_array_equal(a[1::2], b[1::2])
+
+        a = b.copy()
+        np.add(a[::2], 1, a[:n//2])
+        assert_array_equal(a[:n//2], b[::2] + 1)
+
+        a = b.copy()
+        a[:-2] += a[::-1][2:]
+        assert_array_equal(a[:-2], b[:-2] + b[::-1][2:])
+
+        x = np.arange(100.).reshape(10, 10)
+        y = x.copy()
+        np.add(x[0,:], x[:,0], x[0,:])
+        assert_array_equal(x[0,:], y[0,:] + y[:,0])
+        assert_array_equal(x[1:], y[1:])
+
+        x = y.copy()
+        x += x.T
+        assert_array_equal(x, y + y.T)
+
+    @dec.skipif(sys.platform == 'cli',
+        "subprocesses are not used on IronPython")
+    def test_reduce_threads(self):
+        # long rows are split the same way whatever the number of threads
+        import os
+        import subprocess
+        code = ("import numpy as np; a = np.ones(1000003); a[0] = 1e16; "
+                "b = np.ones((3, 100000)); b[:,0] = 1e16; "
+                "print repr(np.add.reduce(a)), repr(np.add.reduce(b, 1))")
+        results = []
+        for n in ['1', '2', '4', '8']:
+            env = dict(os.environ)
+            env['NPY_NUM_THREADS'] = n
+            p = subprocess.Popen([sys.executable, '-c', code], env=env,
+                                 stdout=subprocess.PIPE)
+            results.append(p.communicate()[0])
+            assert_equal(p.returncode, 0)
+        assert_equal(results, [results[0]] * len(results))
+
+    def test_where(self):
+        # only the elements where the mask is true are computed
+        a = np.arange(12.).reshape(3, 4)
+        out = -np.ones((3, 4))
+        np.add(a, 1, out, where=[True, False, True, False])
+        assert_array_equal(out[:,::2], a[:,::2] + 1)
+        assert_array_equal(out[:,1::2], -1)
+
+        out = -np.ones((3, 4))
+        np.multiply(a, 2, out, where=np.array([[True], [False], [True]]))
+        assert_array_equal(out[::2], a[::2] * 2)
+        assert_array_equal(out[1], -1)
+
+        out = -np.ones((3, 4))
+        np.add(a, 1, out, where=np.array([[1], [0], [0]]))
+        assert_array_equal(out[0], a[0] + 1)
+        assert_array_equal(out[1:], -1)
+
+    def test_where_buffered(self):
+        # mixed types and a byteswapped operand go through buffers
+        n = 20001
+        a = np.arange(n, dtype=np.int16)
+        b = np.arange(n, dtype=np.float32)
+        b = b.astype(b.dtype.newbyteorder())
+        mask = (np.arange(n) % 3) == 0
+        out = -np.ones(n)
+        np.add(a, b, out, where=mask)
+        assert_array_equal(out[mask], (a + b)[mask])
+        assert_array_equal(out[~mask], -1)
+
+    @dec.skipif(sys.platform == 'cli',
+        "subprocesses are not used on IronPython")
+    def test_where_threads(self):
+        # masked elements are left alone when the loop is split
+        import os
+        import subprocess
+        code = ("import numpy as np; n = 200001; "
+                "a = np.arange(n, dtype=np.double); m = (np.arange(n) % 7) < 3; "
+                "o = -np.ones(n); np.add(a, 1, o, where=m); "
+                "p = -np.ones(n); np.add(a.astype(np.int16), 1, p, where=m); "
+                "print (o[m] == a[m] + 1).all() and (o[~m] == -1).all(), "
+                "(p[m] == a.astype(np.int16)[m] + 1).all() and "
+                "(p[~m] == -1).all()")
+        env = dict(os.environ)
+        env['NPY_NUM_THREADS'] = '4'
+        p = subprocess.Popen([sys.executable, '-c', code], env=env,
+                             stdout=subprocess.PIPE)
+        assert_equal(p.communicate()[0].split(), ['True', 'True'])
+
 if __name__ == "__main__":
     run_module_suite()
@@ -1140,5 +1140,59 @@ def test_complex_nan_comparisons():
             assert_equal(x >= y, False, err_msg="%r >= %r" % (x, y))
             assert_equal(x == y, False, err_msg="%r == %r" % (x, y))
 
+class TestMixedLoops(TestCase):
+    # double arithmetic with an int, long or float operand has loops which
+    # read that operand without casting it, these must give the results of
+    # casting it to double first
+    ufuncs = [np.add, np.subtract, np.multiply, np.divide, np.true_divide]
+
+    def setUp(self):
+        n = 37
+        self.other = [
+            np.resize(np.array([0, 1, -1, 7, -13, 2**31-1, -2**31],
+                               dtype=np.int32), n),
+            np.resize(np.array([0, 3, -5, 2**53+1, -2**62, 2**31],
+                               dtype=np.long), n),
+            np.resize(np.array([0, 1.5, -0.0, 3.3, 1e30, -7e-3],
+                               dtype=np.float32), n),
+            ]
+        self.double = np.arange(n) * 0.75 - 13.1
+
+    def check(self, x, y, msg):
+        err = np.seterr(all='ignore')
+        try:
+            for f in self.ufuncs:
+                r = f(x, y)
+                e = f(x.astype(np.double), y.astype(np.double))
+                m = "%s %s" % (f.__name__, msg)
+                assert_equal(r.dtype, np.dtype(np.double), err_msg=m)
+                assert_array_equal(r, e, err_msg=m)
+        finally:
+            np.seterr(**err)
+
+    def test_pairings(self):
+        d = self.double
+        for o in self.other:
+            self.check(o, d, "%s, double" % o.dtype)
+            self.check(d, o, "double, %s" % o.dtype)
+            self.check(o[1::2], d[1::2], "strided %s, double" % o.dtype)
+            self.check(d.reshape(1, -1), o.reshape(-1, 1),
+                       "broadcast double, %s" % o.dtype)
+
+    def test_byteswapped(self):
+        o = self.other[0]
+        s = o.astype(o.dtype.newbyteorder())
+        assert_array_equal(s, o)
+        self.check(s, self.double, "byteswapped int32, double")
+        self.check(self.double, s, "double, byteswapped int32")
+
+    def test_misaligned(self):
+        o = self.other[0]
+        m = np.zeros(o.nbytes + 1, dtype=np.uint8)[1:].view(np.int32)
+        m[...] = o
+        assert_(not m.flags.aligned)
+        self.check(m, self.double, "misaligned int32, double")
+        self.check(self.double, m, "double, misaligned int32")
+
 if __name__ == "__main__":
     run_module_suite()